@@ -0,0 +1,665 @@
+/**
+ * Copyright (c) 2008-2015 Alper Akcan <alper.akcan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the fuse-ext2
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "fuse-ext2.h"
+
+/*
+ * io manager with an lru block cache, layered over unix_io_manager.
+ * unix_io caches only a handful of blocks and reads and writes them
+ * one by one. here misses are read in runs, with read-ahead when the
+ * access is sequential, and dirty blocks are written back in runs of
+ * adjacent blocks. the cache of the backing channel is turned off.
+ *
+ * the cache has its own lock, it is safe to use outside the fs lock.
+ */
+
+/* longest run written back or read from the backing channel at once */
+#define CACHEIO_MAX_RUN 256
+
+struct cblock {
+	blk64_t blk;
+	time_t dirty;
+	struct cblock *hnext;
+	struct cblock *prev;
+	struct cblock *next;
+	char data[];
+};
+
+struct cache_private {
+	io_channel real;
+	pthread_mutex_t lock;
+	struct cblock **hash;
+	unsigned long nhash;
+	/* lru list, most recently used first */
+	struct cblock lru;
+	unsigned long count;
+	unsigned long max;
+	unsigned long ndirty;
+	/* sequential read detection */
+	blk64_t seq_next;
+	unsigned long ra_window;
+	unsigned long ra_max;
+	struct cacheio_stats stats;
+};
+
+static size_t cache_bytes = 64 * 1024 * 1024;
+static size_t cache_readahead_bytes = 512 * 1024;
+
+void do_cacheio_setup (size_t size, size_t readahead)
+{
+	cache_bytes = size;
+	cache_readahead_bytes = readahead;
+}
+
+static struct cblock ** cache_find (struct cache_private *p, blk64_t blk)
+{
+	struct cblock **pp;
+
+	for (pp = &p->hash[blk % p->nhash]; *pp != NULL; pp = &(*pp)->hnext) {
+		if ((*pp)->blk == blk) {
+			break;
+		}
+	}
+	return pp;
+}
+
+static struct cblock * cache_lookup (struct cache_private *p, blk64_t blk)
+{
+	return *cache_find(p, blk);
+}
+
+static void cache_touch (struct cache_private *p, struct cblock *b)
+{
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+	b->next = p->lru.next;
+	b->prev = &p->lru;
+	p->lru.next->prev = b;
+	p->lru.next = b;
+}
+
+static void cache_drop (struct cache_private *p, struct cblock *b)
+{
+	struct cblock **pp;
+
+	pp = cache_find(p, b->blk);
+	*pp = b->hnext;
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+	if (b->dirty) {
+		p->ndirty--;
+	}
+	p->count--;
+	free(b);
+}
+
+/* write b and the dirty blocks adjacent to it in one request */
+static errcode_t cache_writeback_run (io_channel channel, struct cblock *b)
+{
+	int i;
+	int n;
+	char *buf;
+	blk64_t start;
+	errcode_t rc;
+	struct cblock *c;
+	struct cblock *run[CACHEIO_MAX_RUN];
+	struct cache_private *p = channel->private_data;
+
+	start = b->blk;
+	n = 1;
+	while (n < CACHEIO_MAX_RUN / 2 && start > 0 &&
+	       (c = cache_lookup(p, start - 1)) != NULL && c->dirty) {
+		start--;
+		n++;
+	}
+	for (i = 0; i < n; i++) {
+		run[i] = cache_lookup(p, start + i);
+	}
+	while (n < CACHEIO_MAX_RUN &&
+	       (c = cache_lookup(p, start + n)) != NULL && c->dirty) {
+		run[n++] = c;
+	}
+
+	buf = malloc((size_t) n * channel->block_size);
+	if (buf == NULL) {
+		return EXT2_ET_NO_MEMORY;
+	}
+	for (i = 0; i < n; i++) {
+		memcpy(buf + (size_t) i * channel->block_size, run[i]->data, channel->block_size);
+	}
+	rc = io_channel_write_blk64(p->real, start, n, buf);
+	free(buf);
+	if (rc) {
+		return rc;
+	}
+	for (i = 0; i < n; i++) {
+		run[i]->dirty = 0;
+	}
+	p->ndirty -= n;
+	p->stats.writebacks++;
+	p->stats.written += n;
+	return 0;
+}
+
+/* write back the blocks dirtied at or before older */
+static errcode_t cache_writeback (io_channel channel, time_t older)
+{
+	errcode_t rc;
+	errcode_t ret;
+	struct cblock *b;
+	struct cache_private *p = channel->private_data;
+
+	ret = 0;
+	for (b = p->lru.next; b != &p->lru && p->ndirty > 0; b = b->next) {
+		if (b->dirty == 0 || b->dirty > older) {
+			continue;
+		}
+		rc = cache_writeback_run(channel, b);
+		if (rc) {
+			ret = rc;
+		}
+	}
+	return ret;
+}
+
+/* write back and forget the blocks that overlap [blk, blk + count) */
+static errcode_t cache_invalidate (io_channel channel, blk64_t blk, unsigned long long count, int writeback)
+{
+	errcode_t rc;
+	struct cblock *b;
+	struct cblock *n;
+	unsigned long long i;
+	struct cache_private *p = channel->private_data;
+
+	/* large ranges (discard) walk the cache instead of the range */
+	if (count > p->count) {
+		for (b = p->lru.next; b != &p->lru; b = n) {
+			if (b->blk < blk || b->blk - blk >= count) {
+				n = b->next;
+				continue;
+			}
+			if (b->dirty && writeback) {
+				rc = cache_writeback_run(channel, b);
+				if (rc) {
+					return rc;
+				}
+			}
+			n = b->next;
+			cache_drop(p, b);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		b = cache_lookup(p, blk + i);
+		if (b == NULL) {
+			continue;
+		}
+		if (b->dirty && writeback) {
+			rc = cache_writeback_run(channel, b);
+			if (rc) {
+				return rc;
+			}
+		}
+		cache_drop(p, b);
+	}
+	return 0;
+}
+
+static struct cblock * cache_insert (io_channel channel, blk64_t blk)
+{
+	struct cblock *b;
+	struct cblock **pp;
+	struct cache_private *p = channel->private_data;
+
+	while (p->count >= p->max) {
+		b = p->lru.prev;
+		if (b->dirty && cache_writeback_run(channel, b) != 0) {
+			return NULL;
+		}
+		cache_drop(p, b);
+	}
+	b = malloc(sizeof(struct cblock) + channel->block_size);
+	if (b == NULL) {
+		return NULL;
+	}
+	b->blk = blk;
+	b->dirty = 0;
+	pp = &p->hash[blk % p->nhash];
+	b->hnext = *pp;
+	*pp = b;
+	b->next = p->lru.next;
+	b->prev = &p->lru;
+	p->lru.next->prev = b;
+	p->lru.next = b;
+	p->count++;
+	return b;
+}
+
+static errcode_t cache_resize (io_channel channel)
+{
+	struct cblock **hash;
+	struct cache_private *p = channel->private_data;
+
+	p->max = cache_bytes / channel->block_size;
+	if (p->max < CACHEIO_MAX_RUN) {
+		p->max = CACHEIO_MAX_RUN;
+	}
+	p->nhash = p->max / 2 + 1;
+	hash = calloc(p->nhash, sizeof(struct cblock *));
+	if (hash == NULL) {
+		return EXT2_ET_NO_MEMORY;
+	}
+	free(p->hash);
+	p->hash = hash;
+	p->ra_max = cache_readahead_bytes / channel->block_size;
+	if (p->ra_max > CACHEIO_MAX_RUN) {
+		p->ra_max = CACHEIO_MAX_RUN;
+	}
+	p->ra_window = 0;
+	return 0;
+}
+
+static errcode_t cache_open (const char *name, int flags, io_channel *channel)
+{
+	errcode_t rc;
+	io_channel io;
+	struct cache_private *p;
+
+	rc = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+	if (rc) {
+		return rc;
+	}
+	rc = ext2fs_get_memzero(sizeof(struct cache_private), &p);
+	if (rc) {
+		ext2fs_free_mem(&io);
+		return rc;
+	}
+	rc = unix_io_manager->open(name, flags, &p->real);
+	if (rc) {
+		ext2fs_free_mem(&p);
+		ext2fs_free_mem(&io);
+		return rc;
+	}
+	/* caching twice only costs memory */
+	if (p->real->manager->set_option) {
+		p->real->manager->set_option(p->real, "cache", "off");
+	}
+
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	io->manager = cache_io_manager;
+	io->name = strdup(name);
+	io->block_size = p->real->block_size;
+	io->align = p->real->align;
+	io->refcount = 1;
+	io->private_data = p;
+	pthread_mutex_init(&p->lock, NULL);
+	p->lru.next = &p->lru;
+	p->lru.prev = &p->lru;
+	rc = cache_resize(io);
+	if (io->name == NULL || rc) {
+		io_channel_close(p->real);
+		free(io->name);
+		ext2fs_free_mem(&p);
+		ext2fs_free_mem(&io);
+		return EXT2_ET_NO_MEMORY;
+	}
+	*channel = io;
+	return 0;
+}
+
+static errcode_t cache_close (io_channel channel)
+{
+	errcode_t rc;
+	errcode_t rc2;
+	struct cblock *b;
+	struct cblock *n;
+	struct cache_private *p = channel->private_data;
+
+	if (--channel->refcount > 0) {
+		return 0;
+	}
+	rc = cache_writeback(channel, time(NULL));
+	for (b = p->lru.next; b != &p->lru; b = n) {
+		n = b->next;
+		free(b);
+	}
+	rc2 = io_channel_close(p->real);
+	if (rc == 0) {
+		rc = rc2;
+	}
+	pthread_mutex_destroy(&p->lock);
+	free(p->hash);
+	free(channel->name);
+	ext2fs_free_mem(&p);
+	ext2fs_free_mem(&channel);
+	return rc;
+}
+
+static errcode_t cache_set_blksize (io_channel channel, int blksize)
+{
+	errcode_t rc;
+	struct cblock *b;
+	struct cache_private *p = channel->private_data;
+
+	if (channel->block_size == blksize) {
+		return 0;
+	}
+	pthread_mutex_lock(&p->lock);
+	rc = cache_writeback(channel, time(NULL));
+	if (rc == 0) {
+		while ((b = p->lru.next) != &p->lru) {
+			cache_drop(p, b);
+		}
+		rc = io_channel_set_blksize(p->real, blksize);
+	}
+	if (rc == 0) {
+		channel->block_size = blksize;
+		rc = cache_resize(channel);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return rc;
+}
+
+static errcode_t cache_read_blk64 (io_channel channel, unsigned long long block, int count, void *data)
+{
+	int i;
+	int j;
+	int n;
+	int ra;
+	char *buf;
+	errcode_t rc;
+	struct cblock *b;
+	size_t bs = channel->block_size;
+	struct cache_private *p = channel->private_data;
+
+	pthread_mutex_lock(&p->lock);
+
+	/* byte sized reads (the super block) bypass the cache */
+	if (count < 0) {
+		rc = cache_invalidate(channel, block, (-count + bs - 1) / bs, 1);
+		if (rc == 0) {
+			rc = io_channel_read_blk64(p->real, block, count, data);
+		}
+		pthread_mutex_unlock(&p->lock);
+		return rc;
+	}
+
+	if (block == p->seq_next) {
+		p->ra_window = p->ra_window ? p->ra_window * 2 : (unsigned long) count;
+		if (p->ra_window > p->ra_max) {
+			p->ra_window = p->ra_max;
+		}
+	} else {
+		p->ra_window = 0;
+	}
+	p->seq_next = block + count;
+
+	rc = 0;
+	for (i = 0; i < count && rc == 0; i = j) {
+		b = cache_lookup(p, block + i);
+		if (b != NULL) {
+			memcpy((char *) data + i * bs, b->data, bs);
+			cache_touch(p, b);
+			p->stats.hits++;
+			j = i + 1;
+			continue;
+		}
+
+		/* read the whole run of missing blocks, plus read-ahead at the end */
+		for (j = i + 1; j < count && j - i < CACHEIO_MAX_RUN && cache_lookup(p, block + j) == NULL; j++)
+			;
+		n = j - i;
+		ra = 0;
+		if (j == count) {
+			while ((unsigned long) ra < p->ra_window && n + ra < CACHEIO_MAX_RUN &&
+			       cache_lookup(p, block + j + ra) == NULL) {
+				ra++;
+			}
+		}
+		buf = malloc((n + ra) * bs);
+		if (buf == NULL) {
+			rc = EXT2_ET_NO_MEMORY;
+			break;
+		}
+		rc = io_channel_read_blk64(p->real, block + i, n + ra, buf);
+		if (rc && ra > 0) {
+			/* read-ahead past the end of the device */
+			ra = 0;
+			rc = io_channel_read_blk64(p->real, block + i, n, buf);
+		}
+		if (rc == 0) {
+			memcpy((char *) data + i * bs, buf, n * bs);
+			for (n = 0; n < j - i + ra; n++) {
+				b = cache_insert(channel, block + i + n);
+				if (b == NULL) {
+					break;
+				}
+				memcpy(b->data, buf + n * bs, bs);
+			}
+			p->stats.misses += j - i;
+			p->stats.readahead += ra;
+		}
+		free(buf);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+	return rc;
+}
+
+static errcode_t cache_write_blk64 (io_channel channel, unsigned long long block, int count, const void *data)
+{
+	int i;
+	time_t now;
+	errcode_t rc;
+	struct cblock *b;
+	size_t bs = channel->block_size;
+	struct cache_private *p = channel->private_data;
+
+	pthread_mutex_lock(&p->lock);
+
+	if (count < 0) {
+		rc = cache_invalidate(channel, block, (-count + bs - 1) / bs, 1);
+		if (rc == 0) {
+			rc = io_channel_write_blk64(p->real, block, count, data);
+		}
+		pthread_mutex_unlock(&p->lock);
+		return rc;
+	}
+
+	if (channel->flags & CHANNEL_FLAGS_WRITETHROUGH) {
+		rc = cache_invalidate(channel, block, count, 0);
+		if (rc == 0) {
+			rc = io_channel_write_blk64(p->real, block, count, data);
+		}
+		pthread_mutex_unlock(&p->lock);
+		return rc;
+	}
+
+	now = time(NULL);
+	for (i = 0; i < count; i++) {
+		b = cache_lookup(p, block + i);
+		if (b == NULL) {
+			b = cache_insert(channel, block + i);
+		}
+		if (b == NULL) {
+			/* no memory for the cache, write the rest through */
+			rc = io_channel_write_blk64(p->real, block + i, count - i, (const char *) data + i * bs);
+			pthread_mutex_unlock(&p->lock);
+			return rc;
+		}
+		memcpy(b->data, (const char *) data + i * bs, bs);
+		if (b->dirty == 0) {
+			b->dirty = now;
+			p->ndirty++;
+		}
+		cache_touch(p, b);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+static errcode_t cache_read_blk (io_channel channel, unsigned long block, int count, void *data)
+{
+	return cache_read_blk64(channel, block, count, data);
+}
+
+static errcode_t cache_write_blk (io_channel channel, unsigned long block, int count, const void *data)
+{
+	return cache_write_blk64(channel, block, count, data);
+}
+
+static errcode_t cache_write_byte (io_channel channel, unsigned long offset, int size, const void *data)
+{
+	errcode_t rc;
+	struct cache_private *p = channel->private_data;
+
+	if (p->real->manager->write_byte == NULL) {
+		return EXT2_ET_UNIMPLEMENTED;
+	}
+	pthread_mutex_lock(&p->lock);
+	rc = cache_invalidate(channel, offset / channel->block_size,
+			(offset % channel->block_size + size + channel->block_size - 1) / channel->block_size, 1);
+	if (rc == 0) {
+		rc = io_channel_write_byte(p->real, offset, size, data);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return rc;
+}
+
+static errcode_t cache_flush (io_channel channel)
+{
+	errcode_t rc;
+	struct cache_private *p = channel->private_data;
+
+	pthread_mutex_lock(&p->lock);
+	rc = cache_writeback(channel, time(NULL));
+	if (rc == 0) {
+		rc = io_channel_flush(p->real);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return rc;
+}
+
+static errcode_t cache_set_option (io_channel channel, const char *option, const char *arg)
+{
+	struct cache_private *p = channel->private_data;
+
+	if (p->real->manager->set_option == NULL) {
+		return EXT2_ET_INVALID_ARGUMENT;
+	}
+	return p->real->manager->set_option(p->real, option, arg);
+}
+
+static errcode_t cache_get_stats (io_channel channel, io_stats *stats)
+{
+	struct cache_private *p = channel->private_data;
+
+	if (p->real->manager->get_stats == NULL) {
+		return EXT2_ET_UNIMPLEMENTED;
+	}
+	return p->real->manager->get_stats(p->real, stats);
+}
+
+static errcode_t cache_discard (io_channel channel, unsigned long long block, unsigned long long count)
+{
+	errcode_t rc;
+	struct cache_private *p = channel->private_data;
+
+	if (p->real->manager->discard == NULL) {
+		return EXT2_ET_UNIMPLEMENTED;
+	}
+	pthread_mutex_lock(&p->lock);
+	rc = cache_invalidate(channel, block, count, 0);
+	if (rc == 0) {
+		rc = p->real->manager->discard(p->real, block, count);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return rc;
+}
+
+static errcode_t cache_zeroout (io_channel channel, unsigned long long block, unsigned long long count)
+{
+	errcode_t rc;
+	struct cache_private *p = channel->private_data;
+
+	if (p->real->manager->zeroout == NULL) {
+		return EXT2_ET_UNIMPLEMENTED;
+	}
+	pthread_mutex_lock(&p->lock);
+	rc = cache_invalidate(channel, block, count, 0);
+	if (rc == 0) {
+		rc = p->real->manager->zeroout(p->real, block, count);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return rc;
+}
+
+static struct struct_io_manager struct_cache_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "fuse-ext2 cache I/O Manager",
+	.open		= cache_open,
+	.close		= cache_close,
+	.set_blksize	= cache_set_blksize,
+	.read_blk	= cache_read_blk,
+	.write_blk	= cache_write_blk,
+	.flush		= cache_flush,
+	.write_byte	= cache_write_byte,
+	.set_option	= cache_set_option,
+	.get_stats	= cache_get_stats,
+	.read_blk64	= cache_read_blk64,
+	.write_blk64	= cache_write_blk64,
+	.discard	= cache_discard,
+	.zeroout	= cache_zeroout,
+};
+
+io_manager cache_io_manager = &struct_cache_manager;
+
+/* write back blocks dirty since older, without syncing the device */
+errcode_t do_cacheio_writeback (io_channel channel, time_t older)
+{
+	errcode_t rc;
+	struct cache_private *p;
+
+	if (channel->manager != cache_io_manager) {
+		return 0;
+	}
+	p = channel->private_data;
+	pthread_mutex_lock(&p->lock);
+	rc = cache_writeback(channel, older);
+	pthread_mutex_unlock(&p->lock);
+	return rc;
+}
+
+int do_cacheio_get_stats (io_channel channel, struct cacheio_stats *stats)
+{
+	struct cache_private *p;
+
+	if (channel->manager != cache_io_manager) {
+		return -1;
+	}
+	p = channel->private_data;
+	pthread_mutex_lock(&p->lock);
+	*stats = p->stats;
+	stats->cached = p->count;
+	stats->dirty = p->ndirty;
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
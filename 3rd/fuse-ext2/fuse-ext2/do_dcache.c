@@ -0,0 +1,199 @@
+/**
+ * Copyright (c) 2008-2015 Alper Akcan <alper.akcan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the fuse-ext2
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "fuse-ext2.h"
+
+/*
+ * name lookup cache, (parent inode, name) -> inode. ino 0 marks a
+ * negative entry, a name known not to exist. entries are keyed by the
+ * parent inode and not by path, so renaming a directory leaves the
+ * entries below it valid. every access is made with iolock held, see
+ * do_readinode(), or with the fs lock exclusive, so the cache needs no
+ * lock of its own.
+ */
+
+#define DCACHE_HASH 4096
+#define DCACHE_SIZE 16384
+
+struct dentry {
+	ext2_ino_t parent;
+	ext2_ino_t ino;
+	struct dentry *hnext;
+	struct dentry *prev;
+	struct dentry *next;
+	int len;
+	char name[];
+};
+
+struct extfs_dcache {
+	struct dentry *hash[DCACHE_HASH];
+	/* lru list, most recently used first */
+	struct dentry lru;
+	int count;
+};
+
+static unsigned int dentry_hash (ext2_ino_t parent, const char *name, int len)
+{
+	int i;
+	unsigned int h = 2166136261U ^ parent;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char) name[i]) * 16777619U;
+	}
+	return h % DCACHE_HASH;
+}
+
+static struct dentry ** dentry_find (struct extfs_dcache *dcache, ext2_ino_t parent, const char *name, int len)
+{
+	struct dentry **pp;
+
+	for (pp = &dcache->hash[dentry_hash(parent, name, len)]; *pp != NULL; pp = &(*pp)->hnext) {
+		if ((*pp)->parent == parent && (*pp)->len == len && memcmp((*pp)->name, name, len) == 0) {
+			break;
+		}
+	}
+	return pp;
+}
+
+static void dentry_unlink (struct extfs_dcache *dcache, struct dentry **pp)
+{
+	struct dentry *d = *pp;
+
+	*pp = d->hnext;
+	d->prev->next = d->next;
+	d->next->prev = d->prev;
+	dcache->count--;
+	free(d);
+}
+
+static void dentry_touch (struct extfs_dcache *dcache, struct dentry *d)
+{
+	d->prev->next = d->next;
+	d->next->prev = d->prev;
+	d->next = dcache->lru.next;
+	d->prev = &dcache->lru;
+	dcache->lru.next->prev = d;
+	dcache->lru.next = d;
+}
+
+int do_dcache_init (struct extfs_data *e2data)
+{
+	struct extfs_dcache *dcache;
+
+	dcache = calloc(1, sizeof(struct extfs_dcache));
+	if (dcache == NULL) {
+		return -ENOMEM;
+	}
+	dcache->lru.next = &dcache->lru;
+	dcache->lru.prev = &dcache->lru;
+	e2data->dcache = dcache;
+	return 0;
+}
+
+void do_dcache_free (struct extfs_data *e2data)
+{
+	struct dentry *d;
+	struct dentry *n;
+	struct extfs_dcache *dcache = e2data->dcache;
+
+	if (dcache == NULL) {
+		return;
+	}
+	for (d = dcache->lru.next; d != &dcache->lru; d = n) {
+		n = d->next;
+		free(d);
+	}
+	free(dcache);
+	e2data->dcache = NULL;
+}
+
+int do_dcache_lookup (struct extfs_data *e2data, ext2_ino_t parent, const char *name, int len, ext2_ino_t *ino)
+{
+	struct dentry **pp;
+
+	pp = dentry_find(e2data->dcache, parent, name, len);
+	if (*pp == NULL) {
+		return 0;
+	}
+	dentry_touch(e2data->dcache, *pp);
+	*ino = (*pp)->ino;
+	return 1;
+}
+
+void do_dcache_add (struct extfs_data *e2data, ext2_ino_t parent, const char *name, int len, ext2_ino_t ino)
+{
+	struct dentry *d;
+	struct dentry **pp;
+	struct extfs_dcache *dcache = e2data->dcache;
+
+	pp = dentry_find(dcache, parent, name, len);
+	if (*pp != NULL) {
+		(*pp)->ino = ino;
+		dentry_touch(dcache, *pp);
+		return;
+	}
+	if (dcache->count >= DCACHE_SIZE) {
+		d = dcache->lru.prev;
+		dentry_unlink(dcache, dentry_find(dcache, d->parent, d->name, d->len));
+	}
+	d = malloc(sizeof(struct dentry) + len);
+	if (d == NULL) {
+		return;
+	}
+	d->parent = parent;
+	d->ino = ino;
+	d->len = len;
+	memcpy(d->name, name, len);
+	pp = &dcache->hash[dentry_hash(parent, name, len)];
+	d->hnext = *pp;
+	*pp = d;
+	d->next = dcache->lru.next;
+	d->prev = &dcache->lru;
+	dcache->lru.next->prev = d;
+	dcache->lru.next = d;
+	dcache->count++;
+}
+
+void do_dcache_remove (struct extfs_data *e2data, ext2_ino_t parent, const char *name)
+{
+	struct dentry **pp;
+
+	pp = dentry_find(e2data->dcache, parent, name, strlen(name));
+	if (*pp != NULL) {
+		dentry_unlink(e2data->dcache, pp);
+	}
+}
+
+void do_dcache_purge_dir (struct extfs_data *e2data, ext2_ino_t parent)
+{
+	int i;
+	struct dentry **pp;
+	struct extfs_dcache *dcache = e2data->dcache;
+
+	/* a removed directory inode may be reused, drop what was cached under it */
+	for (i = 0; i < DCACHE_HASH; i++) {
+		for (pp = &dcache->hash[i]; *pp != NULL; ) {
+			if ((*pp)->parent == parent) {
+				dentry_unlink(dcache, pp);
+			} else {
+				pp = &(*pp)->hnext;
+			}
+		}
+	}
+}
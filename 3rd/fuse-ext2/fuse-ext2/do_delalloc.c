@@ -0,0 +1,339 @@
+/**
+ * Copyright (c) 2008-2015 Alper Akcan <alper.akcan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the fuse-ext2
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "fuse-ext2.h"
+
+/*
+ * delayed allocation. writes to files that are not inline are held in a
+ * per inode buffer, covering one contiguous byte range, instead of going
+ * block by block through ext2fs_file_write(), which allocates and writes
+ * each block as it fills up. the buffer is written out when a write does
+ * not continue it, when it reaches DELALLOC_SIZE, before the file is
+ * truncated, and on flush, fsync, release and by the flusher thread.
+ * reads copy the buffered bytes over what they find on disk, they run
+ * under the shared fs lock and must not allocate. the buffer only
+ * changes under the exclusive lock.
+ *
+ * blocks for the buffered data are reserved in e2data->reserved, with
+ * a worst case for the mapping blocks, so that the buffers of all open
+ * files together never promise more than the free blocks. when a write
+ * does not fit, all held back data is written out first, like ext4 does
+ * near a full fs, and the write goes straight to disk and gets ENOSPC
+ * itself.
+ *
+ * write out allocates the blocks of the whole range with one call to
+ * ext2fs_fallocate(), which hands out contiguous extents next to the
+ * previous blocks of the file, and writes each run of blocks with one
+ * io request. partial blocks at the edges are read, patched and written.
+ * blocks of unwritten extents are marked initialized after the write.
+ * the inode size on disk only grows then, do_delalloc_stat() reports
+ * the size including the buffer in the meantime.
+ *
+ * it runs from the flusher thread too, so it must not use fuse_get_context().
+ */
+
+/* contents of block lblk before a partial write, zeroes past the old size */
+static errcode_t read_edge (ext2_filsys e2fs, ext2_ino_t ino, struct ext2_inode *inode, blk64_t lblk, char *buf)
+{
+	errcode_t rc;
+	__u64 isize = EXT2_I_SIZE(inode);
+	struct extfs_blockrun run;
+
+	memset(buf, 0, e2fs->blocksize);
+	if (lblk * e2fs->blocksize >= isize) {
+		return 0;
+	}
+	if (do_map_blocks(e2fs, ino, inode, lblk, 1, &run) < 0) {
+		return EXT2_ET_BLOCK_ALLOC_FAIL;
+	}
+	if (run.pblk != 0 && !run.uninit) {
+		rc = io_channel_read_blk64(e2fs->io, run.pblk, 1, buf);
+		if (rc) {
+			return rc;
+		}
+	}
+	if (isize < (lblk + 1) * e2fs->blocksize) {
+		memset(buf + isize % e2fs->blocksize, 0, e2fs->blocksize - isize % e2fs->blocksize);
+	}
+	return 0;
+}
+
+/*
+ * blocks needed to write out a byte range: its data blocks, one mapping
+ * block for each block full of block numbers, and a few for the levels
+ * above. blocks that are mapped already are counted too, the safe side.
+ */
+static blk64_t delalloc_blocks (ext2_filsys e2fs, off_t offset, size_t size)
+{
+	blk64_t count;
+
+	if (size == 0) {
+		return 0;
+	}
+	count = (offset + size - 1) / e2fs->blocksize - offset / e2fs->blocksize + 1;
+	return count + count / (e2fs->blocksize / sizeof(__u32)) + 4;
+}
+
+/* turn the reservations of all files into allocated blocks */
+static void flush_all (struct extfs_data *e2data)
+{
+	int i;
+	struct extfs_openfile *file;
+
+	for (i = 0; i < EXTFS_OPENFILE_HASH; i++) {
+		for (file = e2data->openfiles[i]; file != NULL; file = file->next) {
+			if (file->wlen > 0 && do_delalloc_flush(e2data, file) != 0) {
+				debugf_main("do_delalloc_flush(e2data, %d); failed", file->ino);
+			}
+		}
+	}
+}
+
+static int write_range (ext2_filsys e2fs, struct extfs_openfile *file, const char *data, size_t size, off_t offset)
+{
+	int i;
+	int nruns;
+	char *head;
+	char *tail;
+	char *edges;
+	blk64_t j;
+	blk64_t n;
+	blk64_t lblk;
+	blk64_t pblk;
+	errcode_t rc;
+	const char *src;
+	struct ext2_inode inode;
+	struct extfs_blockrun *runs;
+	size_t bs = e2fs->blocksize;
+	blk64_t first = offset / bs;
+	blk64_t last = (offset + size - 1) / bs;
+	blk64_t count = last - first + 1;
+
+	inode = *ext2fs_file_get_inode(file->efile);
+
+	/* partial first and last blocks keep what was around the write */
+	edges = malloc(2 * bs);
+	runs = malloc(count * sizeof(struct extfs_blockrun));
+	if (edges == NULL || runs == NULL) {
+		free(edges);
+		free(runs);
+		return -ENOMEM;
+	}
+	head = NULL;
+	tail = NULL;
+	rc = 0;
+	if (offset % bs != 0 || (first == last && (offset + size) % bs != 0)) {
+		head = edges;
+		rc = read_edge(e2fs, file->ino, &inode, first, head);
+		if (rc == 0) {
+			memcpy(head + offset % bs, data, (first == last) ? size : bs - offset % bs);
+		}
+	}
+	if (rc == 0 && first != last && (offset + size) % bs != 0) {
+		tail = edges + bs;
+		rc = read_edge(e2fs, file->ino, &inode, last, tail);
+		if (rc == 0) {
+			memcpy(tail, data + last * bs - offset, (offset + size) % bs);
+		}
+	}
+	if (rc) {
+		debugf_main("read_edge(e2fs, %d, ...); failed", file->ino);
+		goto out;
+	}
+
+	/* one allocation for the whole range, already mapped blocks are kept */
+	rc = ext2fs_fallocate(e2fs, EXT2_FALLOCATE_FORCE_INIT, file->ino, &inode, ~0ULL, first, count);
+	if (rc) {
+		debugf_main("ext2fs_fallocate(e2fs, FORCE_INIT, %d, &inode, ~0, %llu, %llu); failed", file->ino, (unsigned long long) first, (unsigned long long) count);
+		goto out;
+	}
+	nruns = do_map_blocks(e2fs, file->ino, &inode, first, count, runs);
+	if (nruns < 0) {
+		rc = EXT2_ET_BLOCK_ALLOC_FAIL;
+		goto out;
+	}
+
+	lblk = first;
+	for (i = 0; i < nruns && rc == 0; i++) {
+		if (runs[i].pblk == 0) {
+			rc = EXT2_ET_BLOCK_ALLOC_FAIL;
+			break;
+		}
+		for (j = 0; j < runs[i].count && rc == 0; j += n) {
+			if (lblk + j == first && head != NULL) {
+				n = 1;
+				src = head;
+			} else if (lblk + j == last && tail != NULL) {
+				n = 1;
+				src = tail;
+			} else {
+				for (n = 1; j + n < runs[i].count && !(lblk + j + n == last && tail != NULL); n++)
+					;
+				src = data + (lblk + j) * bs - offset;
+			}
+			rc = io_channel_write_blk64(e2fs->io, runs[i].pblk + j, n, src);
+		}
+		lblk += runs[i].count;
+	}
+	if (rc) {
+		debugf_main("io_channel_write_blk64(e2fs->io, ...); failed");
+		goto out;
+	}
+
+	/* fallocate leaves unwritten extents alone, the data is there now */
+	lblk = first;
+	for (i = 0; i < nruns && rc == 0; i++) {
+		for (j = 0; runs[i].uninit && j < runs[i].count && rc == 0; j++) {
+			pblk = runs[i].pblk + j;
+			rc = ext2fs_bmap2(e2fs, file->ino, &inode, NULL, BMAP_SET, lblk + j, NULL, &pblk);
+		}
+		lblk += runs[i].count;
+	}
+	if (rc) {
+		debugf_main("ext2fs_bmap2(e2fs, %d, &inode, NULL, BMAP_SET, ...); failed", file->ino);
+		goto out;
+	}
+
+	if ((__u64) offset + size > EXT2_I_SIZE(&inode)) {
+		rc = ext2fs_inode_size_set(e2fs, &inode, offset + size);
+		if (rc) {
+			goto out;
+		}
+	}
+	rc = ext2fs_write_inode(e2fs, file->ino, &inode);
+	if (rc == 0) {
+		*ext2fs_file_get_inode(file->efile) = inode;
+	}
+
+out:
+	free(edges);
+	free(runs);
+	if (rc == EXT2_ET_BLOCK_ALLOC_FAIL) {
+		return -ENOSPC;
+	}
+	if (rc == EXT2_ET_FILE_TOO_BIG) {
+		return -EFBIG;
+	}
+	return (rc) ? -EIO : 0;
+}
+
+int do_delalloc_write (struct extfs_data *e2data, struct extfs_openfile *file, const char *buf, size_t size, off_t offset)
+{
+	int rt;
+	int full;
+	char *wbuf;
+	off_t start;
+	size_t end;
+	size_t wsize;
+	blk64_t need;
+	ext2_filsys e2fs = e2data->e2fs;
+
+	if (size == 0) {
+		return 0;
+	}
+
+	/* only a write that continues or overlaps the buffer joins it */
+	if (file->wlen > 0 &&
+	    (offset < file->woff || offset > file->woff + (off_t) file->wlen ||
+	     offset + size - file->woff > DELALLOC_SIZE)) {
+		rt = do_delalloc_flush(e2data, file);
+		if (rt) {
+			return rt;
+		}
+	}
+	start = (file->wlen > 0) ? file->woff : offset;
+	end = offset + size - start;
+	if (end < file->wlen) {
+		end = file->wlen;
+	}
+	need = delalloc_blocks(e2fs, start, end);
+	full = e2data->reserved - file->wres + need > ext2fs_free_blocks_count(e2fs->super);
+	/* too big to hold, or more than is free with all held back data */
+	if (size > DELALLOC_SIZE || full) {
+		if (full) {
+			flush_all(e2data);
+		}
+		rt = do_delalloc_flush(e2data, file);
+		/* blocks still promised to others are not for this write */
+		if (rt == 0 && e2data->reserved > 0 &&
+		    e2data->reserved + delalloc_blocks(e2fs, offset, size) > ext2fs_free_blocks_count(e2fs->super)) {
+			rt = -ENOSPC;
+		}
+		if (rt == 0) {
+			rt = write_range(e2fs, file, buf, size, offset);
+		}
+		return (rt) ? rt : (int) size;
+	}
+
+	file->woff = start;
+	if (end > file->wsize) {
+		for (wsize = (file->wsize) ? file->wsize : 65536; wsize < end; wsize *= 2)
+			;
+		if (wsize > DELALLOC_SIZE) {
+			wsize = DELALLOC_SIZE;
+		}
+		wbuf = realloc(file->wbuf, wsize);
+		if (wbuf == NULL) {
+			return -ENOMEM;
+		}
+		file->wbuf = wbuf;
+		file->wsize = wsize;
+	}
+	memcpy(file->wbuf + (offset - file->woff), buf, size);
+	file->wlen = end;
+	e2data->reserved += need - file->wres;
+	file->wres = need;
+	return size;
+}
+
+int do_delalloc_flush (struct extfs_data *e2data, struct extfs_openfile *file)
+{
+	int rt;
+
+	if (file->wlen == 0) {
+		return 0;
+	}
+	rt = write_range(e2data->e2fs, file, file->wbuf, file->wlen, file->woff);
+	if (rt) {
+		return rt;
+	}
+	file->wlen = 0;
+	e2data->reserved -= file->wres;
+	file->wres = 0;
+	return 0;
+}
+
+void do_delalloc_read (struct extfs_openfile *file, char *buf, size_t size, off_t offset)
+{
+	off_t lo;
+	off_t hi;
+
+	lo = (offset > file->woff) ? offset : file->woff;
+	hi = (offset + (off_t) size < file->woff + (off_t) file->wlen) ? offset + (off_t) size : file->woff + (off_t) file->wlen;
+	if (file->wlen > 0 && lo < hi) {
+		memcpy(buf + (lo - offset), file->wbuf + (lo - file->woff), hi - lo);
+	}
+}
+
+void do_delalloc_stat (struct extfs_openfile *file, struct stat *stbuf)
+{
+	if (file->wlen > 0 && file->woff + (off_t) file->wlen > stbuf->st_size) {
+		stbuf->st_size = file->woff + file->wlen;
+	}
+}
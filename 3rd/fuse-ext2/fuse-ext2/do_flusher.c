@@ -0,0 +1,146 @@
+/**
+ * Copyright (c) 2008-2015 Alper Akcan <alper.akcan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the fuse-ext2
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "fuse-ext2.h"
+
+/*
+ * write back file buffers, bitmaps, group descriptors and the super
+ * block once they have been dirty for dirty_age seconds. runs in its
+ * own thread, without a fuse context, so it uses e2data directly.
+ * fsync and unmount do not wait for it, they flush synchronously.
+ */
+
+int do_flush_files (struct extfs_data *e2data, time_t older)
+{
+	int i;
+	int rt;
+	int err;
+	errcode_t rc;
+	struct extfs_openfile *file;
+	struct extfs_openfile *next;
+
+	rt = 0;
+	for (i = 0; i < EXTFS_OPENFILE_HASH; i++) {
+		for (file = e2data->openfiles[i]; file != NULL; file = next) {
+			next = file->next;
+			if (file->dirty == 0 || file->dirty > older) {
+				continue;
+			}
+			err = do_delalloc_flush(e2data, file);
+			if (err) {
+				debugf_main("do_delalloc_flush(e2data, %d); failed", file->ino);
+				rt = err;
+				continue;
+			}
+			rc = ext2fs_file_flush(file->efile);
+			if (rc) {
+				debugf_main("ext2fs_file_flush(%d); failed", file->ino);
+				rt = -EIO;
+				continue;
+			}
+			file->dirty = 0;
+			/* kept after the last release only until its data was written */
+			if (file->refs == 0) {
+				ext2fs_file_close(file->efile);
+				do_openfile_remove(e2data, file);
+			}
+		}
+	}
+	return rt;
+}
+
+static void flush_dirty (struct extfs_data *e2data, time_t older)
+{
+	errcode_t rc;
+
+	do_flush_files(e2data, older);
+	if (e2data->dirty != 0 && e2data->dirty <= older) {
+		rc = ext2fs_flush2(e2data->e2fs, EXT2_FLAG_FLUSH_NO_SYNC);
+		if (rc) {
+			debugf_main("ext2fs_flush2(e2fs, EXT2_FLAG_FLUSH_NO_SYNC); failed");
+			return;
+		}
+		e2data->dirty = 0;
+	}
+	/* NO_SYNC skips io_channel_flush, write back the block cache here */
+	rc = do_cacheio_writeback(e2data->e2fs->io, older);
+	if (rc) {
+		debugf_main("do_cacheio_writeback(); failed");
+	}
+}
+
+static void * flusher (void *arg)
+{
+	time_t now;
+	struct timespec ts;
+	struct extfs_data *e2data = arg;
+	unsigned int interval = e2data->dirty_age / 2;
+
+	if (interval == 0) {
+		interval = 1;
+	}
+
+	pthread_mutex_lock(&e2data->flush_lock);
+	while (e2data->flush_stop == 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += interval;
+		pthread_cond_timedwait(&e2data->flush_cond, &e2data->flush_lock, &ts);
+		if (e2data->flush_stop) {
+			break;
+		}
+		pthread_mutex_unlock(&e2data->flush_lock);
+
+		now = time(NULL);
+		pthread_rwlock_wrlock(&e2data->lock);
+		flush_dirty(e2data, now - e2data->dirty_age);
+		pthread_rwlock_unlock(&e2data->lock);
+
+		pthread_mutex_lock(&e2data->flush_lock);
+	}
+	pthread_mutex_unlock(&e2data->flush_lock);
+	return NULL;
+}
+
+int do_flusher_start (struct extfs_data *e2data)
+{
+	pthread_mutex_init(&e2data->flush_lock, NULL);
+	pthread_cond_init(&e2data->flush_cond, NULL);
+	e2data->flush_stop = 0;
+	if (pthread_create(&e2data->flusher, NULL, flusher, e2data) != 0) {
+		debugf_main("pthread_create(flusher); failed");
+		return -1;
+	}
+	e2data->flusher_running = 1;
+	return 0;
+}
+
+void do_flusher_stop (struct extfs_data *e2data)
+{
+	if (e2data->flusher_running == 0) {
+		return;
+	}
+	pthread_mutex_lock(&e2data->flush_lock);
+	e2data->flush_stop = 1;
+	pthread_cond_signal(&e2data->flush_cond);
+	pthread_mutex_unlock(&e2data->flush_lock);
+	pthread_join(e2data->flusher, NULL);
+	e2data->flusher_running = 0;
+	pthread_cond_destroy(&e2data->flush_cond);
+	pthread_mutex_destroy(&e2data->flush_lock);
+}
@@ -0,0 +1,229 @@
+/**
+ * Copyright (c) 2008-2015 Alper Akcan <alper.akcan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the fuse-ext2
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "fuse-ext2.h"
+
+/*
+ * name lookup in directories indexed with a hash tree (dir_index).
+ * ext2fs_lookup reads every block of the directory, here the index is
+ * walked down from the root block to the one leaf block that can hold
+ * the name. directories without an index, or with an index that does
+ * not look sane, are searched with ext2fs_lookup.
+ */
+
+/* indirect_levels of the root, 3 with large_dir */
+#define HTREE_MAX_LEVELS 3
+
+static errcode_t read_dir_block (ext2_filsys e2fs, ext2_ino_t dir, struct ext2_inode *inode, blk64_t lblk, char *buf)
+{
+	blk64_t pblk;
+	errcode_t rc;
+
+	if ((lblk + 1) * e2fs->blocksize > EXT2_I_SIZE(inode)) {
+		return EXT2_ET_DIR_CORRUPTED;
+	}
+	rc = ext2fs_bmap2(e2fs, dir, inode, NULL, 0, lblk, NULL, &pblk);
+	if (rc) {
+		return rc;
+	}
+	if (pblk == 0) {
+		return EXT2_ET_DIR_CORRUPTED;
+	}
+	return ext2fs_read_dir_block4(e2fs, pblk, buf, 0, dir);
+}
+
+static errcode_t scan_leaf (ext2_filsys e2fs, char *buf, const char *name, int len, ext2_ino_t *ino)
+{
+	errcode_t rc;
+	unsigned int offset;
+	unsigned int rec_len;
+	struct ext2_dir_entry *dirent;
+
+	for (offset = 0; offset + 8 <= e2fs->blocksize; offset += rec_len) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		rc = ext2fs_get_rec_len(e2fs, dirent, &rec_len);
+		if (rc) {
+			return rc;
+		}
+		if (rec_len < 8 || offset + rec_len > e2fs->blocksize) {
+			return EXT2_ET_DIR_CORRUPTED;
+		}
+		if (dirent->inode != 0 &&
+		    (dirent->name_len & 0xff) == len &&
+		    8 + len <= (int) rec_len &&
+		    memcmp(dirent->name, name, len) == 0) {
+			*ino = dirent->inode;
+			return 0;
+		}
+	}
+	return EXT2_ET_FILE_NOT_FOUND;
+}
+
+static errcode_t dx_node_entries (ext2_filsys e2fs, char *buf, unsigned int offset, struct ext2_dx_entry **entries, int *count)
+{
+	struct ext2_dx_countlimit *limit;
+
+	limit = (struct ext2_dx_countlimit *) (buf + offset);
+	*entries = (struct ext2_dx_entry *) limit;
+	*count = ext2fs_le16_to_cpu(limit->count);
+	if (*count == 0 || *count > ext2fs_le16_to_cpu(limit->limit) ||
+	    offset + ext2fs_le16_to_cpu(limit->limit) * sizeof(struct ext2_dx_entry) > e2fs->blocksize) {
+		return EXT2_ET_DIR_CORRUPTED;
+	}
+	return 0;
+}
+
+/*
+ * buf holds one block per level of the tree, the root first, and the leaf
+ * block at the end.
+ */
+static errcode_t htree_lookup (ext2_filsys e2fs, ext2_ino_t dir, struct ext2_inode *inode, char *buf, const char *name, int len, ext2_ino_t *ino)
+{
+	int lo;
+	int hi;
+	int mid;
+	int level;
+	int levels;
+	int version;
+	__u32 hash;
+	__u32 minor_hash;
+	blk64_t lblk;
+	errcode_t rc;
+	char *leaf = buf + HTREE_MAX_LEVELS * e2fs->blocksize;
+	int at[HTREE_MAX_LEVELS];
+	int count[HTREE_MAX_LEVELS];
+	struct ext2_dx_entry *entries[HTREE_MAX_LEVELS];
+	struct ext2_dx_root_info *info;
+
+	rc = read_dir_block(e2fs, dir, inode, 0, buf);
+	if (rc) {
+		return rc;
+	}
+	/* the root block starts with the "." and ".." entries */
+	info = (struct ext2_dx_root_info *) (buf + 24);
+	if (info->reserved_zero != 0 || info->info_length < 8 ||
+	    info->indirect_levels >= HTREE_MAX_LEVELS) {
+		return EXT2_ET_DIR_CORRUPTED;
+	}
+	levels = info->indirect_levels;
+	version = info->hash_version;
+	if (version <= EXT2_HASH_TEA && (e2fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH)) {
+		version += 3;
+	}
+	rc = ext2fs_dirhash(version, name, len, e2fs->super->s_hash_seed, &hash, &minor_hash);
+	if (rc) {
+		return rc;
+	}
+
+	for (level = 0; ; level++) {
+		/* index nodes start with an empty entry spanning the block */
+		rc = dx_node_entries(e2fs, buf + level * e2fs->blocksize, (level == 0) ? 24 + info->info_length : 8, &entries[level], &count[level]);
+		if (rc) {
+			return rc;
+		}
+		/* last entry with a hash <= ours, the first one has no hash */
+		lo = 1;
+		hi = count[level] - 1;
+		while (lo <= hi) {
+			mid = (lo + hi) / 2;
+			if (ext2fs_le32_to_cpu(entries[level][mid].hash) > hash) {
+				hi = mid - 1;
+			} else {
+				lo = mid + 1;
+			}
+		}
+		at[level] = lo - 1;
+		lblk = ext2fs_le32_to_cpu(entries[level][at[level]].block) & 0x0fffffff;
+		if (level == levels) {
+			break;
+		}
+		rc = read_dir_block(e2fs, dir, inode, lblk, buf + (level + 1) * e2fs->blocksize);
+		if (rc) {
+			return rc;
+		}
+	}
+
+	for (;;) {
+		rc = read_dir_block(e2fs, dir, inode, lblk, leaf);
+		if (rc) {
+			return rc;
+		}
+		rc = scan_leaf(e2fs, leaf, name, len, ino);
+		if (rc != EXT2_ET_FILE_NOT_FOUND) {
+			return rc;
+		}
+
+		/* names with colliding hashes go on in the next leaf, which
+		 * may hang off the next index node */
+		for (level = levels; level >= 0 && at[level] + 1 == count[level]; level--)
+			;
+		if (level < 0) {
+			return EXT2_ET_FILE_NOT_FOUND;
+		}
+		at[level]++;
+		if ((ext2fs_le32_to_cpu(entries[level][at[level]].hash) & ~1) != hash) {
+			return EXT2_ET_FILE_NOT_FOUND;
+		}
+		lblk = ext2fs_le32_to_cpu(entries[level][at[level]].block) & 0x0fffffff;
+		for (level++; level <= levels; level++) {
+			rc = read_dir_block(e2fs, dir, inode, lblk, buf + level * e2fs->blocksize);
+			if (rc) {
+				return rc;
+			}
+			rc = dx_node_entries(e2fs, buf + level * e2fs->blocksize, 8, &entries[level], &count[level]);
+			if (rc) {
+				return rc;
+			}
+			at[level] = 0;
+			lblk = ext2fs_le32_to_cpu(entries[level][0].block) & 0x0fffffff;
+		}
+	}
+}
+
+errcode_t do_htree_lookup (ext2_filsys e2fs, ext2_ino_t dir, const char *name, int len, ext2_ino_t *ino)
+{
+	char *buf;
+	errcode_t rc;
+	struct ext2_inode inode;
+
+	rc = ext2fs_read_inode(e2fs, dir, &inode);
+	if (rc) {
+		return rc;
+	}
+	/* "." and ".." are in the root block, outside the index */
+	if (!(inode.i_flags & EXT2_INDEX_FL) ||
+	    (inode.i_flags & EXT4_CASEFOLD_FL) ||
+	    !ext2fs_has_feature_dir_index(e2fs->super) ||
+	    (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))) {
+		return ext2fs_lookup(e2fs, dir, name, len, NULL, ino);
+	}
+
+	buf = malloc((HTREE_MAX_LEVELS + 1) * e2fs->blocksize);
+	if (buf == NULL) {
+		return EXT2_ET_NO_MEMORY;
+	}
+	rc = htree_lookup(e2fs, dir, &inode, buf, name, len, ino);
+	free(buf);
+	if (rc == 0 || rc == EXT2_ET_FILE_NOT_FOUND) {
+		return rc;
+	}
+
+	debugf("htree_lookup(e2fs, %d, %.*s); failed, searching linearly", dir, len, name);
+	return ext2fs_lookup(e2fs, dir, name, len, NULL, ino);
+}
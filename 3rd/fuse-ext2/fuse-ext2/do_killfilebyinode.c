@@ -41,10 +41,36 @@ static int release_blocks_proc (ext2_filsys fs, blk_t *blocknr, int blockcnt, vo
 int do_killfilebyinode (ext2_filsys e2fs, ext2_ino_t ino, struct ext2_inode *inode)
 {
 	errcode_t rc;
+	struct extfs_openfile *file;
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 	char scratchbuf[3*e2fs->blocksize];
 
 	debugf("enter");
 
+	/* only kept for data that could not be written, which goes with it */
+	file = do_openfile_find(e2data, ino);
+	if (file != NULL && file->refs == 0) {
+		ext2fs_file_close(file->efile);
+		do_openfile_remove(e2data, file);
+		file = NULL;
+	}
+
+	/* still open, blocks and inode are released by the last do_release() */
+	if (file != NULL) {
+		debugf("%d is open, delaying delete", ino);
+		inode->i_links_count = 0;
+		rc = ext2fs_write_inode(e2fs, ino, inode);
+		if (rc) {
+			debugf("ext2fs_write_inode(e2fs, ino, inode); failed");
+			return -EIO;
+		}
+		*ext2fs_file_get_inode(file->efile) = *inode;
+		file->unlinked = 1;
+		debugf("leave");
+		return 0;
+	}
+
 	inode->i_links_count = 0;
 	inode->i_dtime = time(NULL);
 
@@ -0,0 +1,129 @@
+/**
+ * Copyright (c) 2008-2015 Alper Akcan <alper.akcan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the fuse-ext2
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "fuse-ext2.h"
+
+/*
+ * map a range of logical blocks into runs of physically contiguous
+ * blocks, one extent lookup per run for extent mapped inodes. holes come
+ * back as runs with pblk 0, unwritten extents with uninit set. returns
+ * the number of runs, or -1; runs must have room for count entries.
+ */
+
+static errcode_t map_extent_run (ext2_extent_handle_t handle, blk64_t lblk, blk64_t end, struct extfs_blockrun *run)
+{
+	errcode_t rc;
+	struct ext2fs_extent extent;
+
+	rc = ext2fs_extent_goto(handle, lblk);
+	if (rc == 0) {
+		rc = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &extent);
+		if (rc) {
+			return rc;
+		}
+		run->count = extent.e_lblk + extent.e_len - lblk;
+		if (run->count > end - lblk) {
+			run->count = end - lblk;
+		}
+		run->pblk = extent.e_pblk + (lblk - extent.e_lblk);
+		run->uninit = (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) ? 1 : 0;
+		return 0;
+	}
+	if (rc != EXT2_ET_EXTENT_NOT_FOUND) {
+		return rc;
+	}
+
+	/* a hole, it lasts up to the next leaf extent */
+	run->pblk = 0;
+	run->uninit = 0;
+	run->count = end - lblk;
+	rc = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &extent);
+	while (rc == 0 && (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF) || extent.e_lblk <= lblk)) {
+		rc = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT, &extent);
+	}
+	if (rc == 0 && extent.e_lblk - lblk < run->count) {
+		run->count = extent.e_lblk - lblk;
+	}
+	return 0;
+}
+
+static errcode_t map_block_run (ext2_filsys e2fs, ext2_ino_t ino, struct ext2_inode *inode, char *block_buf, blk64_t lblk, blk64_t end, struct extfs_blockrun *run)
+{
+	blk64_t pblk;
+	errcode_t rc;
+
+	rc = ext2fs_bmap2(e2fs, ino, inode, block_buf, 0, lblk, NULL, &run->pblk);
+	if (rc) {
+		return rc;
+	}
+	run->uninit = 0;
+	for (run->count = 1; lblk + run->count < end; run->count++) {
+		rc = ext2fs_bmap2(e2fs, ino, inode, block_buf, 0, lblk + run->count, NULL, &pblk);
+		if (rc) {
+			return rc;
+		}
+		if (run->pblk == 0 ? pblk != 0 : pblk != run->pblk + run->count) {
+			break;
+		}
+	}
+	return 0;
+}
+
+int do_map_blocks (ext2_filsys e2fs, ext2_ino_t ino, struct ext2_inode *inode, blk64_t lblk, blk64_t count, struct extfs_blockrun *runs)
+{
+	int nruns;
+	errcode_t rc;
+	char *block_buf;
+	blk64_t end = lblk + count;
+	ext2_extent_handle_t handle = NULL;
+
+	block_buf = NULL;
+	if (inode->i_flags & EXT4_EXTENTS_FL) {
+		rc = ext2fs_extent_open2(e2fs, ino, inode, &handle);
+		if (rc) {
+			debugf_main("ext2fs_extent_open2(e2fs, %d, inode, &handle); failed", ino);
+			return -1;
+		}
+	} else {
+		block_buf = malloc(2 * e2fs->blocksize);
+		if (block_buf == NULL) {
+			return -1;
+		}
+	}
+
+	for (nruns = 0; lblk < end; nruns++) {
+		if (handle != NULL) {
+			rc = map_extent_run(handle, lblk, end, &runs[nruns]);
+		} else {
+			rc = map_block_run(e2fs, ino, inode, block_buf, lblk, end, &runs[nruns]);
+		}
+		if (rc) {
+			debugf_main("mapping block %llu of inode %d failed", (unsigned long long) lblk, ino);
+			nruns = -1;
+			break;
+		}
+		lblk += runs[nruns].count;
+	}
+
+	if (handle != NULL) {
+		ext2fs_extent_free(handle);
+	}
+	free(block_buf);
+	return nruns;
+}
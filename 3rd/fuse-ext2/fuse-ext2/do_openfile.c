@@ -0,0 +1,102 @@
+/**
+ * Copyright (c) 2008-2015 Alper Akcan <alper.akcan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the fuse-ext2
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "fuse-ext2.h"
+
+/*
+ * every fuse file handle of an inode shares one ext2_file_t, so that
+ * libext2fs keeps exactly one in-core copy of the inode for open files.
+ * do_writeinode() refreshes that copy, which would otherwise be written
+ * back stale by the next ext2fs_file_flush().
+ *
+ * the table is only changed with the fs lock held exclusive, lookups
+ * may run shared. file->lock serializes the file position and buffer
+ * of the shared ext2_file_t between readers of the same file. it is
+ * taken before iolock, never after. the delayed allocation buffer only
+ * changes with the fs lock held exclusive.
+ *
+ * a file whose held back data could not be written at the last release
+ * stays in the table with no references, until the flusher has written
+ * it, the file is opened again or it is deleted.
+ *
+ * data of files that are not inline is read and written by block runs,
+ * see do_mapblocks.c and do_delalloc.c, and never passes through the
+ * ext2_file_t buffer, which could go stale under those writes.
+ */
+
+static inline struct extfs_openfile ** openfile_bucket (struct extfs_data *e2data, ext2_ino_t ino)
+{
+	return &e2data->openfiles[ino % EXTFS_OPENFILE_HASH];
+}
+
+struct extfs_openfile * do_openfile_find (struct extfs_data *e2data, ext2_ino_t ino)
+{
+	struct extfs_openfile *file;
+
+	for (file = *openfile_bucket(e2data, ino); file != NULL; file = file->next) {
+		if (file->ino == ino) {
+			return file;
+		}
+	}
+	return NULL;
+}
+
+struct extfs_openfile * do_openfile_add (struct extfs_data *e2data, ext2_ino_t ino, ext2_file_t efile)
+{
+	struct extfs_openfile *file;
+	struct extfs_openfile **bucket;
+
+	file = malloc(sizeof(struct extfs_openfile));
+	if (file == NULL) {
+		return NULL;
+	}
+	bucket = openfile_bucket(e2data, ino);
+	file->ino = ino;
+	file->efile = efile;
+	file->refs = 1;
+	file->unlinked = 0;
+	file->dirty = 0;
+	file->direct = !(ext2fs_file_get_inode(efile)->i_flags & EXT4_INLINE_DATA_FL);
+	file->wbuf = NULL;
+	file->woff = 0;
+	file->wlen = 0;
+	file->wsize = 0;
+	file->wres = 0;
+	pthread_mutex_init(&file->lock, NULL);
+	file->next = *bucket;
+	*bucket = file;
+	return file;
+}
+
+void do_openfile_remove (struct extfs_data *e2data, struct extfs_openfile *file)
+{
+	struct extfs_openfile **pp;
+
+	for (pp = openfile_bucket(e2data, file->ino); *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == file) {
+			*pp = file->next;
+			break;
+		}
+	}
+	/* data still held back is dropped with the file */
+	e2data->reserved -= file->wres;
+	pthread_mutex_destroy(&file->lock);
+	free(file->wbuf);
+	free(file);
+}
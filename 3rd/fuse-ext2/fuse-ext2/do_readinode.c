@@ -20,15 +20,67 @@
 
 #include "fuse-ext2.h"
 
+/*
+ * resolve the path one component at a time through the name cache,
+ * instead of ext2fs_namei scanning every directory from the root.
+ * misses use the htree index of the directory when it has one.
+ * paths come from the kernel, they have no symlinks, '.' or '..' in them.
+ * called with iolock held, it guards the name cache as well.
+ */
+static int do_lookup (ext2_filsys e2fs, struct extfs_data *e2data, const char *path, ext2_ino_t *ino)
+{
+	int len;
+	errcode_t rc;
+	const char *end;
+	ext2_ino_t dir;
+	ext2_ino_t next;
+
+	dir = EXT2_ROOT_INO;
+	while (*path != '\0') {
+		while (*path == '/') {
+			path++;
+		}
+		if (*path == '\0') {
+			break;
+		}
+		end = strchr(path, '/');
+		len = (end != NULL) ? end - path : (int) strlen(path);
+		if (do_dcache_lookup(e2data, dir, path, len, &next) == 0) {
+			rc = do_htree_lookup(e2fs, dir, path, len, &next);
+			if (rc == EXT2_ET_FILE_NOT_FOUND) {
+				next = 0;
+			} else if (rc) {
+				debugf("do_htree_lookup(e2fs, %d, %.*s); failed", dir, len, path);
+				return -ENOENT;
+			}
+			do_dcache_add(e2data, dir, path, len, next);
+		}
+		if (next == 0) {
+			return -ENOENT;
+		}
+		dir = next;
+		path += len;
+	}
+	*ino = dir;
+	return 0;
+}
+
 int do_readinode (ext2_filsys e2fs, const char *path, ext2_ino_t *ino, struct ext2_inode *inode)
 {
+	int rt;
 	errcode_t rc;
-	rc = ext2fs_namei(e2fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, ino);
-	if (rc) {
-		debugf("ext2fs_namei(e2fs, EXT2_ROOT_INO, EXT2_ROOT_INO, %s, ino); failed", path);
-		return -ENOENT;
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
+
+	fs_iolock();
+	rt = do_lookup(e2fs, e2data, path, ino);
+	if (rt) {
+		fs_iounlock();
+		debugf("do_lookup(e2fs, e2data, %s, ino); failed", path);
+		return rt;
 	}
 	rc = ext2fs_read_inode(e2fs, *ino, inode);
+	fs_iounlock();
 	if (rc) {
 		debugf("ext2fs_read_inode(e2fs, *ino, inode); failed");
 		return -EIO;
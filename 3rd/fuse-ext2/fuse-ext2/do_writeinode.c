@@ -24,6 +24,9 @@ int do_writeinode (ext2_filsys e2fs, ext2_ino_t ino, struct ext2_inode *inode)
 {
 	int rt;
 	errcode_t rc;
+	struct extfs_openfile *file;
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 	if (inode->i_links_count < 1) {
 		rt = do_killfilebyinode(e2fs, ino, inode);
 		if (rt) {
@@ -36,6 +39,10 @@ int do_writeinode (ext2_filsys e2fs, ext2_ino_t ino, struct ext2_inode *inode)
 			debugf("ext2fs_read_inode(e2fs, *ino, inode); failed");
 			return -EIO;
 		}
+		file = do_openfile_find(e2data, ino);
+		if (file != NULL) {
+			*ext2fs_file_get_inode(file->efile) = *inode;
+		}
 	}
 	return 0;
 }
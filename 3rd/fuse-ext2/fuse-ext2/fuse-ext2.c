@@ -89,7 +89,7 @@ static int parse_options (int argc, char *argv[], struct extfs_data *opts)
 {
 	int c;
 
-	static const char *sopt = "o:hv";
+	static const char *sopt = "o:hvs";
 	static const struct option lopt[] = {
 		{ "options",	 required_argument,	NULL, 'o' },
 		{ "help",	 no_argument,		NULL, 'h' },
@@ -119,6 +119,9 @@ static int parse_options (int argc, char *argv[], struct extfs_data *opts)
 			case 'h':
 				usage();
 				exit(9);
+			case 's':
+				opts->single = 1;
+				break;
 			case 'v':
 				/*
 				 * We must handle the 'verbose' option even if
@@ -168,6 +171,24 @@ static int parse_options (int argc, char *argv[], struct extfs_data *opts)
 	return 0;
 }
 
+/* numeric option values, anything but a plain number of at least min is refused */
+static int parse_number (const char *val, long min, unsigned int *num)
+{
+	long n;
+	char *end;
+
+	if (val == NULL || *val == '\0') {
+		return -1;
+	}
+	errno = 0;
+	n = strtol(val, &end, 10);
+	if (errno != 0 || *end != '\0' || n < min || n > INT_MAX) {
+		return -1;
+	}
+	*num = n;
+	return 0;
+}
+
 static char * parse_mount_options (const char *orig_opts, struct extfs_data *opts)
 {
 	char *options, *s, *opt, *val, *ret;
@@ -231,6 +252,21 @@ static char * parse_mount_options (const char *orig_opts, struct extfs_data *opt
 #if __FreeBSD__ == 10
 			strcat(ret, "force,");
 #endif
+		} else if (!strcmp(opt, "cache_size")) { /* block cache in MiB */
+			if (parse_number(val, 0, &opts->cache_size) != 0) {
+				debugf_main("'cache_size' option needs a value of at least 0");
+				goto err_exit;
+			}
+		} else if (!strcmp(opt, "readahead")) { /* read-ahead in KiB */
+			if (parse_number(val, 0, &opts->readahead) != 0) {
+				debugf_main("'readahead' option needs a value of at least 0");
+				goto err_exit;
+			}
+		} else if (!strcmp(opt, "dirty_age")) { /* write back delay */
+			if (parse_number(val, 1, &opts->dirty_age) != 0) {
+				debugf_main("'dirty_age' option needs a value of at least 1");
+				goto err_exit;
+			}
 		} else { /* Probably FUSE option. */
 			strcat(ret, opt);
 			if (val) {
@@ -277,42 +313,288 @@ err_exit:
 	goto exit;
 }
 
+/*
+ * libext2fs is not thread safe, every operation runs under the fs lock.
+ * read-only operations take it shared, everything that may allocate,
+ * free or modify an inode takes it exclusive. shared holders only
+ * serialize their calls into the library with fs_iolock(), the rest of
+ * lookups, getattr and reads runs in parallel. write, flush, fsync and
+ * release stay exclusive even when they only fill the delalloc buffer:
+ * they may flush it, which allocates blocks. calls between operations
+ * (op_create -> op_open, op_rename -> op_unlink) stay inside the lock of
+ * the outer operation.
+ */
+
+static int locked_getattr (const char *path, struct stat *stbuf)
+{
+	int rt;
+	fs_rdlock();
+	rt = op_getattr(path, stbuf);
+	fs_rdunlock();
+	return rt;
+}
+
+static int locked_fgetattr (const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+	int rt;
+	fs_rdlock();
+	rt = op_fgetattr(path, stbuf, fi);
+	fs_rdunlock();
+	return rt;
+}
+
+static int locked_access (const char *path, int mask)
+{
+	int rt;
+	fs_rdlock();
+	rt = op_access(path, mask);
+	fs_rdunlock();
+	return rt;
+}
+
+static int locked_readlink (const char *path, char *buf, size_t size)
+{
+	int rt;
+	fs_rdlock();
+	rt = op_readlink(path, buf, size);
+	fs_rdunlock();
+	return rt;
+}
+
+static int locked_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	int rt;
+	fs_rdlock();
+	rt = op_readdir(path, buf, filler, offset, fi);
+	fs_rdunlock();
+	return rt;
+}
+
+static int locked_read (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	int rt;
+	fs_rdlock();
+	rt = op_read(path, buf, size, offset, fi);
+	fs_rdunlock();
+	return rt;
+}
+
+static int locked_statfs (const char *path, struct statvfs *buf)
+{
+	int rt;
+	fs_rdlock();
+	rt = op_statfs(path, buf);
+	fs_rdunlock();
+	return rt;
+}
+
+static int locked_getxattr (const char *path, const char *name, char *value, size_t size)
+{
+	int rt;
+	fs_rdlock();
+	rt = op_getxattr(path, name, value, size);
+	fs_rdunlock();
+	return rt;
+}
+
+static int locked_mknod (const char *path, mode_t mode, dev_t dev)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_mknod(path, mode, dev);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_mkdir (const char *path, mode_t mode)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_mkdir(path, mode);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_unlink (const char *path)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_unlink(path);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_rmdir (const char *path)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_rmdir(path);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_symlink (const char *sourcename, const char *destname)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_symlink(sourcename, destname);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_rename (const char *source, const char *dest)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_rename(source, dest);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_link (const char *source, const char *dest)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_link(source, dest);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_chmod (const char *path, mode_t mode)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_chmod(path, mode);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_chown (const char *path, uid_t uid, gid_t gid)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_chown(path, uid, gid);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_truncate (const char *path, off_t length)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_truncate(path, length);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_open (const char *path, struct fuse_file_info *fi)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_open(path, fi);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_write (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_write(path, buf, size, offset, fi);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_flush (const char *path, struct fuse_file_info *fi)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_flush(path, fi);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_release (const char *path, struct fuse_file_info *fi)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_release(path, fi);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_fsync (const char *path, int datasync, struct fuse_file_info *fi)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_fsync(path, datasync, fi);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_create (const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_create(path, mode, fi);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_ftruncate (const char *path, off_t length, struct fuse_file_info *fi)
+{
+	int rt;
+	fs_wrlock();
+	rt = op_ftruncate(path, length, fi);
+	fs_wrunlock();
+	return rt;
+}
+
+static int locked_utimens (const char *path, const struct timespec tv[2])
+{
+	int rt;
+	fs_wrlock();
+	rt = op_utimens(path, tv);
+	fs_wrunlock();
+	return rt;
+}
+
 static const struct fuse_operations ext2fs_ops = {
-	.getattr        = op_getattr,
-	.readlink       = op_readlink,
-	.mknod          = op_mknod,
-	.mkdir          = op_mkdir,
-	.unlink         = op_unlink,
-	.rmdir          = op_rmdir,
-	.symlink        = op_symlink,
-	.rename         = op_rename,
-	.link           = op_link,
-	.chmod          = op_chmod,
-	.chown          = op_chown,
-	.truncate       = op_truncate,
-	.open           = op_open,
-	.read           = op_read,
-	.write          = op_write,
-	.statfs         = op_statfs,
-	.flush          = op_flush,
-	.release	= op_release,
-	.fsync          = op_fsync,
+	.getattr        = locked_getattr,
+	.readlink       = locked_readlink,
+	.mknod          = locked_mknod,
+	.mkdir          = locked_mkdir,
+	.unlink         = locked_unlink,
+	.rmdir          = locked_rmdir,
+	.symlink        = locked_symlink,
+	.rename         = locked_rename,
+	.link           = locked_link,
+	.chmod          = locked_chmod,
+	.chown          = locked_chown,
+	.truncate       = locked_truncate,
+	.open           = locked_open,
+	.read           = locked_read,
+	.write          = locked_write,
+	.statfs         = locked_statfs,
+	.flush          = locked_flush,
+	.release	= locked_release,
+	.fsync          = locked_fsync,
 	.setxattr       = NULL,
-	.getxattr       = op_getxattr,
+	.getxattr       = locked_getxattr,
 	.listxattr      = NULL,
 	.removexattr    = NULL,
-	.opendir        = op_open,
-	.readdir        = op_readdir,
-	.releasedir     = op_release,
-	.fsyncdir       = op_fsync,
+	.opendir        = locked_open,
+	.readdir        = locked_readdir,
+	.releasedir     = locked_release,
+	.fsyncdir       = locked_fsync,
 	.init		= op_init,
 	.destroy	= op_destroy,
-	.access         = op_access,
-	.create         = op_create,
-	.ftruncate      = op_ftruncate,
-	.fgetattr       = op_fgetattr,
+	.access         = locked_access,
+	.create         = locked_create,
+	.ftruncate      = locked_ftruncate,
+	.fgetattr       = locked_fgetattr,
 	.lock           = NULL,
-	.utimens        = op_utimens,
+	.utimens        = locked_utimens,
 	.bmap           = NULL,
 #if ( (FUSE_VERSION) == 29 )
 	.flag_utime_omit_ok = 1,
@@ -330,6 +612,9 @@ int main (int argc, char *argv[])
 	debugf_main("version:'%s', fuse_version:'%d / %d / %d'", VERSION, FUSE_USE_VERSION,  FUSE_VERSION, fuse_version());
 
 	memset(&opts, 0, sizeof(opts));
+	opts.dirty_age = FLUSH_DIRTY_AGE;
+	opts.cache_size = CACHE_SIZE;
+	opts.readahead = CACHE_READAHEAD;
 
 	if (parse_options(argc, argv, &opts)) {
 		usage();
@@ -361,7 +646,7 @@ int main (int argc, char *argv[])
 	debugf_main("parsed_options: %s", parsed_options);
 
 	if (fuse_opt_add_arg(&fargs, PACKAGE) == -1 ||
-	    fuse_opt_add_arg(&fargs, "-s") == -1 ||
+	    (opts.single && fuse_opt_add_arg(&fargs, "-s") == -1) ||
 	    fuse_opt_add_arg(&fargs, "-o") == -1 ||
 	    fuse_opt_add_arg(&fargs, parsed_options) == -1 ||
 	    fuse_opt_add_arg(&fargs, opts.mnt_point) == -1) {
@@ -30,6 +30,8 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #ifdef MAJOR_IN_SYSMACROS
 #    include <sys/sysmacros.h>
 #endif
@@ -54,34 +56,140 @@ errcode_t ext2fs_file_close2(ext2_file_t file, void (*close_callback) (struct ex
 #endif
 
 #define EXT2FS_FILE(efile) ((void *) (unsigned long) (efile))
-/* max timeout to flush bitmaps, to reduce inconsistencies */
-#define FLUSH_BITMAPS_TIMEOUT 10
+/* default max age of dirty data in seconds, see -o dirty_age */
+#define FLUSH_DIRTY_AGE 10
+/* default block cache size in MiB and read-ahead in KiB, see -o cache_size */
+#define CACHE_SIZE 64
+#define CACHE_READAHEAD 512
+/* most data held back per open file for delayed allocation */
+#define DELALLOC_SIZE (8 * 1024 * 1024)
+/* buckets in the open file table, see do_openfile.c */
+#define EXTFS_OPENFILE_HASH 256
+
+struct extfs_openfile {
+	ext2_ino_t ino;
+	ext2_file_t efile;
+	int refs;
+	int unlinked;
+	time_t dirty;
+	/* data goes around the ext2_file_t buffer, not for inline data */
+	int direct;
+	/* delayed write: data that has no blocks allocated yet */
+	char *wbuf;
+	off_t woff;
+	size_t wlen;
+	size_t wsize;
+	blk64_t wres;	/* blocks reserved for it */
+	pthread_mutex_t lock;
+	struct extfs_openfile *next;
+};
+
+/* a run of physically contiguous blocks, pblk 0 for a hole */
+struct extfs_blockrun {
+	blk64_t pblk;
+	blk64_t count;
+	int uninit;	/* unwritten extent, reads as zeroes */
+};
+
+struct cacheio_stats {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long readahead;
+	unsigned long long writebacks;
+	unsigned long long written;
+	unsigned long long cached;
+	unsigned long long dirty;
+};
 
 struct extfs_data {
 	unsigned char debug;
 	unsigned char silent;
 	unsigned char force;
 	unsigned char readonly;
-	time_t last_flush;
+	unsigned char single;
+	unsigned int dirty_age;
+	unsigned int cache_size;
+	unsigned int readahead;
+	time_t dirty;
 	char *mnt_point;
 	char *options;
 	char *device;
 	char *volname;
 	ext2_filsys e2fs;
+	struct extfs_openfile *openfiles[EXTFS_OPENFILE_HASH];
+	struct extfs_dcache *dcache;
+	/* blocks promised to delayed writes of all files, see do_delalloc.c */
+	blk64_t reserved;
+	/*
+	 * operations that allocate, free or change metadata hold lock
+	 * exclusive, the others hold it shared. libext2fs updates its inode
+	 * and block caches even when reading, so shared holders take iolock
+	 * around each call into the library, see fs_iolock(), and run the
+	 * rest of the operation in parallel.
+	 */
+	pthread_rwlock_t lock;
+	pthread_mutex_t iolock;
+	/* background write back, see do_flusher.c */
+	pthread_t flusher;
+	pthread_mutex_t flush_lock;
+	pthread_cond_t flush_cond;
+	int flush_stop;
+	int flusher_running;
 };
 
 static inline ext2_filsys current_ext2fs(void)
 {
 	struct fuse_context *mycontext=fuse_get_context();
 	struct extfs_data *e2data=mycontext->private_data;
-	time_t now=time(NULL);
-	if ((now - e2data->last_flush) > FLUSH_BITMAPS_TIMEOUT) {
-		ext2fs_write_bitmaps(e2data->e2fs);
-		e2data->last_flush=now;
-	}
 	return (ext2_filsys) e2data->e2fs;
 }
 
+static inline void fs_rdlock (void)
+{
+	struct fuse_context *mycontext=fuse_get_context();
+	struct extfs_data *e2data=mycontext->private_data;
+	pthread_rwlock_rdlock(&e2data->lock);
+}
+
+static inline void fs_rdunlock (void)
+{
+	struct fuse_context *mycontext=fuse_get_context();
+	struct extfs_data *e2data=mycontext->private_data;
+	pthread_rwlock_unlock(&e2data->lock);
+}
+
+static inline void fs_wrlock (void)
+{
+	struct fuse_context *mycontext=fuse_get_context();
+	struct extfs_data *e2data=mycontext->private_data;
+	pthread_rwlock_wrlock(&e2data->lock);
+}
+
+static inline void fs_wrunlock (void)
+{
+	struct fuse_context *mycontext=fuse_get_context();
+	struct extfs_data *e2data=mycontext->private_data;
+	if (e2data->dirty == 0) {
+		e2data->dirty = time(NULL);
+	}
+	pthread_rwlock_unlock(&e2data->lock);
+}
+
+/* serializes the calls into libext2fs of shared lock holders */
+static inline void fs_iolock (void)
+{
+	struct fuse_context *mycontext=fuse_get_context();
+	struct extfs_data *e2data=mycontext->private_data;
+	pthread_mutex_lock(&e2data->iolock);
+}
+
+static inline void fs_iounlock (void)
+{
+	struct fuse_context *mycontext=fuse_get_context();
+	struct extfs_data *e2data=mycontext->private_data;
+	pthread_mutex_unlock(&e2data->iolock);
+}
+
 static inline uid_t ext2_read_uid(struct ext2_inode *inode)
 {
 	return ((uid_t)inode->osd2.linux2.l_i_uid_high << 16) | inode->i_uid;
@@ -170,6 +278,50 @@ int do_writeinode (ext2_filsys e2fs, ext2_ino_t ino, struct ext2_inode *inode);
 
 int do_killfilebyinode (ext2_filsys e2fs, ext2_ino_t ino, struct ext2_inode *inode);
 
+struct extfs_openfile * do_openfile_find (struct extfs_data *e2data, ext2_ino_t ino);
+
+struct extfs_openfile * do_openfile_add (struct extfs_data *e2data, ext2_ino_t ino, ext2_file_t efile);
+
+void do_openfile_remove (struct extfs_data *e2data, struct extfs_openfile *file);
+
+int do_flush_files (struct extfs_data *e2data, time_t older);
+
+int do_dcache_init (struct extfs_data *e2data);
+
+void do_dcache_free (struct extfs_data *e2data);
+
+int do_dcache_lookup (struct extfs_data *e2data, ext2_ino_t parent, const char *name, int len, ext2_ino_t *ino);
+
+void do_dcache_add (struct extfs_data *e2data, ext2_ino_t parent, const char *name, int len, ext2_ino_t ino);
+
+void do_dcache_remove (struct extfs_data *e2data, ext2_ino_t parent, const char *name);
+
+void do_dcache_purge_dir (struct extfs_data *e2data, ext2_ino_t parent);
+
+errcode_t do_htree_lookup (ext2_filsys e2fs, ext2_ino_t dir, const char *name, int len, ext2_ino_t *ino);
+
+int do_map_blocks (ext2_filsys e2fs, ext2_ino_t ino, struct ext2_inode *inode, blk64_t lblk, blk64_t count, struct extfs_blockrun *runs);
+
+int do_delalloc_write (struct extfs_data *e2data, struct extfs_openfile *file, const char *buf, size_t size, off_t offset);
+
+int do_delalloc_flush (struct extfs_data *e2data, struct extfs_openfile *file);
+
+void do_delalloc_read (struct extfs_openfile *file, char *buf, size_t size, off_t offset);
+
+void do_delalloc_stat (struct extfs_openfile *file, struct stat *stbuf);
+
+extern io_manager cache_io_manager;
+
+void do_cacheio_setup (size_t size, size_t readahead);
+
+errcode_t do_cacheio_writeback (io_channel channel, time_t older);
+
+int do_cacheio_get_stats (io_channel channel, struct cacheio_stats *stats);
+
+int do_flusher_start (struct extfs_data *e2data);
+
+void do_flusher_stop (struct extfs_data *e2data);
+
 /* read support */
 
 int op_access (const char *path, int mask);
@@ -71,6 +71,7 @@ int do_create (ext2_filsys e2fs, const char *path, mode_t mode, dev_t dev, const
 	ext2_ino_t n_ino;
 
 	struct fuse_context *ctx;
+	struct extfs_data *e2data;
 
 	debugf("enter");
 	debugf("path = %s, mode: 0%o", path, mode);
@@ -111,6 +112,10 @@ int do_create (ext2_filsys e2fs, const char *path, mode_t mode, dev_t dev, const
 		return -EIO;
 	}
 
+	ctx = fuse_get_context();
+	e2data = ctx->private_data;
+	do_dcache_add(e2data, ino, r_path, strlen(r_path), n_ino);
+
 	if (ext2fs_test_inode_bitmap(e2fs->inode_map, n_ino)) {
 		debugf("inode already set");
 	}
@@ -122,7 +127,6 @@ int do_create (ext2_filsys e2fs, const char *path, mode_t mode, dev_t dev, const
 	inode.i_atime = inode.i_ctime = inode.i_mtime = tm;
 	inode.i_links_count = 1;
 	inode.i_size = 0;
-	ctx = fuse_get_context();
 	if (ctx) {
 		ext2_write_uid(&inode, ctx->uid);
 		ext2_write_gid(&inode, ctx->gid);
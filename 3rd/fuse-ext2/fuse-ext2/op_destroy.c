@@ -23,13 +23,26 @@
 void op_destroy (void *userdata)
 {
 	errcode_t rc;
+	struct cacheio_stats stats;
+	struct extfs_data *e2data = userdata;
 	ext2_filsys e2fs = current_ext2fs();
 
 	debugf("enter");
+	do_flusher_stop(e2data);
+	if (e2data->readonly == 0) {
+		do_flush_files(e2data, time(NULL));
+	}
+	if (do_cacheio_get_stats(e2fs->io, &stats) == 0) {
+		debugf("block cache: %llu hits, %llu misses, %llu read ahead, %llu blocks written in %llu runs",
+			stats.hits, stats.misses, stats.readahead, stats.written, stats.writebacks);
+	}
 	rc = ext2fs_close(e2fs);
 	if (rc) {
 		debugf("Error while trying to close ext2 filesystem");
 	}
 	e2fs = NULL;
+	do_dcache_free(e2data);
+	pthread_mutex_destroy(&e2data->iolock);
+	pthread_rwlock_destroy(&e2data->lock);
 	debugf("leave");
 }
@@ -25,11 +25,27 @@ int op_fgetattr (const char *path, struct stat *stbuf, struct fuse_file_info *fi
 	int rt;
 	ext2_ino_t ino;
 	struct ext2_inode inode;
+	struct extfs_openfile *file;
+	ext2_file_t efile = EXT2FS_FILE(fi->fh);
 	ext2_filsys e2fs = current_ext2fs();
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 
 	debugf("enter");
-	debugf("path = %s", path);
-	
+	debugf("path = %s (%p)", path, efile);
+
+	if (efile != NULL) {
+		ino = ext2fs_file_get_inode_num(efile);
+		inode = *ext2fs_file_get_inode(efile);
+		do_fillstatbuf(e2fs, ino, &inode, stbuf);
+		file = do_openfile_find(e2data, ino);
+		if (file != NULL) {
+			do_delalloc_stat(file, stbuf);
+		}
+		debugf("leave");
+		return 0;
+	}
+
 	rt = do_check(path);
 	if (rt != 0) {
 		debugf("do_check(%s); failed", path);
@@ -22,8 +22,12 @@
 
 int op_flush (const char *path, struct fuse_file_info *fi)
 {
+	int rt;
 	errcode_t rc;
+	struct extfs_openfile *file;
 	ext2_file_t efile = EXT2FS_FILE(fi->fh);
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 
 	debugf("enter");
 	debugf("path = %s (%p)", path, efile);
@@ -32,10 +36,20 @@ int op_flush (const char *path, struct fuse_file_info *fi)
 		return -ENOENT;
 	}
 	
+	file = do_openfile_find(e2data, ext2fs_file_get_inode_num(efile));
+	if (file != NULL) {
+		rt = do_delalloc_flush(e2data, file);
+		if (rt) {
+			return rt;
+		}
+	}
 	rc = ext2fs_file_flush(efile);
 	if (rc) {
 		return -EIO;
 	}
+	if (file != NULL) {
+		file->dirty = 0;
+	}
 	
 	debugf("leave");
 	return 0;
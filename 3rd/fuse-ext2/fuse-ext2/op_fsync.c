@@ -22,16 +22,25 @@
 
 int op_fsync (const char *path, int datasync, struct fuse_file_info *fi)
 {
+	int rt;
 	errcode_t rc;
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 	ext2_filsys e2fs = current_ext2fs();
 
 	debugf("enter");
 	debugf("path = %s (%p)", path, fi);
 	
+	/* flush every dirty file buffer, not only this one */
+	rt = do_flush_files(e2data, time(NULL));
+	if (rt != 0) {
+		return rt;
+	}
 	rc = ext2fs_flush(e2fs);
 	if (rc) {
 		return -EIO;
 	}
+	e2data->dirty = 0;
 
 	debugf("leave");
 	return 0;
@@ -25,7 +25,10 @@ int op_getattr (const char *path, struct stat *stbuf)
 	int rt;
 	ext2_ino_t ino;
 	struct ext2_inode inode;
+	struct extfs_openfile *file;
 	ext2_filsys e2fs = current_ext2fs();
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 
 	debugf("enter");
 	debugf("path = %s", path);
@@ -42,6 +45,10 @@ int op_getattr (const char *path, struct stat *stbuf)
 		return rt;
 	}
 	do_fillstatbuf(e2fs, ino, &inode, stbuf);
+	file = do_openfile_find(e2data, ino);
+	if (file != NULL) {
+		do_delalloc_stat(file, stbuf);
+	}
 
 	debugf("path: %s, size: %d", path, stbuf->st_size);
 	debugf("leave");
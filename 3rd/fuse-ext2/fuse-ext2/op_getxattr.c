@@ -92,7 +92,9 @@ static int do_getxattr(ext2_filsys e2fs, struct ext2_inode *node, const char *na
 	if (!buf) {
 		return -ENOMEM;
 	}
+	fs_iolock();
 	ext2fs_read_ext_attr(e2fs, node->i_file_acl, buf);
+	fs_iounlock();
 
 	attr_start = buf + sizeof(struct ext2_ext_attr_header);
 	entry = (struct ext2_ext_attr_entry *) attr_start;
@@ -23,14 +23,24 @@
 void * op_init (struct fuse_conn_info *conn)
 {
 	errcode_t rc;
+	io_manager manager;
 	struct fuse_context *cntx=fuse_get_context();
 	struct extfs_data *e2data=cntx->private_data;
 
 	debugf("enter %s", e2data->device);
 
+	pthread_rwlock_init(&e2data->lock, NULL);
+	pthread_mutex_init(&e2data->iolock, NULL);
+
+	manager = unix_io_manager;
+	if (e2data->cache_size > 0) {
+		do_cacheio_setup((size_t) e2data->cache_size * 1024 * 1024, (size_t) e2data->readahead * 1024);
+		manager = cache_io_manager;
+	}
+
 	rc = ext2fs_open(e2data->device, 
 			(e2data->readonly) ? 0 : EXT2_FLAG_RW,
-			0, 0, unix_io_manager, &e2data->e2fs);
+			0, 0, manager, &e2data->e2fs);
 	if (rc) {
 		debugf("Error while trying to open %s", e2data->device);
 		exit(1);
@@ -46,6 +56,17 @@ void * op_init (struct fuse_conn_info *conn)
 	}
 	debugf("FileSystem %s", (e2data->e2fs->flags & EXT2_FLAG_RW) ? "Read&Write" : "ReadOnly");
 
+	if (do_dcache_init(e2data) != 0) {
+		debugf("Error while allocating the name cache");
+		ext2fs_close(e2data->e2fs);
+		exit(1);
+	}
+
+	if (e2data->readonly == 0 && do_flusher_start(e2data) != 0) {
+		ext2fs_close(e2data->e2fs);
+		exit(1);
+	}
+
 	debugf("leave");
 
 	return e2data;
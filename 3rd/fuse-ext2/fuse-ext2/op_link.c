@@ -30,6 +30,8 @@ int op_link (const char *source, const char *dest)
 	ext2_ino_t d_ino;
 	struct ext2_inode s_inode;
 	struct ext2_inode d_inode;
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 	ext2_filsys e2fs = current_ext2fs();
 
 	debugf("source: %s, dest: %s", source, dest);
@@ -79,6 +81,7 @@ int op_link (const char *source, const char *dest)
 		free_split(p_path, r_path);
 		return -EIO;
 	}
+	do_dcache_add(e2data, d_ino, r_path, strlen(r_path), s_ino);
 
 	d_inode.i_mtime = d_inode.i_ctime = s_inode.i_ctime = e2fs->now ? e2fs->now : time(NULL);
 	s_inode.i_links_count += 1;
@@ -33,6 +33,7 @@ int op_mkdir (const char *path, mode_t mode)
 	struct ext2_inode inode;
 
 	struct fuse_context *ctx;
+	struct extfs_data *e2data;
 
 	ext2_filsys e2fs = current_ext2fs();
 
@@ -72,6 +73,9 @@ int op_mkdir (const char *path, mode_t mode)
 		free_split(p_path, r_path);
 		return -EIO;
 	}
+	ctx = fuse_get_context();
+	e2data = ctx->private_data;
+	do_dcache_remove(e2data, ino, r_path);
 
 	rt = do_readinode(e2fs, path, &ino, &inode);
 	if (rt) {
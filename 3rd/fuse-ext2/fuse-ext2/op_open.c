@@ -27,6 +27,7 @@ ext2_file_t do_open (ext2_filsys e2fs, const char *path, int flags)
 	ext2_ino_t ino;
 	ext2_file_t efile;
 	struct ext2_inode inode;
+	struct extfs_openfile *file;
 	struct fuse_context *cntx = fuse_get_context();
 	struct extfs_data *e2data = cntx->private_data;
 
@@ -45,21 +46,37 @@ ext2_file_t do_open (ext2_filsys e2fs, const char *path, int flags)
 		return NULL;
 	}
 
-	rc = ext2fs_file_open2(
-			e2fs,
-			ino,
-			&inode,
-			(((flags & O_ACCMODE) != 0) ? EXT2_FILE_WRITE : 0) | EXT2_FILE_SHARED_INODE, 
-			&efile);
-	if (rc) {
+	if ((flags & O_ACCMODE) != 0 && e2data->readonly) {
+		debugf("%s: write access on a read-only mount", path);
 		return NULL;
 	}
 
+	file = do_openfile_find(e2data, ino);
+	if (file != NULL) {
+		file->refs++;
+		efile = file->efile;
+	} else {
+		rc = ext2fs_file_open2(
+				e2fs,
+				ino,
+				&inode,
+				(e2data->readonly ? 0 : EXT2_FILE_WRITE) | EXT2_FILE_SHARED_INODE,
+				&efile);
+		if (rc) {
+			return NULL;
+		}
+		if (do_openfile_add(e2data, ino, efile) == NULL) {
+			ext2fs_file_close(efile);
+			return NULL;
+		}
+	}
+
 	if (e2data->readonly == 0) {
 		inode.i_atime = e2fs->now ? e2fs->now : time(NULL);
 		rt = do_writeinode(e2fs, ino, &inode);
 		if (rt) {
 			debugf("do_writeinode(%s, &ino, &inode); failed", path);
+			do_release(efile);
 			return NULL;
 		}
 	}
@@ -20,31 +20,185 @@
 
 #include "fuse-ext2.h"
 
-int op_read (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+/*
+ * reads of files that are not inline go around the per-file block buffer
+ * of libext2fs. the blocks of the request are mapped into runs up front,
+ * see do_map_blocks(), and whole blocks are read with one
+ * io_channel_read_blk64() per run straight into the fuse buffer. only the
+ * partial blocks at the edges of the request are read into a bounce
+ * buffer. holes and unwritten extents read back as zeroes. data held
+ * back for delayed allocation is copied over the result, reads run under
+ * the shared fs lock and must not allocate blocks to write it out.
+ */
+
+static int read_buffered (ext2_file_t efile, char *buf, size_t size, off_t offset)
 {
 	__u64 pos;
 	errcode_t rc;
 	unsigned int bytes;
-	ext2_file_t efile = EXT2FS_FILE(fi->fh);
-	ext2_filsys e2fs = current_ext2fs();
-
-	debugf("enter");
-	debugf("path = %s", path);
 
-	efile = do_open(e2fs, path, O_RDONLY);
 	rc = ext2fs_file_llseek(efile, offset, SEEK_SET, &pos);
 	if (rc) {
-		do_release(efile);
 		return -EINVAL;
 	}
-
 	rc = ext2fs_file_read(efile, buf, size, &bytes);
 	if (rc) {
-		do_release(efile);
 		return -EIO;
 	}
-	do_release(efile);
+	return bytes;
+}
+
+static errcode_t read_runs (ext2_filsys e2fs, struct extfs_blockrun *runs, int nruns, char *buf, size_t size, off_t offset)
+{
+	int i;
+	char *dst;
+	char *bounce;
+	blk64_t j;
+	blk64_t n;
+	blk64_t lblk;
+	errcode_t rc;
+	size_t boff;
+	size_t bend;
+	size_t bs = e2fs->blocksize;
+	blk64_t first = offset / bs;
+	blk64_t last = (offset + size - 1) / bs;
+
+	rc = 0;
+	bounce = NULL;
+	lblk = first;
+	for (i = 0; i < nruns && rc == 0; i++) {
+		for (j = 0; j < runs[i].count && rc == 0; j += n) {
+			boff = (lblk + j == first) ? offset % bs : 0;
+			bend = (lblk + j == last) ? (offset + size - 1) % bs + 1 : bs;
+			if (boff != 0 || bend != bs) {
+				n = 1;
+				if (bounce == NULL) {
+					bounce = malloc(bs);
+					if (bounce == NULL) {
+						rc = EXT2_ET_NO_MEMORY;
+						break;
+					}
+				}
+				if (runs[i].pblk == 0 || runs[i].uninit) {
+					memset(bounce, 0, bs);
+				} else {
+					rc = io_channel_read_blk64(e2fs->io, runs[i].pblk + j, 1, bounce);
+				}
+				memcpy(buf + (lblk + j) * bs + boff - offset, bounce + boff, bend - boff);
+				continue;
+			}
+			/* whole blocks up to the end of the run or a partial last block */
+			for (n = 1; j + n < runs[i].count && !(lblk + j + n == last && (offset + size) % bs != 0); n++)
+				;
+			dst = buf + (lblk + j) * bs - offset;
+			if (runs[i].pblk == 0 || runs[i].uninit) {
+				memset(dst, 0, n * bs);
+			} else {
+				rc = io_channel_read_blk64(e2fs->io, runs[i].pblk + j, n, dst);
+			}
+		}
+		lblk += runs[i].count;
+	}
+	free(bounce);
+	return rc;
+}
+
+int op_read (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	int rt;
+	int nruns;
+	__u64 fsize;
+	__u64 dsize;
+	blk64_t first;
+	blk64_t count;
+	errcode_t rc;
+	ext2_filsys e2fs;
+	struct extfs_blockrun *runs;
+	struct ext2_inode inode;
+	struct extfs_openfile *file;
+	ext2_file_t efile = EXT2FS_FILE(fi->fh);
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
+
+	debugf("enter");
+	debugf("path = %s (%p)", path, efile);
+
+	if (efile == NULL) {
+		return -ENOENT;
+	}
+
+	file = do_openfile_find(e2data, ext2fs_file_get_inode_num(efile));
+	if (file == NULL) {
+		return -EBADF;
+	}
+	e2fs = ext2fs_file_get_fs(efile);
+
+	if (!file->direct) {
+		pthread_mutex_lock(&file->lock);
+		fs_iolock();
+		rt = read_buffered(efile, buf, size, offset);
+		fs_iounlock();
+		pthread_mutex_unlock(&file->lock);
+		debugf("leave");
+		return rt;
+	}
+
+	/* the inode and the held back data only change under the exclusive lock */
+	inode = *ext2fs_file_get_inode(efile);
+	dsize = EXT2_I_SIZE(&inode);
+	fsize = dsize;
+	if (file->wlen > 0 && (__u64) file->woff + file->wlen > fsize) {
+		fsize = file->woff + file->wlen;
+	}
+	if ((__u64) offset >= fsize || size == 0) {
+		return 0;
+	}
+	if (size > fsize - offset) {
+		size = fsize - offset;
+	}
+	/* past the size on disk there is only what is held back */
+	dsize = ((__u64) offset < dsize) ? dsize - offset : 0;
+	if (dsize > size) {
+		dsize = size;
+	}
+	if (dsize < size) {
+		memset(buf + dsize, 0, size - dsize);
+	}
+	if (dsize == 0) {
+		do_delalloc_read(file, buf, size, offset);
+		debugf("leave");
+		return size;
+	}
+
+	first = offset / e2fs->blocksize;
+	count = (offset + dsize - 1) / e2fs->blocksize - first + 1;
+	runs = malloc(count * sizeof(struct extfs_blockrun));
+	if (runs == NULL) {
+		return -ENOMEM;
+	}
+	fs_iolock();
+	nruns = do_map_blocks(e2fs, file->ino, &inode, first, count, runs);
+	fs_iounlock();
+	if (nruns < 0) {
+		free(runs);
+		return -EIO;
+	}
+
+	/* the cache manager locks itself, reads through it run in parallel */
+	if (e2fs->io->manager != cache_io_manager) {
+		fs_iolock();
+	}
+	rc = read_runs(e2fs, runs, nruns, buf, dsize, offset);
+	if (e2fs->io->manager != cache_io_manager) {
+		fs_iounlock();
+	}
+	free(runs);
+	if (rc) {
+		debugf("io_channel_read_blk64(e2fs->io, ...); failed");
+		return -EIO;
+	}
+	do_delalloc_read(file, buf, size, offset);
 
 	debugf("leave");
-	return bytes;
+	return size;
 }
@@ -25,81 +25,49 @@ struct dir_walk_data {
 	fuse_fill_dir_t filler;
 };
 
-//#define _USE_DIR_ITERATE2 1
-#if defined(_USE_DIR_ITERATE2) && (_USE_DIR_ITERATE2 == 1)
-static int walk_dir2 (ext2_ino_t dir, int   entry, struct ext2_dir_entry *dirent, int offset, int blocksize, char *buf, void *vpsid)
-{
-	int res;
-	int len;
-	struct stat st;
-	unsigned char type;
-	if (dirent->name_len <= 0) {
-		return 0;
-	}
-	struct dir_walk_data *psid = (struct dir_walk_data *) vpsid;
-	memset(&st, 0, sizeof(st));
-
-	len = dirent->name_len & 0xff;
-	dirent->name[len] = 0; // bug wraparound
+/*
+ * names and types come from the directory entries alone, no inode is
+ * read while listing. fuse only looks at the type bits of st_mode here,
+ * the attributes are read when they are asked for.
+ */
+static const mode_t dirent_modes[] = {
+	[EXT2_FT_UNKNOWN] = 0,
+	[EXT2_FT_REG_FILE] = S_IFREG,
+	[EXT2_FT_DIR] = S_IFDIR,
+	[EXT2_FT_CHRDEV] = S_IFCHR,
+	[EXT2_FT_BLKDEV] = S_IFBLK,
+	[EXT2_FT_FIFO] = S_IFIFO,
+	[EXT2_FT_SOCK] = S_IFSOCK,
+	[EXT2_FT_SYMLINK] = S_IFLNK,
+};
 
-	switch  (dirent->name_len >> 8) {
-		case EXT2_FT_UNKNOWN: 	type = DT_UNKNOWN;	break;
-		case EXT2_FT_REG_FILE:	type = DT_REG;		break;
-		case EXT2_FT_DIR:	type = DT_DIR;		break;
-		case EXT2_FT_CHRDEV:	type = DT_CHR;		break;
-		case EXT2_FT_BLKDEV:	type = DT_BLK;		break;
-		case EXT2_FT_FIFO:	type = DT_FIFO;		break;
-		case EXT2_FT_SOCK:	type = DT_SOCK;		break;
-		case EXT2_FT_SYMLINK:	type = DT_LNK;		break;
-		default:		type = DT_UNKNOWN;	break;
-	}
-	if (type == DT_UNKNOWN) {
-		return 0;
-	}
-	{
-		int rc;
-		struct ext2_inode inode;
-		ext2_filsys e2fs = current_ext2fs();
-		rc = ext2fs_read_inode(e2fs, dirent->inode, &inode);
-		if (rc) {
-			debugf("ext2fs_read_inode(%d, &inode); failed", dirent->inode);
-			return 0;
-		}
-	}
-	st.st_ino = dirent->inode;
-	st.st_mode = type << 12;
-	debugf("%s %d %d %d", dirent->name, dirent->name_len & 0xff, dirent->name_len >> 8, type);
-	res = psid->filler(psid->buf, dirent->name, &st, 0);
-	if (res != 0) {
-		return BLOCK_ABORT;
-	}
-	return 0;
-}
-#else
 static int walk_dir (struct ext2_dir_entry *de, int offset, int blocksize, char *buf, void *priv_data)
 {
 	int ret;
 	size_t flen;
-	char *fname;
+	struct stat st;
+	unsigned int type;
+	char fname[EXT2_NAME_LEN + 1];
 	struct dir_walk_data *b = priv_data;
 
-	debugf("enter");
-
 	flen = de->name_len & 0xff;
-	fname = (char *) malloc(sizeof(char) * (flen + 1));
-	if (fname == NULL) {
-		debugf("s = (char *) malloc(sizeof(char) * (%d + 1)); failed", flen);
-		return -ENOMEM;
+	memcpy(fname, de->name, flen);
+	fname[flen] = '\0';
+
+	type = de->name_len >> 8;
+	memset(&st, 0, sizeof(st));
+	st.st_ino = de->inode;
+	if (type < sizeof(dirent_modes) / sizeof(dirent_modes[0])) {
+		st.st_mode = dirent_modes[type];
 	}
-	snprintf(fname, flen + 1, "%s", de->name);
-	debugf("b->filler(b->buf, %s, NULL, 0);", fname);
-	ret = b->filler(b->buf, fname, NULL, 0);
-	free(fname);
-	
-	debugf("leave");
-	return ret;
+
+	debugf("b->filler(b->buf, %s, %o, 0);", fname, st.st_mode);
+	ret = b->filler(b->buf, fname, &st, 0);
+	if (ret != 0) {
+		return DIRENT_ABORT;
+	}
+	return 0;
 }
-#endif
 
 int op_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
@@ -121,11 +89,9 @@ int op_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 		return rt;
 	}
 
-#if defined(_USE_DIR_ITERATE2) && (_USE_DIR_ITERATE2 == 1)
-	rc = ext2fs_dir_iterate2(e2fs,ino, DIRENT_FLAG_INCLUDE_EMPTY, NULL, walk_dir2, &dwd);
-#else
+	fs_iolock();
 	rc = ext2fs_dir_iterate(e2fs, ino, 0, NULL, walk_dir, &dwd);
-#endif
+	fs_iounlock();
 
 	if (rc) {
 		debugf("Error while trying to ext2fs_dir_iterate %s", path);
@@ -51,7 +51,9 @@ int op_readlink (const char *path, char *buf, size_t size)
 			debugf("ext2fs_get_mem(EXT2_BLOCK_SIZE(e2fs->super), &b); failed");
 			return -ENOMEM;
 		}
+		fs_iolock();
 		rc = io_channel_read_blk(e2fs->io, inode.i_block[0], 1, b);
+		fs_iounlock();
 		if (rc) {
 			ext2fs_free_mem(&b);
 			debugf("io_channel_read_blk(e2fs->io, inode.i_block[0], 1, b); failed");
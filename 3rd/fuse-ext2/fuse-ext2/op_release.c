@@ -22,7 +22,15 @@
 
 int do_release (ext2_file_t efile)
 {
+	int rt;
 	errcode_t rc;
+	int unlinked;
+	ext2_ino_t ino;
+	ext2_filsys e2fs;
+	struct ext2_inode inode;
+	struct extfs_openfile *file;
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 
 	debugf("enter");
 	debugf("path = (%p)", efile);
@@ -30,11 +38,51 @@ int do_release (ext2_file_t efile)
 	if (efile == NULL) {
 		return -ENOENT;
 	}
+
+	e2fs = ext2fs_file_get_fs(efile);
+	ino = ext2fs_file_get_inode_num(efile);
+	unlinked = 0;
+	file = do_openfile_find(e2data, ino);
+	if (file != NULL) {
+		if (--file->refs > 0) {
+			debugf("leave");
+			return 0;
+		}
+		unlinked = file->unlinked;
+		/* held back data of an unlinked file would be freed right away */
+		if (!unlinked) {
+			rt = do_delalloc_flush(e2data, file);
+			if (rt) {
+				/* keep the file and its data, the flusher tries again */
+				debugf("do_delalloc_flush(e2data, file); failed");
+				if (file->dirty == 0) {
+					file->dirty = time(NULL);
+				}
+				return rt;
+			}
+		}
+		do_openfile_remove(e2data, file);
+	}
+
 	rc = ext2fs_file_close(efile);
 	if (rc) {
 		return -EIO;
 	}
 
+	/* last handle of an unlinked inode is gone, free it now */
+	if (unlinked) {
+		rc = ext2fs_read_inode(e2fs, ino, &inode);
+		if (rc) {
+			debugf("ext2fs_read_inode(e2fs, ino, &inode); failed");
+			return -EIO;
+		}
+		rt = do_killfilebyinode(e2fs, ino, &inode);
+		if (rt) {
+			debugf("do_killfilebyinode(e2fs, ino, &inode); failed");
+			return rt;
+		}
+	}
+
 	debugf("leave");
 	return 0;
 }
@@ -76,6 +76,8 @@ int op_rename (const char *source, const char *dest)
 	struct ext2_inode dest_inode;
 	struct ext2_inode d_src_inode;
 	struct ext2_inode d_dest_inode;
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 	ext2_filsys e2fs = current_ext2fs();
 
 	debugf("source: %s, dest: %s", source, dest);
@@ -200,6 +202,7 @@ int op_rename (const char *source, const char *dest)
 		rt = -EIO;
 		goto out;
 	}
+	do_dcache_add(e2data, d_dest_ino, r_dest, strlen(r_dest), src_ino);
 
 	/* Special case: if moving dir across different parents fix counters and '..' */
 	if (LINUX_S_ISDIR(src_inode.i_mode) && d_src_ino != d_dest_ino) {
@@ -242,6 +245,7 @@ int op_rename (const char *source, const char *dest)
 		rt = -EIO;
 		goto out;
 	}
+	do_dcache_remove(e2data, d_src_ino, r_src);
 
 out:	free_split(p_src, r_src);
 	free_split(p_dest, r_dest);
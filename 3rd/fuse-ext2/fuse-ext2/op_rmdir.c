@@ -81,6 +81,8 @@ int op_rmdir (const char *path)
 	ext2_ino_t r_ino;
 	struct ext2_inode r_inode;
 	
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 	ext2_filsys e2fs = current_ext2fs();
 
 	debugf("enter");
@@ -131,6 +133,8 @@ int op_rmdir (const char *path)
 		free_split(p_path, r_path);
 		return -EIO;
 	}
+	do_dcache_remove(e2data, p_ino, r_path);
+	do_dcache_purge_dir(e2data, r_ino);
 
 	rt = do_killfilebyinode(e2fs, r_ino, &r_inode);
 	if (rt) {
@@ -27,7 +27,10 @@ int op_truncate (const char *path, off_t length)
 	ext2_ino_t ino;
 	struct ext2_inode inode;
 	ext2_file_t efile;
+	struct extfs_openfile *file;
 	ext2_filsys e2fs = current_ext2fs();
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 
 	debugf("enter");
 	debugf("path = %s", path);
@@ -43,6 +46,16 @@ int op_truncate (const char *path, off_t length)
 		return -ENOENT;
 	}
 
+	file = do_openfile_find(e2data, ext2fs_file_get_inode_num(efile));
+	if (file != NULL) {
+		rt = do_delalloc_flush(e2data, file);
+		if (rt) {
+			debugf("do_delalloc_flush(e2data, file); failed");
+			do_release(efile);
+			return rt;
+		}
+	}
+
 	rc = ext2fs_file_set_size2(efile, length);
 	if (rc) {
 		do_release(efile);
@@ -80,6 +93,51 @@ int op_truncate (const char *path, off_t length)
 
 int op_ftruncate (const char *path, off_t length, struct fuse_file_info *fi)
 {
-	(void) fi;
-	return op_truncate(path, length);
+	int rt;
+	errcode_t rc;
+	ext2_ino_t ino;
+	struct ext2_inode inode;
+	struct extfs_openfile *file;
+	ext2_file_t efile = EXT2FS_FILE(fi->fh);
+	ext2_filsys e2fs = current_ext2fs();
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
+
+	debugf("enter");
+	debugf("path = %s (%p)", path, efile);
+
+	if (efile == NULL) {
+		return op_truncate(path, length);
+	}
+
+	file = do_openfile_find(e2data, ext2fs_file_get_inode_num(efile));
+	if (file != NULL) {
+		rt = do_delalloc_flush(e2data, file);
+		if (rt) {
+			debugf("do_delalloc_flush(e2data, file); failed");
+			return rt;
+		}
+	}
+
+	rc = ext2fs_file_set_size2(efile, length);
+	if (rc) {
+		debugf("ext2fs_file_set_size(efile, %d); failed", length);
+		if (rc == EXT2_ET_FILE_TOO_BIG) {
+			return -EFBIG;
+		}
+		return -EIO;
+	}
+
+	ino = ext2fs_file_get_inode_num(efile);
+	inode = *ext2fs_file_get_inode(efile);
+	inode.i_ctime = e2fs->now ? e2fs->now : time(NULL);
+	inode.i_mtime = e2fs->now ? e2fs->now : time(NULL);
+	rt = do_writeinode(e2fs, ino, &inode);
+	if (rt) {
+		debugf("do_writeinode(e2fs, ino, &inode); failed");
+		return -EIO;
+	}
+
+	debugf("leave");
+	return 0;
 }
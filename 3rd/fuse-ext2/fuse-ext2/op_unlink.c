@@ -33,6 +33,8 @@ int op_unlink (const char *path)
 	struct ext2_inode p_inode;
 	struct ext2_inode r_inode;
 
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 	ext2_filsys e2fs = current_ext2fs();
 
 	debugf("enter");
@@ -77,6 +79,7 @@ int op_unlink (const char *path)
 		free_split(p_path, r_path);
 		return -EIO;
 	}
+	do_dcache_remove(e2data, p_ino, r_path);
 
 	p_inode.i_ctime = p_inode.i_mtime = e2fs->now ? e2fs->now : time(NULL);
 	rt = do_writeinode(e2fs, p_ino, &p_inode);
@@ -60,28 +60,36 @@ size_t do_write (ext2_file_t efile, const char *buf, size_t size, off_t offset)
 		}
 	}
 
-	rt = ext2fs_file_flush(efile);
-	if (rt != 0 && rt != EXT2_ET_BLOCK_ALLOC_FAIL) {
-		debugf("ext2_file_flush(efile); failed");
-		return -EIO;
-	}
-
 	debugf("leave");
 	return wsize;
 }
 
 int op_write (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	size_t rt;
+	int rt;
+	struct extfs_openfile *file;
 	ext2_file_t efile = EXT2FS_FILE(fi->fh);
-	ext2_filsys e2fs = current_ext2fs();
+	struct fuse_context *cntx = fuse_get_context();
+	struct extfs_data *e2data = cntx->private_data;
 
 	debugf("enter");
-	debugf("path = %s", path);
+	debugf("path = %s (%p)", path, efile);
 
-	efile = do_open(e2fs, path, O_WRONLY);
-	rt = do_write(efile, buf, size, offset);
-	do_release(efile);
+	if (efile == NULL) {
+		return -ENOENT;
+	}
+
+	file = do_openfile_find(e2data, ext2fs_file_get_inode_num(efile));
+	if (file != NULL && file->direct) {
+		rt = do_delalloc_write(e2data, file, buf, size, offset);
+	} else {
+		rt = do_write(efile, buf, size, offset);
+	}
+
+	/* held back data and the file buffer are left to the flusher */
+	if (file != NULL && file->dirty == 0) {
+		file->dirty = time(NULL);
+	}
 
 	debugf("leave");
 	return rt;
@@ -39,6 +39,11 @@
  * requests for all files (which the passthrough filesystem cannot
  * satisfy if it can't read the file in the underlying filesystem).
  *
+ * With --passthrough, files are registered as backing files with the
+ * kernel on open, so that read and write requests go straight to the
+ * source file without passing through this process.  This requires
+ * kernel support and CAP_SYS_ADMIN, and disables the writeback cache.
+ *
  * ## Source code ##
  * \include passthrough_hp.cc
  */
@@ -74,6 +79,8 @@
 #include <cstdio>
 #include <cstdlib>
 #include <list>
+#include <unordered_map>
+#include <vector>
 #include "cxxopts.hpp"
 #include <mutex>
 #include <fstream>
@@ -106,19 +113,25 @@ static void forget_one(fuse_ino_t ino, uint64_t n);
 // right inode number).
 typedef std::pair<ino_t, dev_t> SrcId;
 
-// Define a hash function for SrcId
+// Define a hash function for SrcId. Inode numbers are often small and
+// sequential, so mix all bits rather than XOR-ing the raw values
+// (which also makes every shard of the inode table equally likely).
 namespace std {
     template<>
     struct hash<SrcId> {
         size_t operator()(const SrcId& id) const {
-            return hash<ino_t>{}(id.first) ^ hash<dev_t>{}(id.second);
+            uint64_t h = static_cast<uint64_t>(id.first);
+            h ^= static_cast<uint64_t>(id.second) * 0x9e3779b97f4a7c15ULL;
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+            return static_cast<size_t>(h);
         }
     };
 }
 
-// Maps files in the source directory tree to inodes
-typedef std::unordered_map<SrcId, Inode> InodeMap;
-
 struct Inode {
     int fd {-1};
     dev_t src_dev {0};
@@ -126,6 +139,7 @@ struct Inode {
     int generation {0};
     uint64_t nopen {0};
     uint64_t nlookup {0};
+    int backing_id {0};
     std::mutex m;
 
     // Delete copy constructor and assignments. We could implement
@@ -140,12 +154,99 @@ struct Inode {
         if(fd > 0)
             close(fd);
     }
+
+    // Prepare a forgotten inode for re-use. The generation is bumped
+    // so that the recycled node id never pairs up with a generation
+    // that the kernel has already seen.
+    void recycle() {
+        if(fd > 0)
+            close(fd);
+        fd = -1;
+        src_dev = 0;
+        src_ino = 0;
+        generation++;
+        nopen = 0;
+        nlookup = 0;
+        backing_id = 0;
+    }
+};
+
+// Maps files in the source directory tree to inodes. The table is split
+// into shards, each with its own lock, so that lookups and forgets of
+// unrelated files do not contend. Forgotten inodes are kept on a
+// per-shard free list and handed out again by the next lookup.
+class InodeTable {
+public:
+    static constexpr size_t num_shards = 64;
+
+    struct alignas(64) Shard {
+        // Must be acquired *after* any Inode.m locks.
+        std::mutex m;
+        std::unordered_map<SrcId, Inode*> map; // protected by m
+        std::vector<Inode*> pool; // protected by m
+    };
+
+    InodeTable() = default;
+    InodeTable(const InodeTable&) = delete;
+    InodeTable& operator=(const InodeTable&) = delete;
+
+    ~InodeTable() {
+        for (auto& shard : shards) {
+            for (auto& entry : shard.map)
+                delete entry.second;
+            for (auto inode : shard.pool)
+                delete inode;
+        }
+    }
+
+    Shard& shard(const SrcId& id) {
+        return shards[std::hash<SrcId>{}(id) % num_shards];
+    }
+
+    // Returns the inode for *id*, creating it if necessary. The caller
+    // must hold the shard lock.
+    Inode* get(Shard& shard, const SrcId& id) {
+        auto it = shard.map.find(id);
+        if (it != shard.map.end())
+            return it->second;
+
+        Inode* inode;
+        if (shard.pool.empty()) {
+            inode = new Inode;
+        } else {
+            inode = shard.pool.back();
+            shard.pool.pop_back();
+        }
+        try {
+            shard.map.emplace(id, inode);
+        } catch (...) {
+            shard.pool.push_back(inode);
+            throw;
+        }
+        return inode;
+    }
+
+    // Removes *inode* from the table and returns it to the pool. The
+    // caller must hold the shard lock.
+    void erase(Shard& shard, Inode* inode) {
+        auto it = shard.map.find({inode->src_ino, inode->src_dev});
+        if (it == shard.map.end() || it->second != inode)
+            return;
+        shard.map.erase(it);
+        inode->recycle();
+        if (shard.pool.size() < max_pool)
+            shard.pool.push_back(inode);
+        else
+            delete inode;
+    }
+
+private:
+    static constexpr size_t max_pool = 1024;
+    Shard shards[num_shards];
 };
 
 struct Fs {
-    // Must be acquired *after* any Inode.m locks.
-    std::mutex mutex;
-    InodeMap inodes; // protected by mutex
+    InodeTable inodes;
     Inode root;
     double timeout;
     bool debug;
@@ -154,6 +255,7 @@ struct Fs {
     dev_t src_dev;
     bool nosplice;
     bool nocache;
+    bool passthrough;
 };
 static Fs fs{};
 
@@ -188,7 +290,17 @@ static void sfs_init(void *userdata, fuse_conn_info *conn) {
     if (conn->capable & FUSE_CAP_EXPORT_SUPPORT)
         conn->want |= FUSE_CAP_EXPORT_SUPPORT;
 
-    if (fs.timeout && conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+    if (fs.passthrough && conn->capable & FUSE_CAP_PASSTHROUGH)
+        conn->want |= FUSE_CAP_PASSTHROUGH;
+    else if (fs.passthrough) {
+        cerr << "WARNING: kernel does not support passthrough, "
+             << "falling back to normal I/O" << endl;
+        fs.passthrough = false;
+    }
+
+    // Passthrough and writeback cache are mutually exclusive
+    if (fs.timeout && !fs.passthrough &&
+        conn->capable & FUSE_CAP_WRITEBACK_CACHE)
         conn->want |= FUSE_CAP_WRITEBACK_CACHE;
 
     if (conn->capable & FUSE_CAP_FLOCK_LOCKS)
@@ -339,10 +451,11 @@ static int do_lookup(fuse_ino_t parent, const char *name,
     }
 
     SrcId id {e->attr.st_ino, e->attr.st_dev};
-    unique_lock<mutex> fs_lock {fs.mutex};
+    auto& shard = fs.inodes.shard(id);
+    unique_lock<mutex> fs_lock {shard.m};
     Inode* inode_p;
     try {
-        inode_p = &fs.inodes[id];
+        inode_p = fs.inodes.get(shard, id);
     } catch (std::bad_alloc&) {
         return ENOMEM;
     }
@@ -375,7 +488,7 @@ static int do_lookup(fuse_ino_t parent, const char *name,
     } else { // no existing inode
         /* This is just here to make Helgrind happy. It violates the
            lock ordering requirement (inode.m must be acquired before
-           fs.mutex), but this is of no consequence because at this
+           the shard lock), but this is of no consequence because at this
            point no other thread has access to the inode mutex */
         lock_guard<mutex> g {inode.m};
         inode.src_ino = e->attr.st_ino;
@@ -546,7 +659,8 @@ static void sfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
 			    if (fs.debug)
 				    cerr << "DEBUG: unlink: release inode " << e.attr.st_ino
 					    << "; fd=" << inode.fd << endl;
-			    lock_guard<mutex> g_fs {fs.mutex};
+			    auto& shard = fs.inodes.shard({inode.src_ino, inode.src_dev});
+			    lock_guard<mutex> g_fs {shard.m};
 			    close(inode.fd);
 			    inode.fd = -ENOENT;
 			    inode.generation++;
@@ -581,9 +695,10 @@ static void forget_one(fuse_ino_t ino, uint64_t n) {
         if (fs.debug)
             cerr << "DEBUG: forget: cleaning up inode " << inode.src_ino << endl;
         {
-            lock_guard<mutex> g_fs {fs.mutex};
+            auto& shard = fs.inodes.shard({inode.src_ino, inode.src_dev});
+            lock_guard<mutex> g_fs {shard.m};
             l.unlock();
-            fs.inodes.erase({inode.src_ino, inode.src_dev});
+            fs.inodes.erase(shard, &inode);
         }
     } else if (fs.debug)
             cerr << "DEBUG: forget: inode " << inode.src_ino
@@ -809,6 +924,39 @@ static void sfs_releasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
 }
 
 
+// Must be called with inode.m held. One backing file registration is
+// shared by all open files of the inode and kept until the last one
+// is released.
+static void passthrough_open(fuse_req_t req, Inode& inode, fuse_file_info *fi) {
+    if (!fs.passthrough)
+        return;
+
+    if (!inode.backing_id) {
+        inode.backing_id = fuse_passthrough_open(req, fi->fh);
+        if (!inode.backing_id) {
+            // Serve I/O for this file through the daemon instead
+            return;
+        }
+        if (fs.debug)
+            cerr << "DEBUG: passthrough: inode " << inode.src_ino
+                 << " backing_id " << inode.backing_id << endl;
+    }
+    fi->backing_id = inode.backing_id;
+    // I/O bypasses the page cache, and the kernel refuses passthrough
+    // opens that ask to keep it.
+    fi->keep_cache = 0;
+}
+
+
+// Must be called with inode.m held, after inode.nopen was decremented.
+static void passthrough_release(fuse_req_t req, Inode& inode) {
+    if (inode.backing_id && !inode.nopen) {
+        fuse_passthrough_close(req, inode.backing_id);
+        inode.backing_id = 0;
+    }
+}
+
+
 static void sfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
                        mode_t mode, fuse_file_info *fi) {
     Inode& inode_p = get_inode(parent);
@@ -836,6 +984,7 @@ static void sfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
     Inode& inode = get_inode(e.ino);
     lock_guard<mutex> g {inode.m};
     inode.nopen++;
+    passthrough_open(req, inode, fi);
     fuse_reply_create(req, &e, fi);
 }
 
@@ -890,6 +1039,7 @@ static void sfs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
     fi->keep_cache = (fs.timeout != 0);
     fi->noflush = (fs.timeout == 0 && (fi->flags & O_ACCMODE) == O_RDONLY);
     fi->fh = fd;
+    passthrough_open(req, inode, fi);
     fuse_reply_open(req, fi);
 }
 
@@ -898,6 +1048,7 @@ static void sfs_release(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
     Inode& inode = get_inode(ino);
     lock_guard<mutex> g {inode.m};
     inode.nopen--;
+    passthrough_release(req, inode);
     close(fi->fh);
     fuse_reply_err(req, 0);
 }
@@ -1179,7 +1330,9 @@ static cxxopts::ParseResult parse_options(int argc, char **argv) {
         ("help", "Print help")
         ("nocache", "Disable all caching")
         ("nosplice", "Do not use splice(2) to transfer data")
-        ("single", "Run single-threaded");
+        ("passthrough", "Let the kernel do read/write on the source files")
+        ("single", "Run single-threaded")
+        ("clone-fd", "Use a separate /dev/fuse fd for each thread");
 
     // FIXME: Find a better way to limit the try clause to just
     // opt_parser.parse() (cf. https://github.com/jarro2783/cxxopts/issues/146)
@@ -1202,6 +1355,7 @@ static cxxopts::ParseResult parse_options(int argc, char **argv) {
 
     fs.debug = options.count("debug") != 0;
     fs.nosplice = options.count("nosplice") != 0;
+    fs.passthrough = options.count("passthrough") != 0;
     char* resolved_path = realpath(argv[1], NULL);
     if (resolved_path == NULL)
         warn("WARNING: realpath() failed with");
@@ -1275,7 +1429,7 @@ int main(int argc, char *argv[]) {
 
     // Mount and run main loop
     struct fuse_loop_config loop_config;
-    loop_config.clone_fd = 0;
+    loop_config.clone_fd = options.count("clone-fd") != 0;
     loop_config.max_idle_threads = 10;
     if (fuse_session_mount(se, argv[2]) != 0)
         goto err_out3;
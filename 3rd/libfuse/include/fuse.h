@@ -275,6 +275,22 @@ struct fuse_config {
 	 */
 	int nullpath_ok;
 
+	/**
+	 * The maximum number of directory entries that are buffered per
+	 * open directory for readdir() implementations that pass zero
+	 * offsets to the filler function. Larger directories are read
+	 * in windows of up to this many entries, restarting the
+	 * readdir() operation for each window and skipping the entries
+	 * already returned. This costs a full listing per window, and
+	 * entries may be skipped or repeated if the directory changes in
+	 * between, so only enable it for filesystems whose readdir() can
+	 * be restarted cheaply and lists entries in a stable order.
+	 *
+	 * Zero (the default) means no limit: the whole directory is
+	 * buffered on the first readdir() call.
+	 */
+	unsigned int readdir_window;
+
 	/**
 	 * The remaining options are used by libfuse internally and
 	 * should not be touched.
@@ -555,8 +571,11 @@ struct fuse_operations {
 	 *
 	 * 1) The readdir implementation ignores the offset parameter, and
 	 * passes zero to the filler function's offset.  The filler
-	 * function will not return '1' (unless an error happens), so the
-	 * whole directory is read in a single readdir operation.
+	 * function returns '1' when an error happens or, if
+	 * fuse_config::readdir_window is set, when that many entries have
+	 * been buffered; in that case the readdir operation is repeated
+	 * from the start of the directory when the kernel asks for the
+	 * next entries.  The order of the entries should then be stable.
 	 *
 	 * 2) The readdir implementation keeps track of the offsets of the
 	 * directory entries.  It uses the offset parameter and always
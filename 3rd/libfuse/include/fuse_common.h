@@ -102,6 +102,12 @@ struct fuse_file_info {
 	/** Requested poll events.  Available in ->poll.  Only set on kernels
 	    which support it.  If unsupported, this field is set to zero. */
 	uint32_t poll_events;
+
+	/** Can be filled in by open and create with an id returned by
+	    fuse_passthrough_open() to let the kernel do read and write
+	    directly on the backing file.  Requires FUSE_CAP_PASSTHROUGH
+	    and cannot be combined with keep_cache. */
+	int32_t backing_id;
 };
 
 /**
@@ -398,6 +404,20 @@ struct fuse_loop_config {
  */
 #define FUSE_CAP_EXPLICIT_INVAL_DATA    (1 << 25)
 
+/**
+ * Indicates support for passing read and write requests for files
+ * opened with a backing file straight to that file in the kernel,
+ * without involving the filesystem daemon.
+ *
+ * Backing files are registered with fuse_passthrough_open() and
+ * attached to an open file through the `backing_id` field of
+ * `struct fuse_file_info`.  This is incompatible with
+ * FUSE_CAP_WRITEBACK_CACHE.
+ *
+ * This feature is disabled by default.
+ */
+#define FUSE_CAP_PASSTHROUGH            (1 << 29)
+
 /**
  * Ioctl flags
  *
@@ -527,10 +547,18 @@ struct fuse_conn_info {
 	 */
 	unsigned time_gran;
 
+	/**
+	 * When FUSE_CAP_PASSTHROUGH is enabled, this is the maximum
+	 * stacking depth of the filesystems that backing files may live
+	 * on.  The default of zero allows backing files on non-stacked
+	 * filesystems only.
+	 */
+	unsigned max_backing_stack_depth;
+
 	/**
 	 * For future use.
 	 */
-	unsigned reserved[22];
+	unsigned reserved[21];
 };
 
 struct fuse_session;
@@ -662,8 +690,9 @@ enum fuse_buf_copy_flags {
 	/**
 	 * Don't use splice(2)
 	 *
-	 * Always fall back to using read and write instead of
-	 * splice(2) to copy data from one file descriptor to another.
+	 * Never use splice(2) to copy data from one file descriptor to
+	 * another.  copy_file_range(2) is still tried before falling
+	 * back to read and write.
 	 *
 	 * If this flag is not set, then only fall back if splice is
 	 * unavailable.
@@ -792,6 +821,12 @@ size_t fuse_buf_size(const struct fuse_bufvec *bufv);
 /**
  * Copy data from one buffer vector to another
  *
+ * When copying between two file descriptors neither of which is a
+ * pipe, copy_file_range(2) is tried first, then splice(2) through a
+ * per-thread pipe, then read and write through a per-thread bounce
+ * buffer.  The method that worked is remembered for the pair of file
+ * descriptors.
+ *
  * @param dst destination buffer vector
  * @param src source buffer vector
  * @param flags flags controlling the copy
@@ -1347,7 +1347,7 @@ int fuse_reply_readlink(fuse_req_t req, const char *link);
  * Reply with open parameters
  *
  * currently the following members of 'fi' are used:
- *   fh, direct_io, keep_cache
+ *   fh, direct_io, keep_cache, backing_id
  *
  * Possible requests:
  *   open, opendir
@@ -1358,6 +1358,34 @@ int fuse_reply_readlink(fuse_req_t req, const char *link);
  */
 int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi);
 
+/**
+ * Register a backing file for kernel passthrough
+ *
+ * The returned id can be stored in the `backing_id` field of `struct
+ * fuse_file_info` before replying to open or create.  The kernel will
+ * then send read and write requests for that open file straight to
+ * the backing file.  The same id may be used for several open files.
+ *
+ * Requires FUSE_CAP_PASSTHROUGH and CAP_SYS_ADMIN.
+ *
+ * @param req request handle
+ * @param fd file descriptor of the backing file
+ * @return positive backing id on success, zero on failure
+ */
+int fuse_passthrough_open(fuse_req_t req, int fd);
+
+/**
+ * Unregister a backing file
+ *
+ * Open files that are already using the backing file keep working
+ * until they are released.
+ *
+ * @param req request handle
+ * @param backing_id id returned by fuse_passthrough_open()
+ * @return zero for success, -errno for failure
+ */
+int fuse_passthrough_close(fuse_req_t req, int backing_id);
+
 /**
  * Reply with number of bytes written
  *
@@ -1767,6 +1795,87 @@ int fuse_lowlevel_notify_store(struct fuse_session *se, fuse_ino_t ino,
 int fuse_lowlevel_notify_retrieve(struct fuse_session *se, fuse_ino_t ino,
 				  size_t size, off_t offset, void *cookie);
 
+/**
+ * Batch of cache invalidation notifications
+ *
+ * A batch collects inode and entry invalidations and sends them to
+ * the kernel with fuse_lowlevel_notify_batch_flush().  Invalidations
+ * of the same inode are merged into a single notification covering
+ * all of the requested ranges, and repeated invalidations of the same
+ * entry are sent only once.  This is useful for filesystems that learn
+ * about many changes at once (e.g. after synchronizing with a remote
+ * server), since every notification is a separate write to the
+ * kernel.
+ *
+ * A batch must not be used from more than one thread at a time.  The
+ * same restrictions as for fuse_lowlevel_notify_inval_inode() and
+ * fuse_lowlevel_notify_inval_entry() apply to the thread calling
+ * fuse_lowlevel_notify_batch_flush().
+ */
+struct fuse_notify_batch;
+
+/**
+ * Create a new, empty batch of notifications
+ *
+ * @param se the session object
+ * @return the new batch, or NULL on allocation failure
+ */
+struct fuse_notify_batch *fuse_lowlevel_notify_batch_new(struct fuse_session *se);
+
+/**
+ * Add an inode invalidation to the batch
+ *
+ * See fuse_lowlevel_notify_inval_inode() for the meaning of the
+ * parameters.  If the inode is already part of the batch, the ranges
+ * are merged.  The merged range may invalidate more of the cache than
+ * was requested.
+ *
+ * @param batch the batch
+ * @param ino the inode number
+ * @param off the offset in the inode where to start invalidating
+ *            or negative to invalidate attributes only
+ * @param len the amount of cache to invalidate or 0 for all
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_batch_inval_inode(struct fuse_notify_batch *batch,
+					   fuse_ino_t ino, off_t off, off_t len);
+
+/**
+ * Add an entry invalidation to the batch
+ *
+ * See fuse_lowlevel_notify_inval_entry() for the meaning of the
+ * parameters.  The name is copied.
+ *
+ * @param batch the batch
+ * @param parent inode number
+ * @param name file name
+ * @param namelen strlen() of file name
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_batch_inval_entry(struct fuse_notify_batch *batch,
+					   fuse_ino_t parent, const char *name,
+					   size_t namelen);
+
+/**
+ * Send all notifications of the batch to the kernel
+ *
+ * Notifications are sent in the order in which they were first added
+ * to the batch, and the batch is empty afterwards.  Invalidations of
+ * inodes and entries that are not (or no longer) cached by the kernel
+ * are not considered errors.
+ *
+ * @param batch the batch
+ * @return zero for success, or the first error encountered as -errno
+ */
+int fuse_lowlevel_notify_batch_flush(struct fuse_notify_batch *batch);
+
+/**
+ * Destroy a batch, discarding any notifications that were not flushed
+ *
+ * @param batch the batch
+ */
+void fuse_lowlevel_notify_batch_destroy(struct fuse_notify_batch *batch);
+
 
 /* ----------------------------------------------------------- *
  * Utility functions					       *
@@ -1990,6 +2099,44 @@ int fuse_session_loop_mt_32(struct fuse_session *se, struct fuse_loop_config *co
 #endif
 #endif
 
+/**
+ * Statistics of the multi-threaded event loop
+ *
+ * Counters are accumulated over all runs of fuse_session_loop_mt()
+ * for a session.  The CPU of a request is the CPU on which the worker
+ * thread was running when it received the request.
+ */
+struct fuse_loop_stats {
+	/** Requests received by worker threads */
+	uint64_t requests;
+
+	/** Worker threads started, each start wakes up a new thread */
+	uint64_t threads_started;
+
+	/** Requests received on a different CPU than the previous
+	    request of the same worker thread */
+	uint64_t migrations;
+
+	/** With -o percpu_clone_fd: requests received by a worker on
+	    the CPU that it is bound to, and on another CPU */
+	uint64_t local;
+	uint64_t remote;
+
+	uint64_t reserved[11];
+};
+
+/**
+ * Get the statistics of the multi-threaded event loop
+ *
+ * The event loop may still be running.  In that case the counters
+ * are a snapshot and may be slightly out of date.
+ *
+ * @param se the session
+ * @param stats the statistics are stored here
+ */
+void fuse_session_loop_stats(struct fuse_session *se,
+			     struct fuse_loop_stats *stats);
+
 /**
  * Flag a session as terminated.
  *
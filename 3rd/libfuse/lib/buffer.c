@@ -15,9 +15,58 @@
 #include "fuse_i.h"
 #include "fuse_lowlevel.h"
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Size of the per-thread bounce buffer and splice pipe */
+#define FUSE_BUF_COPY_SIZE (1024 * 1024)
+
+/* Number of fd pairs whose copy strategy is remembered per thread */
+#define FUSE_BUF_COPY_PAIRS 8
+
+enum fuse_buf_copy_strategy {
+	COPY_UNKNOWN = 0,
+	COPY_FILE_RANGE,
+	COPY_SPLICE_PIPE,
+	COPY_BOUNCE,
+};
+
+/*
+ * File descriptor numbers are reused after close, so a pair also
+ * records the files they referred to when the strategy was found.
+ */
+struct fuse_buf_copy_pair {
+	int srcfd;
+	int dstfd;
+	dev_t srcdev;
+	ino_t srcino;
+	dev_t dstdev;
+	ino_t dstino;
+	enum fuse_buf_copy_strategy strategy;
+};
+
+/*
+ * Per-thread state for fd to fd copies: a pipe for splicing between
+ * two non-pipe file descriptors, a bounce buffer for the read/write
+ * fallback and the strategy that last worked for recently used fd
+ * pairs.
+ */
+struct fuse_buf_copy_ctx {
+	int pipe[2];
+	size_t pipe_size;
+	char *buf;
+	struct fuse_buf_copy_pair pairs[FUSE_BUF_COPY_PAIRS];
+	unsigned next_pair;
+};
+
+static pthread_key_t copy_ctx_key;
+static pthread_once_t copy_ctx_once = PTHREAD_ONCE_INIT;
+static int copy_ctx_key_ok;
 
 size_t fuse_buf_size(const struct fuse_bufvec *bufv)
 {
@@ -107,19 +156,107 @@ static ssize_t fuse_buf_read(const struct fuse_buf *dst, size_t dst_off,
 	return copied;
 }
 
-static ssize_t fuse_buf_fd_to_fd(const struct fuse_buf *dst, size_t dst_off,
-				 const struct fuse_buf *src, size_t src_off,
-				 size_t len)
+static void copy_ctx_close_pipe(struct fuse_buf_copy_ctx *ctx)
+{
+	if (ctx->pipe[0] != -1) {
+		close(ctx->pipe[0]);
+		close(ctx->pipe[1]);
+		ctx->pipe[0] = ctx->pipe[1] = -1;
+	}
+}
+
+static void copy_ctx_destructor(void *data)
+{
+	struct fuse_buf_copy_ctx *ctx = data;
+
+	copy_ctx_close_pipe(ctx);
+	free(ctx->buf);
+	free(ctx);
+}
+
+static void copy_ctx_key_init(void)
+{
+	copy_ctx_key_ok = !pthread_key_create(&copy_ctx_key,
+					      copy_ctx_destructor);
+}
+
+static struct fuse_buf_copy_ctx *copy_ctx_get(void)
+{
+	struct fuse_buf_copy_ctx *ctx;
+
+	pthread_once(&copy_ctx_once, copy_ctx_key_init);
+	if (!copy_ctx_key_ok)
+		return NULL;
+
+	ctx = pthread_getspecific(copy_ctx_key);
+	if (ctx == NULL) {
+		ctx = calloc(1, sizeof(struct fuse_buf_copy_ctx));
+		if (ctx == NULL)
+			return NULL;
+
+		ctx->pipe[0] = ctx->pipe[1] = -1;
+		if (pthread_setspecific(copy_ctx_key, ctx) != 0) {
+			free(ctx);
+			return NULL;
+		}
+	}
+
+	return ctx;
+}
+
+static struct fuse_buf_copy_pair *copy_ctx_pair(struct fuse_buf_copy_ctx *ctx,
+						int srcfd, int dstfd)
+{
+	struct fuse_buf_copy_pair *pair;
+	struct stat srcst;
+	struct stat dstst;
+	unsigned i;
+
+	if (fstat(srcfd, &srcst) == -1 || fstat(dstfd, &dstst) == -1) {
+		memset(&srcst, 0, sizeof(srcst));
+		memset(&dstst, 0, sizeof(dstst));
+	}
+
+	for (i = 0; i < FUSE_BUF_COPY_PAIRS; i++) {
+		pair = &ctx->pairs[i];
+		if (pair->srcfd == srcfd && pair->dstfd == dstfd)
+			break;
+	}
+
+	if (i == FUSE_BUF_COPY_PAIRS) {
+		pair = &ctx->pairs[ctx->next_pair];
+		ctx->next_pair = (ctx->next_pair + 1) % FUSE_BUF_COPY_PAIRS;
+		pair->srcfd = srcfd;
+		pair->dstfd = dstfd;
+	} else if (pair->srcdev == srcst.st_dev &&
+		   pair->srcino == srcst.st_ino &&
+		   pair->dstdev == dstst.st_dev &&
+		   pair->dstino == dstst.st_ino) {
+		return pair;
+	}
+
+	/* New pair, or the fds have been closed and reused since */
+	pair->srcdev = srcst.st_dev;
+	pair->srcino = srcst.st_ino;
+	pair->dstdev = dstst.st_dev;
+	pair->dstino = dstst.st_ino;
+	pair->strategy = COPY_UNKNOWN;
+
+	return pair;
+}
+
+static ssize_t fuse_buf_bounce(const struct fuse_buf *dst, size_t dst_off,
+			       const struct fuse_buf *src, size_t src_off,
+			       size_t len, char *mem, size_t memsize)
 {
-	char buf[4096];
 	struct fuse_buf tmp = {
-		.size = sizeof(buf),
+		.size = memsize,
 		.flags = 0,
 	};
 	ssize_t res;
 	size_t copied = 0;
 
-	tmp.mem = buf;
+	tmp.mem = mem;
 
 	while (len) {
 		size_t this_len = min_size(tmp.size, len);
@@ -157,6 +294,229 @@ static ssize_t fuse_buf_fd_to_fd(const struct fuse_buf *dst, size_t dst_off,
 	return copied;
 }
 
+/*
+ * Returns -ENOTSUP if the strategy cannot be used for this pair of
+ * file descriptors and nothing has been copied, so that the caller may
+ * fall back to the next one.
+ */
+static ssize_t fuse_buf_copy_range(const struct fuse_buf *dst, size_t dst_off,
+				   const struct fuse_buf *src, size_t src_off,
+				   size_t len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	off_t *srcpos = NULL;
+	off_t *dstpos = NULL;
+	off_t srcpos_val;
+	off_t dstpos_val;
+	ssize_t res;
+	size_t copied = 0;
+
+	if (src->flags & FUSE_BUF_FD_SEEK) {
+		srcpos_val = src->pos + src_off;
+		srcpos = &srcpos_val;
+	}
+	if (dst->flags & FUSE_BUF_FD_SEEK) {
+		dstpos_val = dst->pos + dst_off;
+		dstpos = &dstpos_val;
+	}
+
+	while (len) {
+		res = copy_file_range(src->fd, srcpos, dst->fd, dstpos, len, 0);
+		if (res == -1) {
+			if (copied)
+				break;
+
+			switch (errno) {
+			case ENOSYS:
+			case EXDEV:
+			case EINVAL:
+			case EBADF:
+			case EOPNOTSUPP:
+				return -ENOTSUP;
+			}
+			return -errno;
+		}
+		if (res == 0)
+			break;
+
+		copied += res;
+		len -= res;
+	}
+
+	return copied;
+#else
+	(void) dst; (void) dst_off; (void) src; (void) src_off; (void) len;
+
+	return -ENOTSUP;
+#endif
+}
+
+#ifdef HAVE_SPLICE
+static int copy_ctx_get_pipe(struct fuse_buf_copy_ctx *ctx)
+{
+	int res;
+
+	if (ctx->pipe[0] != -1)
+		return 0;
+
+#if defined(HAVE_PIPE2) && defined(O_CLOEXEC)
+	res = pipe2(ctx->pipe, O_CLOEXEC);
+#else
+	res = pipe(ctx->pipe);
+#endif
+	if (res == -1) {
+		ctx->pipe[0] = ctx->pipe[1] = -1;
+		return -errno;
+	}
+
+	/* The pipe may be capped below FUSE_BUF_COPY_SIZE by pipe-max-size */
+	ctx->pipe_size = 4096;
+#ifdef F_SETPIPE_SZ
+	res = fcntl(ctx->pipe[0], F_SETPIPE_SZ, FUSE_BUF_COPY_SIZE);
+	if (res == -1)
+		res = fcntl(ctx->pipe[0], F_GETPIPE_SZ);
+	if (res > 0)
+		ctx->pipe_size = res;
+#endif
+
+	return 0;
+}
+
+static ssize_t fuse_buf_splice_pipe(struct fuse_buf_copy_ctx *ctx,
+				    const struct fuse_buf *dst, size_t dst_off,
+				    const struct fuse_buf *src, size_t src_off,
+				    size_t len)
+{
+	off_t *srcpos = NULL;
+	off_t *dstpos = NULL;
+	off_t srcpos_val;
+	off_t dstpos_val;
+	ssize_t res;
+	size_t copied = 0;
+
+	res = copy_ctx_get_pipe(ctx);
+	if (res < 0)
+		return -ENOTSUP;
+
+	if (src->flags & FUSE_BUF_FD_SEEK) {
+		srcpos_val = src->pos + src_off;
+		srcpos = &srcpos_val;
+	}
+	if (dst->flags & FUSE_BUF_FD_SEEK) {
+		dstpos_val = dst->pos + dst_off;
+		dstpos = &dstpos_val;
+	}
+
+	while (len) {
+		size_t in_pipe;
+
+		res = splice(src->fd, srcpos, ctx->pipe[1], NULL,
+			     min_size(ctx->pipe_size, len), SPLICE_F_MOVE);
+		if (res == -1) {
+			if (copied)
+				break;
+			return errno == EINVAL ? -ENOTSUP : -errno;
+		}
+		if (res == 0)
+			break;
+
+		in_pipe = res;
+		while (in_pipe) {
+			res = splice(ctx->pipe[0], NULL, dst->fd, dstpos,
+				     in_pipe, SPLICE_F_MOVE);
+			if (res <= 0) {
+				int err = res ? errno : EIO;
+
+				/* Don't leave stale data behind in the pipe */
+				copy_ctx_close_pipe(ctx);
+				if (copied)
+					return copied;
+				return err == EINVAL ? -ENOTSUP : -err;
+			}
+			in_pipe -= res;
+			copied += res;
+			len -= res;
+		}
+	}
+
+	return copied;
+}
+#else
+static ssize_t fuse_buf_splice_pipe(struct fuse_buf_copy_ctx *ctx,
+				    const struct fuse_buf *dst, size_t dst_off,
+				    const struct fuse_buf *src, size_t src_off,
+				    size_t len)
+{
+	(void) ctx; (void) dst; (void) dst_off; (void) src; (void) src_off;
+	(void) len;
+
+	return -ENOTSUP;
+}
+#endif
+
+/*
+ * Copy between two file descriptors, neither of which needs to be a
+ * pipe.  Try copy_file_range(2) first, then splice(2) through a
+ * per-thread pipe, and finally fall back to read and write through a
+ * bounce buffer.  The strategy that worked is remembered for the fd
+ * pair and the files behind it, so that subsequent copies between the
+ * same files don't have to probe again.
+ */
+static ssize_t fuse_buf_fd_to_fd(const struct fuse_buf *dst, size_t dst_off,
+				 const struct fuse_buf *src, size_t src_off,
+				 size_t len, enum fuse_buf_copy_flags flags)
+{
+	struct fuse_buf_copy_ctx *ctx;
+	struct fuse_buf_copy_pair *pair;
+	ssize_t res;
+
+	ctx = copy_ctx_get();
+	if (ctx == NULL) {
+		char buf[4096];
+
+		return fuse_buf_bounce(dst, dst_off, src, src_off, len,
+				       buf, sizeof(buf));
+	}
+
+	pair = copy_ctx_pair(ctx, src->fd, dst->fd);
+	switch (pair->strategy) {
+	case COPY_UNKNOWN:
+	case COPY_FILE_RANGE:
+		res = fuse_buf_copy_range(dst, dst_off, src, src_off, len);
+		if (res != -ENOTSUP) {
+			pair->strategy = COPY_FILE_RANGE;
+			return res;
+		}
+		/* fall through */
+	case COPY_SPLICE_PIPE:
+		if (!(flags & FUSE_BUF_NO_SPLICE)) {
+			res = fuse_buf_splice_pipe(ctx, dst, dst_off,
+						   src, src_off, len);
+			if (res != -ENOTSUP) {
+				pair->strategy = COPY_SPLICE_PIPE;
+				return res;
+			}
+		}
+		/* fall through */
+	case COPY_BOUNCE:
+		break;
+	}
+
+	pair->strategy = COPY_BOUNCE;
+	if (ctx->buf == NULL) {
+		ctx->buf = malloc(FUSE_BUF_COPY_SIZE);
+		if (ctx->buf == NULL) {
+			char buf[4096];
+
+			return fuse_buf_bounce(dst, dst_off, src, src_off, len,
+					       buf, sizeof(buf));
+		}
+	}
+
+	return fuse_buf_bounce(dst, dst_off, src, src_off, len,
+			       ctx->buf, FUSE_BUF_COPY_SIZE);
+}
+
 #ifdef HAVE_SPLICE
 static ssize_t fuse_buf_splice(const struct fuse_buf *dst, size_t dst_off,
 			       const struct fuse_buf *src, size_t src_off,
@@ -196,7 +556,7 @@ static ssize_t fuse_buf_splice(const struct fuse_buf *dst, size_t dst_off,
 
 			/* Maybe splice is not supported for this combination */
 			return fuse_buf_fd_to_fd(dst, dst_off, src, src_off,
-						 len);
+						 len, flags);
 		}
 		if (res == 0)
 			break;
@@ -217,9 +577,7 @@ static ssize_t fuse_buf_splice(const struct fuse_buf *dst, size_t dst_off,
 			       const struct fuse_buf *src, size_t src_off,
 			       size_t len, enum fuse_buf_copy_flags flags)
 {
-	(void) flags;
-
-	return fuse_buf_fd_to_fd(dst, dst_off, src, src_off, len);
+	return fuse_buf_fd_to_fd(dst, dst_off, src, src_off, len, flags);
 }
 #endif
 
@@ -248,7 +606,7 @@ static ssize_t fuse_buf_copy_one(const struct fuse_buf *dst, size_t dst_off,
 	} else if (!dst_is_fd) {
 		return fuse_buf_read(dst, dst_off, src, src_off, len);
 	} else if (flags & FUSE_BUF_NO_SPLICE) {
-		return fuse_buf_fd_to_fd(dst, dst_off, src, src_off, len);
+		return fuse_buf_fd_to_fd(dst, dst_off, src, src_off, len, flags);
 	} else {
 		return fuse_buf_splice(dst, dst_off, src, src_off, len, flags);
 	}
@@ -119,6 +119,7 @@ struct fuse {
 	fuse_ino_t ctr;
 	unsigned int generation;
 	unsigned int hidectr;
+	uint64_t path_gen;
 	pthread_mutex_t lock;
 	struct fuse_config conf;
 	int intr_installed;
@@ -147,6 +148,10 @@ struct node {
 	int refctr;
 	struct node *parent;
 	char *name;
+	char *path;
+	unsigned int pathlen;
+	unsigned int nchildren;
+	uint64_t path_gen;
 	uint64_t nlookup;
 	int open_count;
 	struct timespec stat_updated;
@@ -170,10 +175,23 @@ struct node_lru {
 
 struct fuse_direntry {
 	struct stat stat;
+	enum fuse_fill_dir_flags flags;
 	char *name;
 	struct fuse_direntry *next;
 };
 
+/*
+ * Entries of filesystems that pass zero offsets to the filler are
+ * buffered in a window: the list holds entries start ... start +
+ * nentries - 1 of the directory.  When the kernel asks for an offset
+ * outside the window, the directory is read again from the beginning,
+ * skipping the entries before the new window.  Consecutive windows
+ * double in size up to conf.readdir_window entries.  Windows are only
+ * used when readdir_window is set, by default the whole directory is
+ * buffered.
+ */
+#define FUSE_DH_MIN_WINDOW 1024
+
 struct fuse_dh {
 	pthread_mutex_t lock;
 	struct fuse *fuse;
@@ -188,6 +206,11 @@ struct fuse_dh {
 	uint64_t fh;
 	int error;
 	fuse_ino_t nodeid;
+	off_t start;
+	off_t pos;
+	unsigned nentries;
+	unsigned window;
+	int more;
 };
 
 struct fuse_context_i {
@@ -572,6 +595,7 @@ static void free_node(struct fuse *f, struct node *node)
 {
 	if (node->name != node->inline_name)
 		free(node->name);
+	free(node->path);
 	free_node_mem(f, node);
 }
 
@@ -708,6 +732,40 @@ static size_t name_hash(struct fuse *f, fuse_ino_t parent,
 
 static void unref_node(struct fuse *f, struct node *node);
 
+/*
+ * The cached path of a node is valid as long as none of its ancestors
+ * has been unhashed since it was built.  Unhashing a node with children
+ * bumps the global path generation, which invalidates every cached path
+ * at once; unhashing a leaf only drops that node's own path.
+ */
+static int node_path_valid(struct fuse *f, struct node *node)
+{
+	return node->path != NULL && node->path_gen == f->path_gen;
+}
+
+static void invalidate_node_path(struct fuse *f, struct node *node)
+{
+	free(node->path);
+	node->path = NULL;
+	if (node->nchildren)
+		f->path_gen++;
+}
+
+static void set_node_path(struct fuse *f, struct node *node,
+			  const char *path, unsigned len)
+{
+	char *newpath = realloc(node->path, len + 1);
+
+	if (newpath == NULL)
+		return;
+
+	memcpy(newpath, path, len);
+	newpath[len] = '\0';
+	node->path = newpath;
+	node->pathlen = len;
+	node->path_gen = f->path_gen;
+}
+
 static void remerge_name(struct fuse *f)
 {
 	struct node_table *t = &f->name_table;
@@ -744,6 +802,8 @@ static void unhash_name(struct fuse *f, struct node *node)
 			if (*nodep == node) {
 				*nodep = node->name_next;
 				node->name_next = NULL;
+				invalidate_node_path(f, node);
+				node->parent->nchildren--;
 				unref_node(f, node->parent);
 				if (node->name != node->inline_name)
 					free(node->name);
@@ -806,6 +866,7 @@ static int hash_name(struct fuse *f, struct node *node, fuse_ino_t parentid,
 	}
 
 	parent->refctr ++;
+	parent->nchildren++;
 	node->parent = parent;
 	node->name_next = f->name_table.array[hash];
 	f->name_table.array[hash] = node;
@@ -998,14 +1059,21 @@ static int try_get_path(struct fuse *f, fuse_ino_t nodeid, const char *name,
 			char **path, struct node **wnodep, bool need_lock)
 {
 	unsigned bufsize = 256;
+	unsigned namelen = name ? strlen(name) + 1 : 0;
 	char *buf;
 	char *s;
 	struct node *node;
 	struct node *wnode = NULL;
+	bool cached;
 	int err;
 
 	*path = NULL;
 
+	node = get_node(f, nodeid);
+	cached = node_path_valid(f, node);
+	if (cached)
+		bufsize = node->pathlen + namelen + 1;
+
 	err = -ENOMEM;
 	buf = malloc(bufsize);
 	if (buf == NULL)
@@ -1035,16 +1103,17 @@ static int try_get_path(struct fuse *f, fuse_ino_t nodeid, const char *name,
 		}
 	}
 
-	for (node = get_node(f, nodeid); node->nodeid != FUSE_ROOT_ID;
-	     node = node->parent) {
+	for (; node->nodeid != FUSE_ROOT_ID; node = node->parent) {
 		err = -ESTALE;
 		if (node->name == NULL || node->parent == NULL)
 			goto out_unlock;
 
-		err = -ENOMEM;
-		s = add_name(&buf, &bufsize, s, node->name);
-		if (s == NULL)
-			goto out_unlock;
+		if (!cached) {
+			err = -ENOMEM;
+			s = add_name(&buf, &bufsize, s, node->name);
+			if (s == NULL)
+				goto out_unlock;
+		}
 
 		if (need_lock) {
 			err = -EAGAIN;
@@ -1055,10 +1124,19 @@ static int try_get_path(struct fuse *f, fuse_ino_t nodeid, const char *name,
 		}
 	}
 
-	if (s[0])
-		memmove(buf, s, bufsize - (s - buf));
-	else
+	if (cached) {
+		node = get_node(f, nodeid);
+		memcpy(buf, node->path, node->pathlen);
+	} else if (s[0]) {
+		unsigned len = bufsize - (s - buf) - 1;
+
+		memmove(buf, s, len + 1);
+		if (nodeid != FUSE_ROOT_ID)
+			set_node_path(f, get_node(f, nodeid), buf,
+				      len - namelen);
+	} else {
 		strcpy(buf, "/");
+	}
 
 	*path = buf;
 	if (wnodep)
@@ -3363,6 +3441,24 @@ static void fuse_lib_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
 	reply_err(req, err);
 }
 
+static unsigned dh_initial_window(struct fuse *f)
+{
+	unsigned max = f->conf.readdir_window;
+
+	if (!max)
+		return 0;
+	return max < FUSE_DH_MIN_WINDOW ? max : FUSE_DH_MIN_WINDOW;
+}
+
+static unsigned dh_next_window(struct fuse *f, unsigned window)
+{
+	unsigned max = f->conf.readdir_window;
+
+	if (!max)
+		return 0;
+	return window < max / 2 ? window * 2 : max;
+}
+
 static struct fuse_dh *get_dirhandle(const struct fuse_file_info *llfi,
 				     struct fuse_file_info *fi)
 {
@@ -3394,6 +3490,7 @@ static void fuse_lib_opendir(fuse_req_t req, fuse_ino_t ino,
 	dh->len = 0;
 	dh->filled = 0;
 	dh->nodeid = ino;
+	dh->window = dh_initial_window(f);
 	pthread_mutex_init(&dh->lock, NULL);
 
 	llfi->fh = (uintptr_t) dh;
@@ -3450,7 +3547,7 @@ static int extend_contents(struct fuse_dh *dh, unsigned minsize)
 }
 
 static int fuse_add_direntry_to_dh(struct fuse_dh *dh, const char *name,
-				   struct stat *st)
+				   struct stat *st, enum fuse_fill_dir_flags flags)
 {
 	struct fuse_direntry *de;
 
@@ -3466,14 +3563,37 @@ static int fuse_add_direntry_to_dh(struct fuse_dh *dh, const char *name,
 		return -1;
 	}
 	de->stat = *st;
+	de->flags = flags;
 	de->next = NULL;
 
 	*dh->last = de;
 	dh->last = &de->next;
+	dh->nentries++;
+	dh->pos++;
 
 	return 0;
 }
 
+/*
+ * Called for entries passed without an offset, before anything else is
+ * done with them.  Returns 1 if the entry lies before the window and
+ * should be skipped, -1 if the window is full and the filesystem should
+ * stop, 0 if the entry is to be added.
+ */
+static int dh_window_check(struct fuse_dh *dh)
+{
+	dh->filled = 1;
+	if (dh->pos < dh->start) {
+		dh->pos++;
+		return 1;
+	}
+	if (dh->window && dh->nentries >= dh->window) {
+		dh->more = 1;
+		return -1;
+	}
+	return 0;
+}
+
 static fuse_ino_t lookup_nodeid(struct fuse *f, fuse_ino_t parent,
 				const char *name)
 {
@@ -3500,6 +3620,12 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 		return 1;
 	}
 
+	if (!off) {
+		int res = dh_window_check(dh);
+		if (res)
+			return res < 0;
+	}
+
 	if (statp)
 		stbuf = *statp;
 	else {
@@ -3540,9 +3666,7 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 
 		dh->len = newlen;
 	} else {
-		dh->filled = 1;
-
-		if (fuse_add_direntry_to_dh(dh, name, &stbuf) == -1)
+		if (fuse_add_direntry_to_dh(dh, name, &stbuf, 0) == -1)
 			return 1;
 	}
 	return 0;
@@ -3570,15 +3694,25 @@ static int fill_dir_plus(void *dh_, const char *name, const struct stat *statp,
 		return 1;
 	}
 
+	if (!off) {
+		res = dh_window_check(dh);
+		if (res)
+			return res < 0;
+	}
+
 	if (statp && (flags & FUSE_FILL_DIR_PLUS)) {
 		e.attr = *statp;
 
-		if (!is_dot_or_dotdot(name)) {
+		/* Buffered entries are looked up when they are returned to
+		   the kernel, since each returned entry counts as a lookup */
+		if (off && !is_dot_or_dotdot(name)) {
 			res = do_lookup(f, dh->nodeid, name, &e);
 			if (res) {
 				dh->error = res;
 				return 1;
 			}
+		} else if (!off && !f->conf.use_ino) {
+			e.attr.st_ino = FUSE_UNKNOWN_INO;
 		}
 	} else {
 		e.attr.st_ino = FUSE_UNKNOWN_INO;
@@ -3616,9 +3750,8 @@ static int fill_dir_plus(void *dh_, const char *name, const struct stat *statp,
 			return 1;
 		dh->len = newlen;
 	} else {
-		dh->filled = 1;
-
-		if (fuse_add_direntry_to_dh(dh, name, &e.attr) == -1)
+		if (fuse_add_direntry_to_dh(dh, name, &e.attr,
+					    statp ? flags : 0) == -1)
 			return 1;
 	}
 
@@ -3662,6 +3795,10 @@ static int readdir_fill(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
 		dh->needlen = size;
 		dh->filled = 0;
 		dh->req = req;
+		dh->start = off;
+		dh->pos = 0;
+		dh->nentries = 0;
+		dh->more = 0;
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_readdir(f->fs, path, dh, filler, off, fi, flags);
 		fuse_finish_interrupt(f, req, &d);
@@ -3678,6 +3815,7 @@ static int readdir_fill(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
 static int readdir_fill_from_list(fuse_req_t req, struct fuse_dh *dh,
 				  off_t off, enum fuse_readdir_flags flags)
 {
+	struct fuse *f = dh->fuse;
 	off_t pos;
 	struct fuse_direntry *de = dh->first;
 
@@ -3686,7 +3824,7 @@ static int readdir_fill_from_list(fuse_req_t req, struct fuse_dh *dh,
 	if (extend_contents(dh, dh->needlen) == -1)
 		return dh->error;
 
-	for (pos = 0; pos < off; pos++) {
+	for (pos = dh->start; pos < off; pos++) {
 		if (!de)
 			break;
 
@@ -3704,6 +3842,20 @@ static int readdir_fill_from_list(fuse_req_t req, struct fuse_dh *dh,
 				.ino = 0,
 				.attr = de->stat,
 			};
+
+			if ((de->flags & FUSE_FILL_DIR_PLUS) &&
+			    !is_dot_or_dotdot(de->name)) {
+				/* Only look up entries that fit */
+				thislen = fuse_add_direntry_plus(req, NULL, 0,
+								 de->name, &e,
+								 pos);
+				if (dh->len + thislen > dh->needlen)
+					break;
+				if (do_lookup(f, dh->nodeid, de->name, &e)) {
+					e.ino = 0;
+					e.attr = de->stat;
+				}
+			}
 			thislen = fuse_add_direntry_plus(req, p, rem,
 							 de->name, &e, pos);
 		} else {
@@ -3731,8 +3883,19 @@ static void fuse_readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size,
 	pthread_mutex_lock(&dh->lock);
 	/* According to SUS, directory contents need to be refreshed on
 	   rewinddir() */
-	if (!off)
+	if (!off) {
 		dh->filled = 0;
+		dh->window = dh_initial_window(f);
+	} else if (dh->filled && (off < dh->start ||
+		   (dh->more && off >= dh->start + dh->nentries))) {
+		/* Outside of the buffered window, read the directory
+		   again.  The window grows while reading forward */
+		if (off == dh->start + dh->nentries)
+			dh->window = dh_next_window(f, dh->window);
+		else
+			dh->window = dh_initial_window(f);
+		dh->filled = 0;
+	}
 
 	if (!dh->filled) {
 		err = readdir_fill(f, req, ino, size, off, dh, &fi, flags);
@@ -4673,6 +4836,7 @@ static const struct fuse_opt fuse_lib_opts[] = {
 	FUSE_LIB_OPT("negative_timeout=%lf",  negative_timeout, 0),
 	FUSE_LIB_OPT("noforget",              remember, -1),
 	FUSE_LIB_OPT("remember=%u",           remember, 0),
+	FUSE_LIB_OPT("readdir_window=%u",     readdir_window, 0),
 	FUSE_LIB_OPT("modules=%s",	      modules, 0),
 	FUSE_OPT_END
 };
@@ -4722,6 +4886,7 @@ void fuse_lib_help(struct fuse_args *args)
 "    -o ac_attr_timeout=T   auto cache timeout for attributes (attr_timeout)\n"
 "    -o noforget            never forget cached inodes\n"
 "    -o remember=T          remember cached inodes for T seconds (0s)\n"
+"    -o readdir_window=N    max. directory entries buffered per handle (0=all)\n"
 "    -o modules=M1[:M2...]  names of modules to push onto filesystem stack\n");
 
 
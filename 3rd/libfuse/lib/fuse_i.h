@@ -64,6 +64,8 @@ struct fuse_session {
 	struct fuse_notify_req notify_list;
 	size_t bufsize;
 	int error;
+	int percpu_clone_fd;
+	struct fuse_loop_stats loop_stats;
 };
 
 struct fuse_chan {
@@ -8,6 +8,8 @@
   See the file COPYING.LIB.
 */
 
+#define _GNU_SOURCE
+
 #include "config.h"
 #include "fuse_lowlevel.h"
 #include "fuse_misc.h"
@@ -24,10 +26,23 @@
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <assert.h>
+#include <sched.h>
 
 /* Environment var controlling the thread stack size */
 #define ENVNAME_THREAD_STACK "FUSE_THREAD_STACK"
 
+/*
+ * With -o percpu_clone_fd there is one of these per CPU.  The workers
+ * of a CPU are bound to it and share its cloned device fd, and the
+ * number of idle workers is tracked per CPU.
+ */
+struct fuse_mt_cpu {
+	int cpu;
+	int numworker;
+	int numavail;
+	struct fuse_chan *ch;
+};
+
 struct fuse_worker {
 	struct fuse_worker *prev;
 	struct fuse_worker *next;
@@ -38,6 +53,8 @@ struct fuse_worker {
 	struct fuse_buf fbuf;
 	struct fuse_chan *ch;
 	struct fuse_mt *mt;
+	struct fuse_mt_cpu *pc;
+	int last_cpu;
 };
 
 struct fuse_mt {
@@ -51,6 +68,9 @@ struct fuse_mt {
 	int error;
 	int clone_fd;
 	int max_idle;
+	struct fuse_mt_cpu *cpus;
+	int ncpus;
+	int max_idle_cpu;
 };
 
 static struct fuse_chan *fuse_chan_new(int fd)
@@ -111,12 +131,46 @@ static void list_del_worker(struct fuse_worker *w)
 	next->prev = prev;
 }
 
-static int fuse_loop_start_thread(struct fuse_mt *mt);
+static int fuse_loop_start_thread(struct fuse_mt *mt, struct fuse_mt_cpu *pc);
+
+static void fuse_worker_count(struct fuse_worker *w)
+{
+	struct fuse_loop_stats *stats = &w->mt->se->loop_stats;
+	int cpu = -1;
+
+#ifdef __linux__
+	cpu = sched_getcpu();
+#endif
+	stats->requests++;
+	if (cpu < 0)
+		return;
+	if (w->last_cpu >= 0 && cpu != w->last_cpu)
+		stats->migrations++;
+	w->last_cpu = cpu;
+	if (w->pc) {
+		if (cpu == w->pc->cpu)
+			stats->local++;
+		else
+			stats->remote++;
+	}
+}
 
 static void *fuse_do_work(void *data)
 {
 	struct fuse_worker *w = (struct fuse_worker *) data;
 	struct fuse_mt *mt = w->mt;
+	int *numavail = w->pc ? &w->pc->numavail : &mt->numavail;
+	int max_idle = w->pc ? mt->max_idle_cpu : mt->max_idle;
+
+#ifdef __linux__
+	if (w->pc) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(w->pc->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#endif
 
 	while (!fuse_session_exited(mt->se)) {
 		int isforget = 0;
@@ -140,6 +194,7 @@ static void *fuse_do_work(void *data)
 			pthread_mutex_unlock(&mt->lock);
 			return NULL;
 		}
+		fuse_worker_count(w);
 
 		/*
 		 * This disgusting hack is needed so that zillions of threads
@@ -154,23 +209,25 @@ static void *fuse_do_work(void *data)
 		}
 
 		if (!isforget)
-			mt->numavail--;
-		if (mt->numavail == 0)
-			fuse_loop_start_thread(mt);
+			(*numavail)--;
+		if (*numavail == 0)
+			fuse_loop_start_thread(mt, w->pc);
 		pthread_mutex_unlock(&mt->lock);
 
 		fuse_session_process_buf_int(mt->se, &w->fbuf, w->ch);
 
 		pthread_mutex_lock(&mt->lock);
 		if (!isforget)
-			mt->numavail++;
-		if (mt->numavail > mt->max_idle) {
+			(*numavail)++;
+		if (*numavail > max_idle) {
 			if (mt->exit) {
 				pthread_mutex_unlock(&mt->lock);
 				return NULL;
 			}
 			list_del_worker(w);
-			mt->numavail--;
+			(*numavail)--;
+			if (w->pc)
+				w->pc->numworker--;
 			mt->numworker--;
 			pthread_mutex_unlock(&mt->lock);
 
@@ -255,7 +312,7 @@ static struct fuse_chan *fuse_clone_chan(struct fuse_mt *mt)
 	return newch;
 }
 
-static int fuse_loop_start_thread(struct fuse_mt *mt)
+static int fuse_loop_start_thread(struct fuse_mt *mt, struct fuse_mt_cpu *pc)
 {
 	int res;
 
@@ -267,9 +324,13 @@ static int fuse_loop_start_thread(struct fuse_mt *mt)
 	memset(w, 0, sizeof(struct fuse_worker));
 	w->fbuf.mem = NULL;
 	w->mt = mt;
+	w->pc = pc;
+	w->last_cpu = -1;
 
 	w->ch = NULL;
-	if (mt->clone_fd) {
+	if (pc) {
+		w->ch = fuse_chan_get(pc->ch);
+	} else if (mt->clone_fd) {
 		w->ch = fuse_clone_chan(mt);
 		if(!w->ch) {
 			/* Don't attempt this again */
@@ -286,12 +347,79 @@ static int fuse_loop_start_thread(struct fuse_mt *mt)
 		return -1;
 	}
 	list_add_worker(w, &mt->main);
-	mt->numavail ++;
+	if (pc) {
+		pc->numavail++;
+		pc->numworker++;
+	} else {
+		mt->numavail ++;
+	}
 	mt->numworker ++;
+	mt->se->loop_stats.threads_started++;
 
 	return 0;
 }
 
+/*
+ * Set up one cloned device fd for each CPU that we may run on and
+ * start a worker bound to each of them.  Returns -1 if that is not
+ * possible, in which case the caller falls back to a shared pool.
+ */
+static int fuse_loop_start_percpu(struct fuse_mt *mt)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	int cpu, i;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+		fuse_log(FUSE_LOG_ERR, "fuse: sched_getaffinity: %s\n",
+			 strerror(errno));
+		return -1;
+	}
+
+	mt->ncpus = CPU_COUNT(&set);
+	mt->cpus = calloc(mt->ncpus, sizeof(*mt->cpus));
+	if (mt->cpus == NULL) {
+		fuse_log(FUSE_LOG_ERR, "fuse: failed to allocate per-cpu data\n");
+		return -1;
+	}
+
+	for (cpu = 0, i = 0; i < mt->ncpus; cpu++) {
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+		mt->cpus[i].cpu = cpu;
+		mt->cpus[i].ch = fuse_clone_chan(mt);
+		if (mt->cpus[i].ch == NULL)
+			goto out_free;
+		i++;
+	}
+
+	/* Spread the idle threads over the CPUs, but keep at least one
+	   waiting on each */
+	mt->max_idle_cpu = mt->max_idle / mt->ncpus;
+	if (mt->max_idle_cpu < 1)
+		mt->max_idle_cpu = 1;
+
+	for (i = 0; i < mt->ncpus; i++) {
+		if (fuse_loop_start_thread(mt, &mt->cpus[i]) == -1) {
+			/* Workers that were already started keep
+			   their channel alive */
+			return i ? 0 : -1;
+		}
+	}
+	return 0;
+
+out_free:
+	for (i = 0; i < mt->ncpus; i++)
+		fuse_chan_put(mt->cpus[i].ch);
+	free(mt->cpus);
+	mt->cpus = NULL;
+	mt->ncpus = 0;
+#else
+	(void) mt;
+#endif
+	return -1;
+}
+
 static void fuse_join_worker(struct fuse_mt *mt, struct fuse_worker *w)
 {
 	pthread_join(w->thread_id, NULL);
@@ -323,7 +451,15 @@ int fuse_session_loop_mt_32(struct fuse_session *se, struct fuse_loop_config *co
 	pthread_mutex_init(&mt.lock, NULL);
 
 	pthread_mutex_lock(&mt.lock);
-	err = fuse_loop_start_thread(&mt);
+	err = -1;
+	if (se->percpu_clone_fd) {
+		err = fuse_loop_start_percpu(&mt);
+		if (err)
+			fuse_log(FUSE_LOG_ERR, "fuse: trying to continue "
+				 "without -o percpu_clone_fd.\n");
+	}
+	if (err)
+		err = fuse_loop_start_thread(&mt, NULL);
 	pthread_mutex_unlock(&mt.lock);
 	if (!err) {
 		/* sem_wait() is interruptible */
@@ -342,6 +478,25 @@ int fuse_session_loop_mt_32(struct fuse_session *se, struct fuse_loop_config *co
 		err = mt.error;
 	}
 
+	if (se->debug) {
+		struct fuse_loop_stats *stats = &se->loop_stats;
+
+		fuse_log(FUSE_LOG_DEBUG, "fuse: %llu requests, %llu threads "
+			 "started, %llu migrations, %llu local, %llu remote\n",
+			 (unsigned long long) stats->requests,
+			 (unsigned long long) stats->threads_started,
+			 (unsigned long long) stats->migrations,
+			 (unsigned long long) stats->local,
+			 (unsigned long long) stats->remote);
+	}
+
+	if (mt.cpus) {
+		int i;
+
+		for (i = 0; i < mt.ncpus; i++)
+			fuse_chan_put(mt.cpus[i].ch);
+		free(mt.cpus);
+	}
 	pthread_mutex_destroy(&mt.lock);
 	sem_destroy(&mt.finish);
 	if(se->error != 0)
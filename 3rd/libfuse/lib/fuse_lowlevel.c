@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
 
 #ifndef F_LINUX_SPECIFIC_BASE
 #define F_LINUX_SPECIFIC_BASE       1024
@@ -398,6 +399,10 @@ static void fill_open(struct fuse_open_out *arg,
 		arg->open_flags |= FOPEN_NONSEEKABLE;
 	if (f->noflush)
 		arg->open_flags |= FOPEN_NOFLUSH;
+	if (f->backing_id > 0) {
+		arg->backing_id = f->backing_id;
+		arg->open_flags |= FOPEN_PASSTHROUGH;
+	}
 }
 
 int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
@@ -461,6 +466,37 @@ int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *f)
 	return send_reply_ok(req, &arg, sizeof(arg));
 }
 
+int fuse_passthrough_open(fuse_req_t req, int fd)
+{
+	struct fuse_backing_map map = { .fd = fd };
+	int ret;
+
+	ret = ioctl(req->ch ? req->ch->fd : req->se->fd,
+		    FUSE_DEV_IOC_BACKING_OPEN, &map);
+	if (ret <= 0) {
+		fuse_log(FUSE_LOG_ERR, "fuse: passthrough_open: %s\n",
+			 strerror(errno));
+		return 0;
+	}
+
+	return ret;
+}
+
+int fuse_passthrough_close(fuse_req_t req, int backing_id)
+{
+	int ret;
+
+	ret = ioctl(req->ch ? req->ch->fd : req->se->fd,
+		    FUSE_DEV_IOC_BACKING_CLOSE, &backing_id);
+	if (ret < 0) {
+		ret = -errno;
+		fuse_log(FUSE_LOG_ERR, "fuse: passthrough_close: %s\n",
+			 strerror(-ret));
+	}
+
+	return ret;
+}
+
 int fuse_reply_write(fuse_req_t req, size_t count)
 {
 	struct fuse_write_out arg;
@@ -1981,6 +2017,8 @@ void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 			se->conn.capable |= FUSE_CAP_NO_OPENDIR_SUPPORT;
 		if (inargflags & FUSE_EXPLICIT_INVAL_DATA)
 			se->conn.capable |= FUSE_CAP_EXPLICIT_INVAL_DATA;
+		if (inargflags & FUSE_PASSTHROUGH)
+			se->conn.capable |= FUSE_CAP_PASSTHROUGH;
 		if (!(inargflags & FUSE_MAX_PAGES)) {
 			size_t max_bufsize =
 				FUSE_DEFAULT_MAX_PAGES_PER_REQ * getpagesize()
@@ -2105,6 +2143,11 @@ void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		outargflags |= FUSE_CACHE_SYMLINKS;
 	if (se->conn.want & FUSE_CAP_EXPLICIT_INVAL_DATA)
 		outargflags |= FUSE_EXPLICIT_INVAL_DATA;
+	if (se->conn.want & FUSE_CAP_PASSTHROUGH) {
+		outargflags |= FUSE_PASSTHROUGH;
+		/* The kernel counts the fuse layer itself as well */
+		outarg.max_stack_depth = se->conn.max_backing_stack_depth + 1;
+	}
 
 	if (inargflags & FUSE_INIT_EXT) {
 		outargflags |= FUSE_INIT_EXT;
@@ -2143,6 +2186,9 @@ void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 			outarg.congestion_threshold);
 		fuse_log(FUSE_LOG_DEBUG, "   time_gran=%u\n",
 			outarg.time_gran);
+		if (outargflags & FUSE_PASSTHROUGH)
+			fuse_log(FUSE_LOG_DEBUG, "   max_stack_depth=%u\n",
+				outarg.max_stack_depth);
 	}
 	if (arg->minor < 5)
 		outargsize = FUSE_COMPAT_INIT_OUT_SIZE;
@@ -2441,6 +2487,262 @@ int fuse_lowlevel_notify_retrieve(struct fuse_session *se, fuse_ino_t ino,
 	return err;
 }
 
+struct fuse_notify_rec {
+	int code;
+	fuse_ino_t ino;
+	/* FUSE_NOTIFY_INVAL_INODE: range to invalidate, off < 0 for
+	   attributes only, end < 0 for up to the end of the file */
+	off_t off;
+	off_t end;
+	/* FUSE_NOTIFY_INVAL_ENTRY */
+	char *name;
+	size_t namelen;
+};
+
+struct fuse_notify_batch {
+	struct fuse_session *se;
+	struct fuse_notify_rec *recs;
+	size_t nrecs;
+	size_t recs_size;
+	/* Open addressing hash of index + 1 into recs, 0 for free slots */
+	size_t *hash;
+	size_t hash_size;
+};
+
+static size_t notify_rec_hash(int code, fuse_ino_t ino, const char *name,
+			      size_t namelen)
+{
+	uint64_t h = (uint64_t) ino * 0x9e3779b97f4a7c15ULL + code;
+	size_t i;
+
+	for (i = 0; i < namelen; i++)
+		h = (h ^ (unsigned char) name[i]) * 0x100000001b3ULL;
+
+	return (size_t) (h ^ (h >> 29));
+}
+
+static size_t *notify_batch_slot(struct fuse_notify_batch *batch, int code,
+				 fuse_ino_t ino, const char *name,
+				 size_t namelen)
+{
+	size_t mask = batch->hash_size - 1;
+	size_t i = notify_rec_hash(code, ino, name, namelen) & mask;
+
+	while (batch->hash[i]) {
+		struct fuse_notify_rec *rec = &batch->recs[batch->hash[i] - 1];
+
+		if (rec->code == code && rec->ino == ino &&
+		    rec->namelen == namelen &&
+		    (!namelen || memcmp(rec->name, name, namelen) == 0))
+			break;
+		i = (i + 1) & mask;
+	}
+	return &batch->hash[i];
+}
+
+static int notify_batch_grow(struct fuse_notify_batch *batch)
+{
+	struct fuse_notify_rec *recs;
+	size_t *hash;
+	size_t hash_size;
+	size_t i;
+
+	if (batch->nrecs < batch->recs_size)
+		return 0;
+
+	/* Keep the hash at most half full */
+	hash_size = 4 * batch->recs_size;
+	hash = calloc(hash_size, sizeof(*hash));
+	if (hash == NULL)
+		return -ENOMEM;
+	recs = realloc(batch->recs, 2 * batch->recs_size * sizeof(*recs));
+	if (recs == NULL) {
+		free(hash);
+		return -ENOMEM;
+	}
+	batch->recs = recs;
+	batch->recs_size *= 2;
+	free(batch->hash);
+	batch->hash = hash;
+	batch->hash_size = hash_size;
+
+	for (i = 0; i < batch->nrecs; i++) {
+		struct fuse_notify_rec *rec = &batch->recs[i];
+
+		*notify_batch_slot(batch, rec->code, rec->ino, rec->name,
+				   rec->namelen) = i + 1;
+	}
+	return 0;
+}
+
+struct fuse_notify_batch *fuse_lowlevel_notify_batch_new(struct fuse_session *se)
+{
+	struct fuse_notify_batch *batch;
+
+	batch = calloc(1, sizeof(*batch));
+	if (batch == NULL)
+		return NULL;
+
+	batch->se = se;
+	batch->recs_size = 64;
+	batch->hash_size = 2 * batch->recs_size;
+	batch->recs = malloc(batch->recs_size * sizeof(*batch->recs));
+	batch->hash = calloc(batch->hash_size, sizeof(*batch->hash));
+	if (batch->recs == NULL || batch->hash == NULL) {
+		fuse_lowlevel_notify_batch_destroy(batch);
+		return NULL;
+	}
+	return batch;
+}
+
+int fuse_lowlevel_notify_batch_inval_inode(struct fuse_notify_batch *batch,
+					   fuse_ino_t ino, off_t off, off_t len)
+{
+	struct fuse_notify_rec *rec;
+	size_t *slot;
+	off_t end;
+	int err;
+
+	if (!batch)
+		return -EINVAL;
+
+	end = (off >= 0 && len > 0) ? off + len : -1;
+	slot = notify_batch_slot(batch, FUSE_NOTIFY_INVAL_INODE, ino, NULL, 0);
+	if (*slot) {
+		rec = &batch->recs[*slot - 1];
+		if (off < 0)
+			return 0;
+		if (rec->off < 0) {
+			rec->off = off;
+			rec->end = end;
+			return 0;
+		}
+		if (off < rec->off)
+			rec->off = off;
+		if (rec->end >= 0 && (end < 0 || end > rec->end))
+			rec->end = end;
+		return 0;
+	}
+
+	err = notify_batch_grow(batch);
+	if (err)
+		return err;
+	/* The hash may have been rebuilt */
+	slot = notify_batch_slot(batch, FUSE_NOTIFY_INVAL_INODE, ino, NULL, 0);
+
+	rec = &batch->recs[batch->nrecs];
+	rec->code = FUSE_NOTIFY_INVAL_INODE;
+	rec->ino = ino;
+	rec->off = off;
+	rec->end = end;
+	rec->name = NULL;
+	rec->namelen = 0;
+	*slot = ++batch->nrecs;
+
+	return 0;
+}
+
+int fuse_lowlevel_notify_batch_inval_entry(struct fuse_notify_batch *batch,
+					   fuse_ino_t parent, const char *name,
+					   size_t namelen)
+{
+	struct fuse_notify_rec *rec;
+	size_t *slot;
+	int err;
+
+	if (!batch)
+		return -EINVAL;
+
+	slot = notify_batch_slot(batch, FUSE_NOTIFY_INVAL_ENTRY, parent,
+				 name, namelen);
+	if (*slot)
+		return 0;
+
+	err = notify_batch_grow(batch);
+	if (err)
+		return err;
+	slot = notify_batch_slot(batch, FUSE_NOTIFY_INVAL_ENTRY, parent,
+				 name, namelen);
+
+	rec = &batch->recs[batch->nrecs];
+	rec->code = FUSE_NOTIFY_INVAL_ENTRY;
+	rec->ino = parent;
+	rec->off = 0;
+	rec->end = 0;
+	rec->name = malloc(namelen + 1);
+	if (rec->name == NULL)
+		return -ENOMEM;
+	memcpy(rec->name, name, namelen);
+	rec->name[namelen] = '\0';
+	rec->namelen = namelen;
+	*slot = ++batch->nrecs;
+
+	return 0;
+}
+
+static void notify_batch_clear(struct fuse_notify_batch *batch)
+{
+	size_t i;
+
+	for (i = 0; i < batch->nrecs; i++)
+		free(batch->recs[i].name);
+	batch->nrecs = 0;
+	memset(batch->hash, 0, batch->hash_size * sizeof(*batch->hash));
+}
+
+int fuse_lowlevel_notify_batch_flush(struct fuse_notify_batch *batch)
+{
+	size_t i;
+	int err = 0;
+
+	if (!batch)
+		return -EINVAL;
+
+	for (i = 0; i < batch->nrecs; i++) {
+		struct fuse_notify_rec *rec = &batch->recs[i];
+		int res;
+
+		if (rec->code == FUSE_NOTIFY_INVAL_INODE) {
+			off_t len = 0;
+
+			if (rec->off >= 0 && rec->end >= 0)
+				len = rec->end - rec->off;
+			res = fuse_lowlevel_notify_inval_inode(batch->se,
+							       rec->ino,
+							       rec->off, len);
+		} else {
+			res = fuse_lowlevel_notify_inval_entry(batch->se,
+							       rec->ino,
+							       rec->name,
+							       rec->namelen);
+		}
+		if (res == -ENOENT)
+			continue;
+		if (res && !err)
+			err = res;
+		/* No point in trying the rest */
+		if (res == -ENODEV || res == -ENOTCONN || res == -ENOSYS)
+			break;
+	}
+	notify_batch_clear(batch);
+
+	return err;
+}
+
+void fuse_lowlevel_notify_batch_destroy(struct fuse_notify_batch *batch)
+{
+	size_t i;
+
+	if (!batch)
+		return;
+
+	for (i = 0; i < batch->nrecs; i++)
+		free(batch->recs[i].name);
+	free(batch->recs);
+	free(batch->hash);
+	free(batch);
+}
+
 void *fuse_req_userdata(fuse_req_t req)
 {
 	return req->se->userdata;
@@ -2705,6 +3007,7 @@ static const struct fuse_opt fuse_ll_opts[] = {
 	LL_OPTION("-d", debug, 1),
 	LL_OPTION("--debug", debug, 1),
 	LL_OPTION("allow_root", deny_others, 1),
+	LL_OPTION("percpu_clone_fd", percpu_clone_fd, 1),
 	FUSE_OPT_END
 };
 
@@ -2722,7 +3025,14 @@ void fuse_lowlevel_help(void)
 	printf(
 "    -o allow_other         allow access by all users\n"
 "    -o allow_root          allow access by root\n"
-"    -o auto_unmount        auto unmount on process termination\n");
+"    -o auto_unmount        auto unmount on process termination\n"
+"    -o percpu_clone_fd     one device fd and pinned workers per CPU\n");
+}
+
+void fuse_session_loop_stats(struct fuse_session *se,
+			     struct fuse_loop_stats *stats)
+{
+	*stats = se->loop_stats;
 }
 
 void fuse_session_destroy(struct fuse_session *se)
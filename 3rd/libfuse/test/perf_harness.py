@@ -0,0 +1,352 @@
+#!/usr/bin/env python3
+'''Performance harness for the example file systems
+
+Mounts passthrough_ll, passthrough_hp and null in different session loop
+and buffer configurations, runs metadata, sequential I/O and small
+random I/O workloads against them, and reports operations per second
+and latency percentiles as JSON.
+
+This is not a test - it does not check results and is not collected by
+pytest. Run it from the build directory:
+
+    $ python3 test/perf_harness.py --output baseline.json
+    (apply changes, rebuild)
+    $ python3 test/perf_harness.py --baseline baseline.json
+
+The file systems are mounted through fusermount3 when not running as
+root. Numbers are only comparable between runs on the same machine.
+'''
+
+import argparse
+import json
+import os
+import platform
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from os.path import join as pjoin
+
+sys.path.insert(0, os.path.dirname(__file__))
+from util import (wait_for_mount, umount, cleanup, base_cmdline,
+                  basename)
+
+# Extra arguments for each file system and loop configuration. None
+# means that the file system does not support the configuration.
+CONFIGS = {
+    'passthrough_ll': {
+        'single': [ '-s' ],
+        'mt': [],
+        'clone_fd': [ '-o', 'clone_fd' ],
+        'percpu': [ '-o', 'percpu_clone_fd' ],
+        'splice': None,
+        'nosplice': None,
+    },
+    'passthrough_hp': {
+        'single': [ '--single' ],
+        'mt': [],
+        'clone_fd': [ '--clone-fd' ],
+        'percpu': None,
+        'splice': [],
+        'nosplice': [ '--nosplice' ],
+    },
+    'null': {
+        'single': [ '-s' ],
+        'mt': [],
+        'clone_fd': [ '-o', 'clone_fd' ],
+        'percpu': [ '-o', 'percpu_clone_fd' ],
+        'splice': None,
+        'nosplice': None,
+    },
+}
+
+# null mounts a single file, so it can only run the I/O workloads
+WORKLOADS = {
+    'metadata': ('passthrough_ll', 'passthrough_hp'),
+    'seqio': ('passthrough_ll', 'passthrough_hp', 'null'),
+    'randio': ('passthrough_ll', 'passthrough_hp', 'null'),
+}
+
+
+def mount(fs, config, src_dir, mnt_dir, output):
+    cmdline = base_cmdline + [ pjoin(basename, 'example', fs) ]
+    if fs == 'passthrough_ll':
+        cmdline += [ '-f', '-o', 'source=%s' % src_dir, mnt_dir ]
+    elif fs == 'passthrough_hp':
+        cmdline += [ src_dir, mnt_dir ]
+    else:
+        cmdline += [ '-f', mnt_dir ]
+    cmdline += CONFIGS[fs][config]
+
+    mount_process = subprocess.Popen(cmdline, stdout=output,
+                                     stderr=output)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+    except BaseException:
+        cleanup(mount_process, mnt_dir)
+        raise
+    return mount_process
+
+
+class Recorder:
+    '''Collects per-operation latencies of one worker thread'''
+
+    def __init__(self):
+        self.lat = []
+        self.bytes = 0
+
+    def timed(self, fn, *args):
+        start = time.perf_counter_ns()
+        res = fn(*args)
+        self.lat.append(time.perf_counter_ns() - start)
+        return res
+
+
+def drop_cache(fd, off=0, size=0):
+    # Clean pages are dropped from the FUSE page cache, so that the
+    # next read goes to the file system
+    os.posix_fadvise(fd, off, size, os.POSIX_FADV_DONTNEED)
+
+
+def wl_metadata(path, rec, args):
+    names = [ pjoin(path, 'f%d' % i) for i in range(args.files) ]
+    for name in names:
+        fd = rec.timed(os.open, name, os.O_CREAT | os.O_WRONLY, 0o644)
+        os.close(fd)
+    for name in names:
+        rec.timed(os.stat, name)
+    for name in names:
+        rec.timed(os.unlink, name)
+
+
+def wl_seqio(path, rec, args):
+    block = args.block_size
+    count = args.file_size // block
+    buf = b'x' * block
+
+    fd = os.open(path, os.O_CREAT | os.O_RDWR, 0o644)
+    try:
+        for i in range(count):
+            rec.bytes += rec.timed(os.pwrite, fd, buf, i * block)
+        os.fsync(fd)
+        drop_cache(fd)
+        for i in range(count):
+            rec.bytes += len(rec.timed(os.pread, fd, block, i * block))
+    finally:
+        os.close(fd)
+
+
+def wl_randio(path, rec, args):
+    block = 4096
+    nblocks = args.file_size // block
+    buf = b'y' * block
+    rnd = random.Random(42)
+
+    fd = os.open(path, os.O_CREAT | os.O_RDWR, 0o644)
+    try:
+        if os.fstat(fd).st_size < args.file_size:
+            os.ftruncate(fd, args.file_size)
+        for _ in range(args.random_ops):
+            off = rnd.randrange(nblocks) * block
+            if rnd.random() < 0.5:
+                drop_cache(fd, off, block)
+                rec.bytes += len(rec.timed(os.pread, fd, block, off))
+            else:
+                rec.bytes += rec.timed(os.pwrite, fd, buf, off)
+    finally:
+        os.close(fd)
+
+
+WORKLOAD_FNS = {
+    'metadata': wl_metadata,
+    'seqio': wl_seqio,
+    'randio': wl_randio,
+}
+
+
+def percentile(values, pct):
+    if not values:
+        return 0
+    idx = min(len(values) - 1, int(len(values) * pct / 100))
+    return values[idx]
+
+
+def run_workload(fs, workload, mnt_dir, args):
+    recs = [ Recorder() for _ in range(args.jobs) ]
+    errors = []
+
+    def worker(i):
+        if fs == 'null':
+            path = mnt_dir
+        elif workload == 'metadata':
+            path = pjoin(mnt_dir, 'job%d' % i)
+            os.mkdir(path)
+        else:
+            path = pjoin(mnt_dir, 'job%d.dat' % i)
+        try:
+            WORKLOAD_FNS[workload](path, recs[i], args)
+        except OSError as exc:
+            errors.append(exc)
+        finally:
+            if fs == 'null':
+                pass
+            elif workload == 'metadata':
+                os.rmdir(path)
+            elif os.path.exists(path):
+                os.unlink(path)
+
+    threads = [ threading.Thread(target=worker, args=(i,))
+                for i in range(args.jobs) ]
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - start
+    if errors:
+        raise errors[0]
+
+    lat = sorted(l for rec in recs for l in rec.lat)
+    nbytes = sum(rec.bytes for rec in recs)
+    return {
+        'ops': len(lat),
+        'seconds': round(elapsed, 3),
+        'ops_per_sec': round(len(lat) / elapsed, 1),
+        'mb_per_sec': round(nbytes / elapsed / 1e6, 1),
+        'latency_us': {
+            'p50': round(percentile(lat, 50) / 1000, 1),
+            'p90': round(percentile(lat, 90) / 1000, 1),
+            'p99': round(percentile(lat, 99) / 1000, 1),
+            'max': round(lat[-1] / 1000, 1) if lat else 0,
+        },
+    }
+
+
+def run_config(fs, config, workloads, args):
+    tmpdir = tempfile.mkdtemp(prefix='fuse-perf-')
+    src_dir = pjoin(tmpdir, 'src')
+    os.mkdir(src_dir)
+    mnt_dir = pjoin(tmpdir, 'mnt')
+    if fs == 'null':
+        open(mnt_dir, 'w').close()
+    else:
+        os.mkdir(mnt_dir)
+
+    results = []
+    output = subprocess.DEVNULL if not args.verbose else None
+    mount_process = mount(fs, config, src_dir, mnt_dir, output)
+    try:
+        for workload in workloads:
+            res = run_workload(fs, workload, mnt_dir, args)
+            res.update(fs=fs, config=config, workload=workload)
+            results.append(res)
+            print('%-15s %-9s %-9s %10.0f ops/s  p50 %8.1f us  p99 %8.1f us'
+                  % (fs, config, workload, res['ops_per_sec'],
+                     res['latency_us']['p50'], res['latency_us']['p99']),
+                  file=sys.stderr)
+    except BaseException:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+    finally:
+        shutil.rmtree(tmpdir, ignore_errors=True)
+    return results
+
+
+def compare(results, baseline_file):
+    with open(baseline_file) as fh:
+        baseline = json.load(fh)
+    old = { (r['fs'], r['config'], r['workload']): r
+            for r in baseline['results'] }
+
+    print('%-15s %-9s %-9s %12s %12s %8s'
+          % ('fs', 'config', 'workload', 'ops/s', 'baseline', 'change'))
+    for r in results:
+        b = old.get((r['fs'], r['config'], r['workload']))
+        if b is None or not b['ops_per_sec']:
+            continue
+        change = (r['ops_per_sec'] / b['ops_per_sec'] - 1) * 100
+        print('%-15s %-9s %-9s %12.0f %12.0f %+7.1f%%'
+              % (r['fs'], r['config'], r['workload'], r['ops_per_sec'],
+                 b['ops_per_sec'], change))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__.split('\n')[0])
+    parser.add_argument('--fs', default=','.join(CONFIGS),
+                        help='comma separated file systems (%(default)s)')
+    parser.add_argument('--config', default=','.join(CONFIGS['passthrough_hp']),
+                        help='comma separated loop and buffer configurations '
+                        '(%(default)s)')
+    parser.add_argument('--workload', default=','.join(WORKLOADS),
+                        help='comma separated workloads (%(default)s)')
+    parser.add_argument('--jobs', type=int, default=1,
+                        help='concurrent threads per workload (%(default)s)')
+    parser.add_argument('--files', type=int, default=2000,
+                        help='files per job for metadata (%(default)s)')
+    parser.add_argument('--file-size', type=int, default=64 << 20,
+                        help='file size in bytes for seqio and randio '
+                        '(%(default)s)')
+    parser.add_argument('--block-size', type=int, default=128 << 10,
+                        help='block size in bytes for seqio (%(default)s)')
+    parser.add_argument('--random-ops', type=int, default=20000,
+                        help='operations per job for randio (%(default)s)')
+    parser.add_argument('--output', help='write JSON results to this file '
+                        'instead of stdout')
+    parser.add_argument('--baseline', help='compare with the JSON results '
+                        'of an earlier run')
+    parser.add_argument('--verbose', action='store_true',
+                        help='show file system output')
+    args = parser.parse_args()
+
+    for workload in args.workload.split(','):
+        if workload not in WORKLOADS:
+            parser.error('unknown workload: %s' % workload)
+
+    results = []
+    for fs in args.fs.split(','):
+        if fs not in CONFIGS:
+            parser.error('unknown file system: %s' % fs)
+        for config in args.config.split(','):
+            if config not in CONFIGS[fs]:
+                parser.error('unknown configuration: %s' % config)
+            if CONFIGS[fs][config] is None:
+                continue
+            workloads = [ w for w in args.workload.split(',')
+                          if fs in WORKLOADS[w] ]
+            if workloads:
+                results += run_config(fs, config, workloads, args)
+
+    report = {
+        'machine': {
+            'system': platform.system(),
+            'release': platform.release(),
+            'machine': platform.machine(),
+            'cpus': os.cpu_count(),
+        },
+        'parameters': {
+            'jobs': args.jobs,
+            'files': args.files,
+            'file_size': args.file_size,
+            'block_size': args.block_size,
+            'random_ops': args.random_ops,
+        },
+        'results': results,
+    }
+    if args.output:
+        with open(args.output, 'w') as fh:
+            json.dump(report, fh, indent=2)
+    elif not args.baseline:
+        json.dump(report, sys.stdout, indent=2)
+        print()
+    if args.baseline:
+        compare(results, args.baseline)
+
+
+if __name__ == '__main__':
+    main()
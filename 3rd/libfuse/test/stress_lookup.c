@@ -0,0 +1,163 @@
+/*
+ * Stress test for the lookup and forget paths of a FUSE filesystem.
+ *
+ * Runs the same workload with 1, 2, 4, ... threads and prints the
+ * throughput for each step. Every thread repeatedly stats files from a
+ * shared set (a lookup of a known inode when the filesystem is mounted
+ * without entry caching, e.g. passthrough_hp --nocache) and creates and
+ * unlinks a private file (a lookup of a new inode, followed by a forget
+ * once the kernel drops it).
+ *
+ * Usage: stress_lookup dir [max_threads] [seconds] [nfiles]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static const char *base_dir;
+static int nfiles = 1000;
+static volatile int stop;
+
+struct worker {
+	pthread_t tid;
+	int id;
+	unsigned long ops;
+	int err;
+};
+
+static void *worker_main(void *data)
+{
+	struct worker *w = data;
+	unsigned int seed = w->id + 1;
+	char path[4096];
+	char priv[4096];
+	struct stat st;
+	int fd;
+
+	snprintf(priv, sizeof(priv), "%s/priv.%d", base_dir, w->id);
+	while (!stop) {
+		snprintf(path, sizeof(path), "%s/file.%d", base_dir,
+			 rand_r(&seed) % nfiles);
+		if (stat(path, &st) == -1) {
+			w->err = errno;
+			break;
+		}
+		fd = open(priv, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (fd == -1 || close(fd) == -1 || unlink(priv) == -1) {
+			w->err = errno;
+			break;
+		}
+		w->ops += 2;
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(int nthreads, int seconds)
+{
+	struct worker *w;
+	unsigned long ops = 0;
+	double start, elapsed;
+	int i, err = 0;
+
+	w = calloc(nthreads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	stop = 0;
+	start = now();
+	for (i = 0; i < nthreads; i++) {
+		w[i].id = i;
+		err = pthread_create(&w[i].tid, NULL, worker_main, &w[i]);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			nthreads = i;
+			break;
+		}
+	}
+	if (!err)
+		sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].tid, NULL);
+		ops += w[i].ops;
+		if (w[i].err && !err) {
+			fprintf(stderr, "thread %d: %s\n", i,
+				strerror(w[i].err));
+			err = w[i].err;
+		}
+	}
+	elapsed = now() - start;
+	free(w);
+	if (err)
+		return -1;
+
+	printf("%3d threads: %10.0f ops/s\n", nthreads, ops / elapsed);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char path[4096];
+	int max_threads = 8;
+	int seconds = 3;
+	int nthreads;
+	int i, fd, res = 0;
+
+	if (argc < 2 || argc > 5) {
+		fprintf(stderr, "Usage: stress_lookup dir [max_threads] "
+			"[seconds] [nfiles]\n");
+		return 1;
+	}
+	base_dir = argv[1];
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (argc > 3)
+		seconds = atoi(argv[3]);
+	if (argc > 4)
+		nfiles = atoi(argv[4]);
+	if (max_threads < 1 || seconds < 1 || nfiles < 1) {
+		fprintf(stderr, "stress_lookup: invalid argument\n");
+		return 1;
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		snprintf(path, sizeof(path), "%s/file.%d", base_dir, i);
+		fd = open(path, O_CREAT | O_WRONLY, 0644);
+		if (fd == -1) {
+			perror(path);
+			return 2;
+		}
+		close(fd);
+	}
+
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		if (run(nthreads, seconds) == -1) {
+			res = 3;
+			break;
+		}
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		snprintf(path, sizeof(path), "%s/file.%d", base_dir, i);
+		unlink(path);
+	}
+	return res;
+}
@@ -16,6 +16,7 @@ import filecmp
 import tempfile
 import time
 import errno
+import re
 import sys
 import platform
 from distutils.version import LooseVersion
@@ -162,6 +163,7 @@ def test_passthrough(short_tmpdir, name, debug, output_checker, writeback):
         tst_mkdir(work_dir)
         tst_rmdir(work_dir, src_dir)
         tst_unlink(work_dir, src_dir)
+        tst_rename_tree(work_dir)
         tst_symlink(work_dir)
         if os.getuid() == 0:
             tst_chown(work_dir)
@@ -188,6 +190,33 @@ def test_passthrough(short_tmpdir, name, debug, output_checker, writeback):
     else:
         umount(mount_process, mnt_dir)
 
+@pytest.mark.parametrize("name", ('passthrough', 'passthrough_plus'))
+def test_readdir_window(short_tmpdir, name, output_checker):
+    mnt_dir = str(short_tmpdir.mkdir('mnt'))
+    src_dir = str(short_tmpdir.mkdir('src'))
+
+    # Use a tiny window so that every directory is read in
+    # several passes
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'passthrough'),
+                '-f', '-o', 'readdir_window=7', mnt_dir ]
+    if name == 'passthrough_plus':
+        cmdline.append('--plus')
+
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        work_dir = mnt_dir + src_dir
+
+        tst_readdir(src_dir, work_dir)
+        tst_readdir_big(src_dir, work_dir)
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
 @pytest.mark.parametrize("cache", (False, True))
 def test_passthrough_hp(short_tmpdir, cache, output_checker):
     mnt_dir = str(short_tmpdir.mkdir('mnt'))
@@ -303,7 +332,9 @@ def test_poll(tmpdir, output_checker):
     else:
         umount(mount_process, mnt_dir)
 
-def test_null(tmpdir, output_checker):
+@pytest.mark.parametrize("loop_opts", ((), ('-o', 'clone_fd'),
+                                       ('-o', 'percpu_clone_fd')))
+def test_null(tmpdir, output_checker, loop_opts):
     progname = pjoin(basename, 'example', 'null')
     if not os.path.exists(progname):
         pytest.skip('%s not built' % os.path.basename(progname))
@@ -311,7 +342,7 @@ def test_null(tmpdir, output_checker):
     mnt_file = str(tmpdir) + '/file'
     with open(mnt_file, 'w') as fh:
         fh.write('dummy')
-    cmdline = base_cmdline + [ progname, '-f', mnt_file ]
+    cmdline = base_cmdline + [ progname, '-f', mnt_file ] + list(loop_opts)
     mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
                                      stderr=output_checker.fd)
     def test_fn(name):
@@ -365,6 +396,42 @@ def test_notify_inval_entry(tmpdir, notify, output_checker):
     else:
         umount(mount_process, mnt_dir)
 
+def test_notify_inval_batch(tmpdir, output_checker):
+    mnt_dir = str(tmpdir)
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'notify_inval_batch'),
+                '-f', '--update-interval=2', '--files=100',
+                '--changes=3', '-o', 'ro', mnt_dir ]
+    mount_process = subprocess.Popen(cmdline, stdout=subprocess.PIPE,
+                                     stderr=output_checker.fd,
+                                     universal_newlines=True)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        fname = pjoin(mnt_dir, 'file_42')
+        with open(fname, 'rb') as fh:
+            data = fh.read()
+
+        # The stats line is printed right after the batched run.  Its
+        # notifications must have dropped the attributes cached before
+        # it, or the mtime would still be that of the unbatched run.
+        # (The mount is read-only, because otherwise every read marks
+        # the atime stale and stat() always asks the file system.)
+        line = mount_process.stdout.readline()
+        hit = re.match(r'^run (\d+): 100 files, 300 changes: '
+                       r'unbatched \d+ ms, batched \d+ ms$', line)
+        assert hit, line
+        assert os.stat(fname).st_mtime >= int(hit.group(1))
+        with open(fname, 'rb') as fh:
+            assert fh.read() == data
+        assert mount_process.poll() is None
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+    finally:
+        mount_process.stdout.close()
+
 @pytest.mark.skipif(os.getuid() != 0,
                     reason='needs to run as root')
 def test_cuse(output_checker):
@@ -455,6 +522,34 @@ def tst_rmdir(mnt_dir, src_dir=None):
     assert exc_info.value.errno == errno.ENOENT
     assert name not in os.listdir(mnt_dir)
 
+def tst_rename_tree(mnt_dir):
+    top = pjoin(mnt_dir, name_generator())
+    deep = pjoin(top, 'a', 'b', 'c')
+    os.makedirs(deep)
+    with open(pjoin(deep, 'file'), 'wb') as fh:
+        fh.write(b'hello')
+    fstat = os.stat(pjoin(deep, 'file'))
+
+    # Renaming an ancestor must not leave stale paths behind
+    os.rename(pjoin(top, 'a'), pjoin(top, 'x'))
+    with pytest.raises(OSError) as exc_info:
+        os.stat(pjoin(deep, 'file'))
+    assert exc_info.value.errno == errno.ENOENT
+    newname = pjoin(top, 'x', 'b', 'c', 'file')
+    assert os.stat(newname).st_ino == fstat.st_ino
+    with open(newname, 'rb') as fh:
+        assert fh.read() == b'hello'
+
+    os.rename(pjoin(top, 'x', 'b'), pjoin(top, 'b'))
+    newname = pjoin(top, 'b', 'c', 'file')
+    assert os.stat(newname).st_ino == fstat.st_ino
+    os.unlink(newname)
+    os.rmdir(pjoin(top, 'x'))
+    os.rmdir(pjoin(top, 'b', 'c'))
+    os.rmdir(pjoin(top, 'b'))
+    os.rmdir(top)
+    assert not os.path.exists(top)
+
 def tst_symlink(mnt_dir):
     linkname = name_generator()
     fullname = mnt_dir + "/" + linkname
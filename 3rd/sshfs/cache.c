@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <glib.h>
@@ -19,6 +20,28 @@
 #define DEFAULT_MAX_CACHE_SIZE 10000
 #define DEFAULT_CACHE_CLEAN_INTERVAL_SECS 60
 #define DEFAULT_MIN_CACHE_CLEAN_INTERVAL_SECS 5
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+#define CACHE_CLEAN_BATCH 8
+
+struct list_head {
+	struct list_head *prev;
+	struct list_head *next;
+};
+
+/*
+ * The cache is split into shards by the hash of the path, each with its
+ * own lock, table and list of nodes in order of use.  Every insert
+ * drops the least recently used nodes of its shard that exceed the
+ * shard's part of max_size, and up to CACHE_CLEAN_BATCH expired ones,
+ * so that no operation has to scan the whole cache.
+ */
+struct cache_shard {
+	pthread_mutex_t lock;
+	GHashTable *table;
+	/* Most recently used first */
+	struct list_head lru;
+};
 
 struct cache {
 	int on;
@@ -26,18 +49,22 @@ struct cache {
 	unsigned int dir_timeout_secs;
 	unsigned int link_timeout_secs;
 	unsigned int max_size;
+	/* No longer used, expired nodes are dropped on insert */
 	unsigned int clean_interval_secs;
 	unsigned int min_clean_interval_secs;
 	struct fuse_operations *next_oper;
-	GHashTable *table;
+	struct cache_shard shards[CACHE_SHARDS];
+	unsigned int shard_max_size;
+	/* Protects write_ctr */
 	pthread_mutex_t lock;
-	time_t last_cleaned;
 	uint64_t write_ctr;
 };
 
 static struct cache cache;
 
 struct node {
+	struct list_head lru;
+	char *path;
 	struct stat stat;
 	time_t stat_valid;
 	char **dir;
@@ -63,42 +90,88 @@ struct file_handle {
 	unsigned long fs_fh;
 };
 
+#define node_entry(ptr) \
+	((struct node *) ((char *) (ptr) - offsetof(struct node, lru)))
+
+static void list_init(struct list_head *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static void list_add(struct list_head *new, struct list_head *head)
+{
+	struct list_head *next = head->next;
+	new->next = next;
+	new->prev = head;
+	next->prev = new;
+	head->next = new;
+}
+
+static void list_del(struct list_head *entry)
+{
+	struct list_head *prev = entry->prev;
+	struct list_head *next = entry->next;
+	next->prev = prev;
+	prev->next = next;
+}
+
 static void free_node(gpointer node_)
 {
 	struct node *node = (struct node *) node_;
+	list_del(&node->lru);
+	g_free(node->path);
 	g_strfreev(node->dir);
+	g_free(node->link);
 	g_free(node);
 }
 
-static int cache_clean_entry(void *key_, struct node *node, time_t *now)
+static struct cache_shard *cache_shard(const char *path)
 {
-	(void) key_;
-	if (*now > node->valid)
-		return TRUE;
-	else
-		return FALSE;
+	/* Take the top bits, the tables index by the low ones */
+	guint hash = g_str_hash(path) * 2654435761U;
+	return &cache.shards[hash >> (32 - CACHE_SHARD_BITS)];
 }
 
-static void cache_clean(void)
+/* Must be called with the shard's lock held */
+static void cache_clean(struct cache_shard *shard)
 {
 	time_t now = time(NULL);
-	if (now > cache.last_cleaned + cache.min_clean_interval_secs &&
-	    (g_hash_table_size(cache.table) > cache.max_size ||
-	     now > cache.last_cleaned + cache.clean_interval_secs)) {
-		g_hash_table_foreach_remove(cache.table,
-					    (GHRFunc) cache_clean_entry, &now);
-		cache.last_cleaned = now;
+	int n;
+
+	while (g_hash_table_size(shard->table) > cache.shard_max_size)
+		g_hash_table_remove(shard->table,
+				    node_entry(shard->lru.prev)->path);
+
+	for (n = 0; n < CACHE_CLEAN_BATCH && shard->lru.prev != &shard->lru;
+	     n++) {
+		struct node *node = node_entry(shard->lru.prev);
+
+		if (now <= node->valid)
+			break;
+		g_hash_table_remove(shard->table, node->path);
 	}
 }
 
-static struct node *cache_lookup(const char *path)
+/* Must be called with the shard's lock held */
+static struct node *cache_lookup(struct cache_shard *shard, const char *path)
 {
-	return (struct node *) g_hash_table_lookup(cache.table, path);
+	struct node *node = g_hash_table_lookup(shard->table, path);
+
+	if (node != NULL && node->lru.prev != &shard->lru) {
+		list_del(&node->lru);
+		list_add(&node->lru, &shard->lru);
+	}
+	return node;
 }
 
 static void cache_purge(const char *path)
 {
-	g_hash_table_remove(cache.table, path);
+	struct cache_shard *shard = cache_shard(path);
+
+	pthread_mutex_lock(&shard->lock);
+	g_hash_table_remove(shard->table, path);
+	pthread_mutex_unlock(&shard->lock);
 }
 
 static void cache_purge_parent(const char *path)
@@ -106,7 +179,7 @@ static void cache_purge_parent(const char *path)
 	const char *s = strrchr(path, '/');
 	if (s) {
 		if (s == path)
-			g_hash_table_remove(cache.table, "/");
+			cache_purge("/");
 		else {
 			char *parent = g_strndup(path, s - path);
 			cache_purge(parent);
@@ -117,25 +190,25 @@ static void cache_purge_parent(const char *path)
 
 void cache_invalidate(const char *path)
 {
-	pthread_mutex_lock(&cache.lock);
 	cache_purge(path);
-	pthread_mutex_unlock(&cache.lock);
 }
 
 static void cache_invalidate_write(const char *path)
 {
+	struct cache_shard *shard = cache_shard(path);
+
+	pthread_mutex_lock(&shard->lock);
+	g_hash_table_remove(shard->table, path);
 	pthread_mutex_lock(&cache.lock);
-	cache_purge(path);
 	cache.write_ctr++;
 	pthread_mutex_unlock(&cache.lock);
+	pthread_mutex_unlock(&shard->lock);
 }
 
 static void cache_invalidate_dir(const char *path)
 {
-	pthread_mutex_lock(&cache.lock);
 	cache_purge(path);
 	cache_purge_parent(path);
-	pthread_mutex_unlock(&cache.lock);
 }
 
 static int cache_del_children(const char *key, void *val_, const char *path)
@@ -149,56 +222,72 @@ static int cache_del_children(const char *key, void *val_, const char *path)
 
 static void cache_do_rename(const char *from, const char *to)
 {
-	pthread_mutex_lock(&cache.lock);
-	g_hash_table_foreach_remove(cache.table, (GHRFunc) cache_del_children,
-				    (char *) from);
+	int i;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache.shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		g_hash_table_foreach_remove(shard->table,
+					    (GHRFunc) cache_del_children,
+					    (char *) from);
+		pthread_mutex_unlock(&shard->lock);
+	}
 	cache_purge(from);
 	cache_purge(to);
 	cache_purge_parent(from);
 	cache_purge_parent(to);
-	pthread_mutex_unlock(&cache.lock);
 }
 
-static struct node *cache_get(const char *path)
+/* Must be called with the shard's lock held */
+static struct node *cache_get(struct cache_shard *shard, const char *path)
 {
-	struct node *node = cache_lookup(path);
+	struct node *node = cache_lookup(shard, path);
 	if (node == NULL) {
-		char *pathcopy = g_strdup(path);
 		node = g_new0(struct node, 1);
-		g_hash_table_insert(cache.table, pathcopy, node);
+		node->path = g_strdup(path);
+		list_add(&node->lru, &shard->lru);
+		g_hash_table_insert(shard->table, node->path, node);
 	}
 	return node;
 }
 
 void cache_add_attr(const char *path, const struct stat *stbuf, uint64_t wrctr)
 {
+	struct cache_shard *shard = cache_shard(path);
 	struct node *node;
+	int current;
 
+	/* The shard's lock orders this against cache_invalidate_write() */
+	pthread_mutex_lock(&shard->lock);
 	pthread_mutex_lock(&cache.lock);
-	if (wrctr == cache.write_ctr) {
-		node = cache_get(path);
+	current = wrctr == cache.write_ctr;
+	pthread_mutex_unlock(&cache.lock);
+	if (current) {
+		node = cache_get(shard, path);
 		node->stat = *stbuf;
 		node->stat_valid = time(NULL) + cache.stat_timeout_secs;
 		if (node->stat_valid > node->valid)
 			node->valid = node->stat_valid;
-		cache_clean();
+		cache_clean(shard);
 	}
-	pthread_mutex_unlock(&cache.lock);
+	pthread_mutex_unlock(&shard->lock);
 }
 
 static void cache_add_dir(const char *path, char **dir)
 {
+	struct cache_shard *shard = cache_shard(path);
 	struct node *node;
 
-	pthread_mutex_lock(&cache.lock);
-	node = cache_get(path);
+	pthread_mutex_lock(&shard->lock);
+	node = cache_get(shard, path);
 	g_strfreev(node->dir);
 	node->dir = dir;
 	node->dir_valid = time(NULL) + cache.dir_timeout_secs;
 	if (node->dir_valid > node->valid)
 		node->valid = node->dir_valid;
-	cache_clean();
-	pthread_mutex_unlock(&cache.lock);
+	cache_clean(shard);
+	pthread_mutex_unlock(&shard->lock);
 }
 
 static size_t my_strnlen(const char *s, size_t maxsize)
@@ -210,25 +299,27 @@ static size_t my_strnlen(const char *s, size_t maxsize)
 
 static void cache_add_link(const char *path, const char *link, size_t size)
 {
+	struct cache_shard *shard = cache_shard(path);
 	struct node *node;
 
-	pthread_mutex_lock(&cache.lock);
-	node = cache_get(path);
+	pthread_mutex_lock(&shard->lock);
+	node = cache_get(shard, path);
 	g_free(node->link);
 	node->link = g_strndup(link, my_strnlen(link, size-1));
 	node->link_valid = time(NULL) + cache.link_timeout_secs;
 	if (node->link_valid > node->valid)
 		node->valid = node->link_valid;
-	cache_clean();
-	pthread_mutex_unlock(&cache.lock);
+	cache_clean(shard);
+	pthread_mutex_unlock(&shard->lock);
 }
 
 static int cache_get_attr(const char *path, struct stat *stbuf)
 {
+	struct cache_shard *shard = cache_shard(path);
 	struct node *node;
 	int err = -EAGAIN;
-	pthread_mutex_lock(&cache.lock);
-	node = cache_lookup(path);
+	pthread_mutex_lock(&shard->lock);
+	node = cache_lookup(shard, path);
 	if (node != NULL) {
 		time_t now = time(NULL);
 		if (node->stat_valid - now >= 0) {
@@ -236,7 +327,7 @@ static int cache_get_attr(const char *path, struct stat *stbuf)
 			err = 0;
 		}
 	}
-	pthread_mutex_unlock(&cache.lock);
+	pthread_mutex_unlock(&shard->lock);
 	return err;
 }
 
@@ -278,21 +369,22 @@ static int cache_getattr(const char *path, struct stat *stbuf,
 
 static int cache_readlink(const char *path, char *buf, size_t size)
 {
+	struct cache_shard *shard = cache_shard(path);
 	struct node *node;
 	int err;
 
-	pthread_mutex_lock(&cache.lock);
-	node = cache_lookup(path);
+	pthread_mutex_lock(&shard->lock);
+	node = cache_lookup(shard, path);
 	if (node != NULL) {
 		time_t now = time(NULL);
 		if (node->link_valid - now >= 0) {
 			strncpy(buf, node->link, size-1);
 			buf[size-1] = '\0';
-			pthread_mutex_unlock(&cache.lock);
+			pthread_mutex_unlock(&shard->lock);
 			return 0;
 		}
 	}
-	pthread_mutex_unlock(&cache.lock);
+	pthread_mutex_unlock(&shard->lock);
 	err = cache.next_oper->readlink(path, buf, size);
 	if (!err)
 		cache_add_link(path, buf, size);
@@ -340,20 +432,50 @@ static int cache_dirfill (void *buf, const char *name,
 
 	ch = (struct readdir_handle*) buf;
 	err = ch->filler(ch->buf, name, stbuf, off, flags);
-	if (!err) {
-		g_ptr_array_add(ch->dir, g_strdup(name));
-		if (stbuf->st_mode & S_IFMT) {
-			char *fullpath;
-			const char *basepath = !ch->path[1] ? "" : ch->path;
-
-			fullpath = g_strdup_printf("%s/%s", basepath, name);
-			cache_add_attr(fullpath, stbuf, ch->wrctr);
-			g_free(fullpath);
-		}
+	/* The listing is cached whole, even if the caller wants no more */
+	g_ptr_array_add(ch->dir, g_strdup(name));
+	if (stbuf && (stbuf->st_mode & S_IFMT)) {
+		char *fullpath;
+		const char *basepath = !ch->path[1] ? "" : ch->path;
+
+		fullpath = g_strdup_printf("%s/%s", basepath, name);
+		cache_add_attr(fullpath, stbuf, ch->wrctr);
+		g_free(fullpath);
 	}
 	return err;
 }
 
+/*
+ * Returns a cached listing with the cached attributes of its entries.
+ * Fails if any of them has expired, then the directory is read again,
+ * which is cheaper than the kernel looking up the entries one by one.
+ */
+static int cache_fill_plus(const char *path, char **dir, void *buf,
+			   fuse_fill_dir_t filler)
+{
+	const char *basepath = !path[1] ? "" : path;
+	unsigned n = g_strv_length(dir);
+	struct stat *stats = g_new(struct stat, n ? n : 1);
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		char *fullpath = g_strdup_printf("%s/%s", basepath, dir[i]);
+		int err = cache_get_attr(fullpath, &stats[i]);
+
+		g_free(fullpath);
+		if (err) {
+			g_free(stats);
+			return err;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (filler(buf, dir[i], &stats[i], 0, FUSE_FILL_DIR_PLUS))
+			break;
+	}
+	g_free(stats);
+	return 0;
+}
+
 static int cache_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			 off_t offset, struct fuse_file_info *fi,
 			 enum fuse_readdir_flags flags)
@@ -363,22 +485,35 @@ static int cache_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	int err;
 	char **dir;
 	struct node *node;
+	struct cache_shard *shard = cache_shard(path);
 
 	assert(offset == 0);
 
-	pthread_mutex_lock(&cache.lock);
-	node = cache_lookup(path);
+	pthread_mutex_lock(&shard->lock);
+	node = cache_lookup(shard, path);
 	if (node != NULL && node->dir != NULL) {
 		time_t now = time(NULL);
 		if (node->dir_valid - now >= 0) {
+			if (flags & FUSE_READDIR_PLUS) {
+				/* Entries may live in other shards */
+				dir = g_strdupv(node->dir);
+				pthread_mutex_unlock(&shard->lock);
+				err = cache_fill_plus(path, dir, buf, filler);
+				g_strfreev(dir);
+				if (!err)
+					return 0;
+				goto read_dir;
+			}
 			for(dir = node->dir; *dir != NULL; dir++)
 				// FIXME: What about st_mode?
 				filler(buf, *dir, NULL, 0, 0);
-			pthread_mutex_unlock(&cache.lock);
+			pthread_mutex_unlock(&shard->lock);
 			return 0;
 		}
 	}
-	pthread_mutex_unlock(&cache.lock);
+	pthread_mutex_unlock(&shard->lock);
+
+read_dir:
 
 	cfi = (struct file_handle*) fi->fh;
 	if(cfi->is_open)
@@ -505,6 +640,21 @@ static int cache_write(const char *path, const char *buf, size_t size,
 	return res;
 }
 
+static ssize_t cache_copy_file_range(const char *path_in,
+				     struct fuse_file_info *fi_in,
+				     off_t offset_in, const char *path_out,
+				     struct fuse_file_info *fi_out,
+				     off_t offset_out, size_t size, int flags)
+{
+	ssize_t res = cache.next_oper->copy_file_range(path_in, fi_in,
+						       offset_in, path_out,
+						       fi_out, offset_out,
+						       size, flags);
+	if (res >= 0)
+		cache_invalidate_write(path_out);
+	return res;
+}
+
 static int cache_create(const char *path, mode_t mode,
                         struct fuse_file_info *fi)
 {
@@ -529,6 +679,8 @@ static void cache_fill(struct fuse_operations *oper,
 	cache_oper->access   = oper->access;
 	cache_oper->chmod    = oper->chmod ? cache_chmod : NULL;
 	cache_oper->chown    = oper->chown ? cache_chown : NULL;
+	cache_oper->copy_file_range = oper->copy_file_range ?
+		cache_copy_file_range : NULL;
 	cache_oper->create   = oper->create ? cache_create : NULL;
 	cache_oper->flush    = oper->flush;
 	cache_oper->fsync    = oper->fsync;
@@ -561,15 +713,23 @@ static void cache_fill(struct fuse_operations *oper,
 struct fuse_operations *cache_wrap(struct fuse_operations *oper)
 {
 	static struct fuse_operations cache_oper;
+	int i;
 	cache.next_oper = oper;
 
 	cache_fill(oper, &cache_oper);
 	pthread_mutex_init(&cache.lock, NULL);
-	cache.table = g_hash_table_new_full(g_str_hash, g_str_equal,
-					    g_free, free_node);
-	if (cache.table == NULL) {
-		fprintf(stderr, "failed to create cache\n");
-		return NULL;
+	cache.shard_max_size = (cache.max_size + CACHE_SHARDS - 1) / CACHE_SHARDS;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache.shards[i];
+
+		pthread_mutex_init(&shard->lock, NULL);
+		list_init(&shard->lru);
+		shard->table = g_hash_table_new_full(g_str_hash, g_str_equal,
+						     NULL, free_node);
+		if (shard->table == NULL) {
+			fprintf(stderr, "failed to create cache\n");
+			return NULL;
+		}
 	}
 	return &cache_oper;
 }
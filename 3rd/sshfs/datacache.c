@@ -0,0 +1,872 @@
+/*
+  Persistent data cache
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "datacache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <glib.h>
+#include <pthread.h>
+
+#define DEFAULT_DATACACHE_SIZE_MB 1024
+#define DATACACHE_MAGIC "sshfs data cache 3"
+#define DATACACHE_INFO "info"
+/* Disk space of the two directories and the info file of a cached file */
+#define DATACACHE_FILE_OVERHEAD (3 * 4096)
+
+/*
+ * The cache directory has one subdirectory per remote file, named by a
+ * hash of its key.  The key is the remote directory of the mount
+ * ([user@]host:path) followed by the path in the mount, so that mounts
+ * of different hosts or directories can share a cache directory.  Below
+ * it, a directory named by a generation number holds an "info" file
+ * with the key, size and modification time of the file the blocks were
+ * read from, and one file per cached block, named by the block index.
+ * Only whole blocks are stored, the last block of a file ends at the
+ * file size.
+ *
+ * The blocks of a file are only used while the size and modification
+ * time returned by the server at open match the ones in "info".
+ * Otherwise, and whenever the file is opened for writing, written,
+ * truncated, removed or renamed through this mount, the file moves on
+ * to a new generation and the old one is removed.
+ *
+ * Nothing is written for a file until its first block is stored.  A
+ * file without blocks and without open handles is forgotten, and its
+ * directories are removed.  Their space counts against the cache size.
+ *
+ * Files of an old generation can never be taken for current ones, so
+ * all removals are done after datacache.lock has been dropped, see
+ * dc_empty_trash().  Only the renames that make a new block or info file
+ * current are done under the lock, after checking the generation.
+ */
+
+struct dc_list {
+	struct dc_list *prev;
+	struct dc_list *next;
+};
+
+struct dc_file;
+
+struct dc_block {
+	struct dc_list lru;
+	struct dc_file *file;
+	uint64_t index;
+	size_t size;
+	time_t atime;
+};
+
+struct dc_file {
+	char name[17];
+	char *key;
+	off_t size;
+	time_t mtime;
+	unsigned gen;
+	/* Open handles */
+	unsigned refs;
+	/* The info file of this generation is on disk */
+	int has_info;
+	GHashTable *blocks;
+};
+
+struct datacache_handle {
+	struct dc_file *file;
+	unsigned gen;
+	off_t size;
+};
+
+struct datacache {
+	char *dir;
+	char *remote;
+	unsigned size_mb;
+	uint64_t max_bytes;
+	uint64_t bytes;
+	unsigned next_gen;
+	GHashTable *files;
+	/* Most recently used block first */
+	struct dc_list lru;
+	pthread_mutex_t lock;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+static struct datacache datacache;
+
+#define dc_block_entry(ptr) \
+	((struct dc_block *) ((char *) (ptr) - offsetof(struct dc_block, lru)))
+
+static void dc_list_init(struct dc_list *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static void dc_list_add(struct dc_list *new, struct dc_list *head)
+{
+	struct dc_list *next = head->next;
+	new->next = next;
+	new->prev = head;
+	next->prev = new;
+	head->next = new;
+}
+
+static void dc_list_del(struct dc_list *entry)
+{
+	struct dc_list *prev = entry->prev;
+	struct dc_list *next = entry->next;
+	next->prev = prev;
+	prev->next = next;
+}
+
+static char *dc_key(const char *path)
+{
+	return g_strdup_printf("%s%s", datacache.remote, path);
+}
+
+/* 64-bit FNV-1a */
+static void dc_hash_name(const char *key, char *name)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (; *key; key++) {
+		hash ^= (unsigned char) *key;
+		hash *= 0x100000001b3ULL;
+	}
+	sprintf(name, "%016llx", (unsigned long long) hash);
+}
+
+static char *dc_file_path(const char *name)
+{
+	return g_strdup_printf("%s/%s", datacache.dir, name);
+}
+
+static char *dc_gen_path(const char *name, unsigned gen)
+{
+	return g_strdup_printf("%s/%s/%u", datacache.dir, name, gen);
+}
+
+static char *dc_block_path(const struct dc_file *f, unsigned gen,
+			   uint64_t index)
+{
+	return g_strdup_printf("%s/%s/%u/%llu", datacache.dir, f->name, gen,
+			       (unsigned long long) index);
+}
+
+/* Size of a block of a file, 0 past the end of the file */
+static size_t dc_block_size(off_t fsize, uint64_t index)
+{
+	off_t start = (off_t) index * DATACACHE_BLOCK_SIZE;
+
+	if (start >= fsize)
+		return 0;
+	if (fsize - start < DATACACHE_BLOCK_SIZE)
+		return fsize - start;
+	return DATACACHE_BLOCK_SIZE;
+}
+
+/* Remove a file, or a directory and the files in it */
+static void dc_remove(const char *path)
+{
+	struct dirent *de;
+	DIR *dp;
+
+	if (unlink(path) == 0 || (errno != EISDIR && errno != EPERM))
+		return;
+	dp = opendir(path);
+	if (dp != NULL) {
+		while ((de = readdir(dp)) != NULL) {
+			char *epath;
+
+			if (strcmp(de->d_name, ".") == 0 ||
+			    strcmp(de->d_name, "..") == 0)
+				continue;
+			epath = g_strdup_printf("%s/%s", path, de->d_name);
+			unlink(epath);
+			g_free(epath);
+		}
+		closedir(dp);
+	}
+	rmdir(path);
+}
+
+/* Must be called with datacache.lock held, takes over path */
+static void dc_trash(GPtrArray *trash, char *path)
+{
+	g_ptr_array_add(trash, path);
+}
+
+/* Remove what was put in the trash, without datacache.lock held */
+static void dc_empty_trash(GPtrArray *trash)
+{
+	guint i;
+
+	for (i = 0; i < trash->len; i++) {
+		dc_remove(g_ptr_array_index(trash, i));
+		g_free(g_ptr_array_index(trash, i));
+	}
+	g_ptr_array_free(trash, TRUE);
+}
+
+/* Must be called with datacache.lock held */
+static struct dc_file *dc_file_new(const char *name)
+{
+	struct dc_file *f = g_new0(struct dc_file, 1);
+
+	strcpy(f->name, name);
+	f->size = -1;
+	f->gen = datacache.next_gen++;
+	f->blocks = g_hash_table_new(g_int64_hash, g_int64_equal);
+	g_hash_table_insert(datacache.files, f->name, f);
+	return f;
+}
+
+/*
+ * Forget a file that has neither blocks nor open handles.  Must be
+ * called with datacache.lock held
+ */
+static void dc_file_put(struct dc_file *f, GPtrArray *trash)
+{
+	if (f->refs || g_hash_table_size(f->blocks))
+		return;
+	if (f->has_info) {
+		dc_trash(trash, dc_gen_path(f->name, f->gen));
+		dc_trash(trash, dc_file_path(f->name));
+		datacache.bytes -= DATACACHE_FILE_OVERHEAD;
+	}
+	g_hash_table_remove(datacache.files, f->name);
+	g_hash_table_destroy(f->blocks);
+	g_free(f->key);
+	g_free(f);
+}
+
+/* Must be called with datacache.lock held.  May forget the file */
+static void dc_drop_block(struct dc_block *b, GPtrArray *trash)
+{
+	struct dc_file *f = b->file;
+
+	g_hash_table_remove(f->blocks, &b->index);
+	dc_trash(trash, dc_block_path(f, f->gen, b->index));
+	dc_list_del(&b->lru);
+	datacache.bytes -= b->size;
+	g_free(b);
+	dc_file_put(f, trash);
+}
+
+/* Must be called with datacache.lock held */
+static void dc_evict(GPtrArray *trash)
+{
+	while (datacache.bytes > datacache.max_bytes &&
+	       datacache.lru.prev != &datacache.lru) {
+		dc_drop_block(dc_block_entry(datacache.lru.prev), trash);
+		datacache.evictions++;
+	}
+}
+
+/*
+ * Drop all blocks of a file, and make the handles that are open on it
+ * bypass the cache.  Must be called with datacache.lock held
+ */
+static void dc_reset(struct dc_file *f, GPtrArray *trash)
+{
+	GHashTableIter iter;
+	gpointer val;
+
+	g_hash_table_iter_init(&iter, f->blocks);
+	while (g_hash_table_iter_next(&iter, NULL, &val)) {
+		struct dc_block *b = val;
+
+		g_hash_table_iter_remove(&iter);
+		dc_list_del(&b->lru);
+		datacache.bytes -= b->size;
+		g_free(b);
+	}
+	if (f->has_info) {
+		dc_trash(trash, dc_gen_path(f->name, f->gen));
+		dc_trash(trash, dc_file_path(f->name));
+		datacache.bytes -= DATACACHE_FILE_OVERHEAD;
+		f->has_info = 0;
+	}
+	f->size = -1;
+	f->gen = datacache.next_gen++;
+}
+
+/*
+ * Write the info file for the generation of a handle, unless the file
+ * has moved on since.  Returns 0 if the generation has an info file
+ */
+static int dc_write_info(struct datacache_handle *dh)
+{
+	struct dc_file *f = dh->file;
+	char *dpath = dc_file_path(f->name);
+	char *gpath = dc_gen_path(f->name, dh->gen);
+	char *ipath = g_strdup_printf("%s/" DATACACHE_INFO, gpath);
+	char *tmp = g_strdup_printf("%s/" DATACACHE_INFO ".XXXXXX", gpath);
+	GPtrArray *trash;
+	time_t mtime = 0;
+	char *key = NULL;
+	int renamed = 0;
+	int res = -1;
+	FILE *fp;
+	int fd;
+
+	pthread_mutex_lock(&datacache.lock);
+	if (dh->gen == f->gen) {
+		key = g_strdup(f->key);
+		mtime = f->mtime;
+	}
+	pthread_mutex_unlock(&datacache.lock);
+	if (key == NULL)
+		goto out;
+
+	if ((mkdir(dpath, 0700) == -1 && errno != EEXIST) ||
+	    (mkdir(gpath, 0700) == -1 && errno != EEXIST))
+		goto out;
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		goto out_rmdir;
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		close(fd);
+		unlink(tmp);
+		goto out_rmdir;
+	}
+	fprintf(fp, DATACACHE_MAGIC "\n%lld %lld\n%s", (long long) dh->size,
+		(long long) mtime, key);
+	if (fclose(fp) != 0) {
+		unlink(tmp);
+		goto out_rmdir;
+	}
+
+	trash = g_ptr_array_new();
+	pthread_mutex_lock(&datacache.lock);
+	if (dh->gen == f->gen && !f->has_info && rename(tmp, ipath) == 0) {
+		renamed = 1;
+		f->has_info = 1;
+		datacache.bytes += DATACACHE_FILE_OVERHEAD;
+		dc_evict(trash);
+	}
+	if (dh->gen == f->gen && f->has_info)
+		res = 0;
+	pthread_mutex_unlock(&datacache.lock);
+	dc_empty_trash(trash);
+	if (!renamed)
+		unlink(tmp);
+
+out_rmdir:
+	/* Left behind by a generation that is gone */
+	if (res == -1)
+		rmdir(gpath);
+out:
+	g_free(key);
+	g_free(tmp);
+	g_free(ipath);
+	g_free(gpath);
+	g_free(dpath);
+	return res;
+}
+
+static int dc_read_info(struct dc_file *f)
+{
+	char *ipath = g_strdup_printf("%s/%s/%u/" DATACACHE_INFO,
+				      datacache.dir, f->name, f->gen);
+	char buf[PATH_MAX + 64];
+	long long size, mtime;
+	char *key;
+	size_t len;
+	FILE *fp;
+
+	fp = fopen(ipath, "r");
+	g_free(ipath);
+	if (fp == NULL)
+		return -1;
+	len = fread(buf, 1, sizeof(buf) - 1, fp);
+	fclose(fp);
+	buf[len] = '\0';
+
+	if (strncmp(buf, DATACACHE_MAGIC "\n", strlen(DATACACHE_MAGIC) + 1))
+		return -1;
+	key = strchr(buf + strlen(DATACACHE_MAGIC) + 1, '\n');
+	if (key == NULL ||
+	    sscanf(buf + strlen(DATACACHE_MAGIC) + 1, "%lld %lld",
+		   &size, &mtime) != 2 || size < 0)
+		return -1;
+
+	f->key = g_strdup(key + 1);
+	f->size = size;
+	f->mtime = mtime;
+	return 0;
+}
+
+/* Newest generation directory of a cached file, -1 if there is none */
+static long long dc_newest_gen(const char *dpath)
+{
+	long long newest = -1;
+	struct dirent *de;
+	DIR *dp;
+
+	dp = opendir(dpath);
+	if (dp == NULL)
+		return -1;
+	while ((de = readdir(dp)) != NULL) {
+		char *end;
+		unsigned long gen = strtoul(de->d_name, &end, 10);
+
+		if (de->d_name[0] < '0' || de->d_name[0] > '9' ||
+		    *end != '\0' || gen > UINT_MAX)
+			continue;
+		if (gen >= datacache.next_gen)
+			datacache.next_gen = gen + 1;
+		if ((long long) gen > newest)
+			newest = gen;
+	}
+	closedir(dp);
+	return newest;
+}
+
+/*
+ * Add the blocks of the newest generation of one cached file to the
+ * table, remove anything else.  Runs before any other thread
+ */
+static void dc_load_file(const char *name, GPtrArray *blocks,
+			 GPtrArray *trash)
+{
+	char *dpath = dc_file_path(name);
+	long long newest = dc_newest_gen(dpath);
+	struct dc_file *f = NULL;
+	struct dirent *de;
+	char *gpath;
+	DIR *dp;
+
+	if (newest != -1) {
+		f = dc_file_new(name);
+		f->gen = newest;
+		if (dc_read_info(f) == 0) {
+			f->has_info = 1;
+			datacache.bytes += DATACACHE_FILE_OVERHEAD;
+		}
+	}
+
+	/* Older generations, and what older cache formats left */
+	dp = opendir(dpath);
+	if (dp == NULL) {
+		unlink(dpath);
+		g_free(dpath);
+		return;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		char *end;
+
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0 ||
+		    (f != NULL && f->has_info &&
+		     strtoull(de->d_name, &end, 10) == f->gen &&
+		     *end == '\0' && de->d_name[0] != '\0'))
+			continue;
+		dc_trash(trash, g_strdup_printf("%s/%s", dpath, de->d_name));
+	}
+	closedir(dp);
+	if (f == NULL || !f->has_info) {
+		if (f != NULL)
+			dc_file_put(f, trash);
+		dc_trash(trash, dpath);
+		return;
+	}
+	g_free(dpath);
+
+	gpath = dc_gen_path(name, f->gen);
+	dp = opendir(gpath);
+	while (dp != NULL && (de = readdir(dp)) != NULL) {
+		char *bpath;
+		char *end;
+		uint64_t index;
+		struct stat stbuf;
+		struct dc_block *b;
+
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0 ||
+		    strcmp(de->d_name, DATACACHE_INFO) == 0)
+			continue;
+
+		bpath = g_strdup_printf("%s/%s", gpath, de->d_name);
+		index = strtoull(de->d_name, &end, 10);
+		if (*end != '\0' || stat(bpath, &stbuf) == -1 ||
+		    dc_block_size(f->size, index) == 0 ||
+		    (size_t) stbuf.st_size != dc_block_size(f->size, index)) {
+			dc_trash(trash, bpath);
+			continue;
+		}
+		g_free(bpath);
+
+		b = g_new0(struct dc_block, 1);
+		b->file = f;
+		b->index = index;
+		b->size = stbuf.st_size;
+		b->atime = stbuf.st_atime;
+		g_hash_table_insert(f->blocks, &b->index, b);
+		dc_list_add(&b->lru, &datacache.lru);
+		g_ptr_array_add(blocks, b);
+		datacache.bytes += b->size;
+	}
+	if (dp != NULL)
+		closedir(dp);
+	g_free(gpath);
+	dc_file_put(f, trash);
+}
+
+static int dc_cmp_atime(const void *a, const void *b)
+{
+	const struct dc_block *ba = *(struct dc_block * const *) a;
+	const struct dc_block *bb = *(struct dc_block * const *) b;
+
+	return ba->atime < bb->atime ? -1 : ba->atime > bb->atime;
+}
+
+int datacache_init(const char *remote)
+{
+	GPtrArray *blocks;
+	GPtrArray *trash;
+	struct dirent *de;
+	char *dir;
+	DIR *dp;
+	guint i;
+
+	if (!datacache.dir)
+		return 0;
+
+	if (mkdir(datacache.dir, 0700) == -1 && errno != EEXIST) {
+		fprintf(stderr, "failed to create data cache directory %s: %s\n",
+			datacache.dir, strerror(errno));
+		return -1;
+	}
+	/* The daemon changes to the root directory */
+	dir = realpath(datacache.dir, NULL);
+	if (dir == NULL) {
+		fprintf(stderr, "bad data cache directory %s: %s\n",
+			datacache.dir, strerror(errno));
+		return -1;
+	}
+	free(datacache.dir);
+	datacache.dir = dir;
+	datacache.remote = g_strdup(remote);
+
+	datacache.max_bytes = (uint64_t) datacache.size_mb * 1024 * 1024;
+	datacache.files = g_hash_table_new(g_str_hash, g_str_equal);
+	dc_list_init(&datacache.lru);
+	pthread_mutex_init(&datacache.lock, NULL);
+
+	dp = opendir(datacache.dir);
+	if (dp == NULL) {
+		fprintf(stderr, "failed to open data cache directory %s: %s\n",
+			datacache.dir, strerror(errno));
+		return -1;
+	}
+	blocks = g_ptr_array_new();
+	trash = g_ptr_array_new();
+	while ((de = readdir(dp)) != NULL) {
+		if (strlen(de->d_name) == 16 &&
+		    strspn(de->d_name, "0123456789abcdef") == 16)
+			dc_load_file(de->d_name, blocks, trash);
+	}
+	closedir(dp);
+
+	/* The least recently used blocks go to the end of the list */
+	qsort(blocks->pdata, blocks->len, sizeof(gpointer), dc_cmp_atime);
+	for (i = 0; i < blocks->len; i++) {
+		struct dc_block *b = g_ptr_array_index(blocks, i);
+		dc_list_del(&b->lru);
+		dc_list_add(&b->lru, &datacache.lru);
+	}
+	g_ptr_array_free(blocks, TRUE);
+	dc_evict(trash);
+	dc_empty_trash(trash);
+
+	return 0;
+}
+
+int datacache_enabled(void)
+{
+	return datacache.dir != NULL;
+}
+
+struct datacache_handle *datacache_open(const char *path,
+					const struct stat *stbuf)
+{
+	struct datacache_handle *dh;
+	GPtrArray *trash;
+	char name[17];
+	struct dc_file *f;
+	char *key;
+
+	if (!datacache.dir || !S_ISREG(stbuf->st_mode) || !stbuf->st_size)
+		return NULL;
+
+	key = dc_key(path);
+	dc_hash_name(key, name);
+	trash = g_ptr_array_new();
+	pthread_mutex_lock(&datacache.lock);
+	f = g_hash_table_lookup(datacache.files, name);
+	if (f == NULL)
+		f = dc_file_new(name);
+	if (f->size != stbuf->st_size || f->mtime != stbuf->st_mtime ||
+	    f->key == NULL || strcmp(f->key, key) != 0) {
+		dc_reset(f, trash);
+		g_free(f->key);
+		f->key = key;
+		key = NULL;
+		f->size = stbuf->st_size;
+		f->mtime = stbuf->st_mtime;
+	}
+	f->refs++;
+	dh = g_new(struct datacache_handle, 1);
+	dh->file = f;
+	dh->gen = f->gen;
+	dh->size = f->size;
+	pthread_mutex_unlock(&datacache.lock);
+	dc_empty_trash(trash);
+	g_free(key);
+
+	return dh;
+}
+
+void datacache_release(struct datacache_handle *dh)
+{
+	GPtrArray *trash;
+
+	if (dh == NULL)
+		return;
+
+	trash = g_ptr_array_new();
+	pthread_mutex_lock(&datacache.lock);
+	dh->file->refs--;
+	dc_file_put(dh->file, trash);
+	pthread_mutex_unlock(&datacache.lock);
+	dc_empty_trash(trash);
+	g_free(dh);
+}
+
+/*
+ * Size of the file at open, or -1 if the file has been changed through
+ * this mount since then and the handle must not use the cache any more
+ */
+off_t datacache_file_size(const struct datacache_handle *dh)
+{
+	off_t size;
+
+	pthread_mutex_lock(&datacache.lock);
+	size = dh->gen == dh->file->gen ? dh->size : -1;
+	pthread_mutex_unlock(&datacache.lock);
+
+	return size;
+}
+
+/*
+ * Copy the cached data from offset on into buf.  Stops at the first
+ * block that is not cached and at the size of the file at open.
+ * Returns the number of bytes copied.
+ */
+int datacache_read(struct datacache_handle *dh, char *buf, size_t size,
+		   off_t offset)
+{
+	struct dc_file *f = dh->file;
+	off_t end = offset + size;
+	size_t total = 0;
+
+	if (end > dh->size)
+		end = dh->size;
+
+	while (offset + (off_t) total < end) {
+		static const struct timespec times[2] = {
+			{ 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+		off_t pos = offset + total;
+		uint64_t index = pos / DATACACHE_BLOCK_SIZE;
+		size_t skip = pos % DATACACHE_BLOCK_SIZE;
+		size_t len = dc_block_size(dh->size, index) - skip;
+		struct dc_block *b = NULL;
+		GPtrArray *trash;
+		ssize_t res = -1;
+		char *bpath;
+		int fd;
+
+		if (len > (size_t) (end - pos))
+			len = end - pos;
+
+		pthread_mutex_lock(&datacache.lock);
+		if (dh->gen == f->gen)
+			b = g_hash_table_lookup(f->blocks, &index);
+		if (b != NULL) {
+			dc_list_del(&b->lru);
+			dc_list_add(&b->lru, &datacache.lru);
+			datacache.hits++;
+		} else {
+			datacache.misses++;
+		}
+		pthread_mutex_unlock(&datacache.lock);
+		if (b == NULL)
+			break;
+
+		bpath = dc_block_path(f, dh->gen, index);
+		fd = open(bpath, O_RDONLY);
+		g_free(bpath);
+		if (fd != -1) {
+			res = pread(fd, buf + total, len, skip);
+			/* Keeps the order of use across mounts */
+			futimens(fd, times);
+			close(fd);
+		}
+		if (res != (ssize_t) len) {
+			/* Removed or damaged, fetch it again */
+			trash = g_ptr_array_new();
+			pthread_mutex_lock(&datacache.lock);
+			b = NULL;
+			if (dh->gen == f->gen)
+				b = g_hash_table_lookup(f->blocks, &index);
+			if (b != NULL)
+				dc_drop_block(b, trash);
+			pthread_mutex_unlock(&datacache.lock);
+			dc_empty_trash(trash);
+			break;
+		}
+		total += len;
+	}
+
+	return total;
+}
+
+/* Store the whole blocks in buf, which holds the data at offset */
+void datacache_fill(struct datacache_handle *dh, const char *buf,
+		    size_t size, off_t offset)
+{
+	struct dc_file *f = dh->file;
+	uint64_t index = (offset + DATACACHE_BLOCK_SIZE - 1) /
+		DATACACHE_BLOCK_SIZE;
+
+	for (;; index++) {
+		off_t start = (off_t) index * DATACACHE_BLOCK_SIZE;
+		size_t len = dc_block_size(dh->size, index);
+		struct dc_block *b;
+		GPtrArray *trash;
+		char *bpath;
+		char *tmp;
+		ssize_t res;
+		int has_info;
+		int skip;
+		int fd;
+
+		if (!len || start + (off_t) len > offset + (off_t) size)
+			break;
+
+		pthread_mutex_lock(&datacache.lock);
+		skip = dh->gen != f->gen ||
+			g_hash_table_lookup(f->blocks, &index) != NULL;
+		has_info = f->has_info;
+		pthread_mutex_unlock(&datacache.lock);
+		if (skip)
+			continue;
+		if (!has_info && dc_write_info(dh) == -1)
+			break;
+
+		tmp = g_strdup_printf("%s/%s/%u/%llu.XXXXXX", datacache.dir,
+				      f->name, dh->gen,
+				      (unsigned long long) index);
+		fd = mkstemp(tmp);
+		if (fd == -1) {
+			g_free(tmp);
+			break;
+		}
+		res = pwrite(fd, buf + (start - offset), len, 0);
+		close(fd);
+		if (res != (ssize_t) len) {
+			unlink(tmp);
+			g_free(tmp);
+			break;
+		}
+
+		/* Renamed under the lock, so that a reset can't miss it */
+		bpath = dc_block_path(f, dh->gen, index);
+		trash = g_ptr_array_new();
+		pthread_mutex_lock(&datacache.lock);
+		if (dh->gen == f->gen && f->has_info &&
+		    g_hash_table_lookup(f->blocks, &index) == NULL &&
+		    rename(tmp, bpath) == 0) {
+			b = g_new0(struct dc_block, 1);
+			b->file = f;
+			b->index = index;
+			b->size = len;
+			g_hash_table_insert(f->blocks, &b->index, b);
+			dc_list_add(&b->lru, &datacache.lru);
+			datacache.bytes += len;
+			dc_evict(trash);
+			g_free(tmp);
+		} else {
+			dc_trash(trash, tmp);
+			/* May have been made again after the reset */
+			if (dh->gen != f->gen)
+				dc_trash(trash, dc_gen_path(f->name, dh->gen));
+		}
+		pthread_mutex_unlock(&datacache.lock);
+		dc_empty_trash(trash);
+		g_free(bpath);
+	}
+}
+
+void datacache_invalidate(const char *path)
+{
+	GPtrArray *trash;
+	char name[17];
+	struct dc_file *f;
+	char *key;
+
+	if (!datacache.dir)
+		return;
+
+	key = dc_key(path);
+	dc_hash_name(key, name);
+	g_free(key);
+	trash = g_ptr_array_new();
+	pthread_mutex_lock(&datacache.lock);
+	f = g_hash_table_lookup(datacache.files, name);
+	if (f != NULL) {
+		dc_reset(f, trash);
+		dc_file_put(f, trash);
+	}
+	pthread_mutex_unlock(&datacache.lock);
+	dc_empty_trash(trash);
+}
+
+void datacache_get_stats(uint64_t *hits, uint64_t *misses,
+			 uint64_t *evictions)
+{
+	if (!datacache.dir) {
+		*hits = *misses = *evictions = 0;
+		return;
+	}
+	pthread_mutex_lock(&datacache.lock);
+	*hits = datacache.hits;
+	*misses = datacache.misses;
+	*evictions = datacache.evictions;
+	pthread_mutex_unlock(&datacache.lock);
+}
+
+static const struct fuse_opt datacache_opts[] = {
+	{ "data_cache=%s", offsetof(struct datacache, dir), 0 },
+	{ "data_cache_size=%u", offsetof(struct datacache, size_mb), 0 },
+	FUSE_OPT_END
+};
+
+int datacache_parse_options(struct fuse_args *args)
+{
+	datacache.size_mb = DEFAULT_DATACACHE_SIZE_MB;
+
+	return fuse_opt_parse(args, &datacache, datacache_opts, NULL);
+}
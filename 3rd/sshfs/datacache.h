@@ -0,0 +1,31 @@
+/*
+    Persistent data cache
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <fuse.h>
+#include <fuse_opt.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define DATACACHE_BLOCK_SIZE (64 * 1024)
+
+struct datacache_handle;
+
+int datacache_parse_options(struct fuse_args *args);
+int datacache_init(const char *remote);
+int datacache_enabled(void);
+struct datacache_handle *datacache_open(const char *path,
+					const struct stat *stbuf);
+void datacache_release(struct datacache_handle *dh);
+off_t datacache_file_size(const struct datacache_handle *dh);
+int datacache_read(struct datacache_handle *dh, char *buf, size_t size,
+		   off_t offset);
+void datacache_fill(struct datacache_handle *dh, const char *buf,
+		    size_t size, off_t offset);
+void datacache_invalidate(const char *path);
+void datacache_get_stats(uint64_t *hits, uint64_t *misses,
+			 uint64_t *evictions);
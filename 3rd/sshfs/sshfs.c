@@ -52,6 +52,7 @@
 #endif
 
 #include "cache.h"
+#include "datacache.h"
 
 #ifndef MAP_LOCKED
 #  define MAP_LOCKED 0
@@ -121,12 +122,17 @@
 #define SFTP_EXT_STATVFS "statvfs@openssh.com"
 #define SFTP_EXT_HARDLINK "hardlink@openssh.com"
 #define SFTP_EXT_FSYNC "fsync@openssh.com"
+#define SFTP_EXT_LIMITS "limits@openssh.com"
+#define SFTP_EXT_COPY_DATA "copy-data"
 
 #define PROTO_VERSION 3
 
 #define MY_EOF 1
 
-#define MAX_REPLY_LEN (1 << 17)
+#define MAX_REPLY_LEN (1 << 19)
+
+/* Upper bound of read and write sizes taken from the server limits */
+#define MAX_LIMITS_IO (1 << 18)
 
 #define RENAME_TEMP_CHARS 8
 
@@ -200,10 +206,23 @@
    This problem is again hard in general, but solvable since we only have to worry about
    the effects of pending write() calls. For rename() and link(), it does not matter if a
    pending write is executed before or after the operation. For readdir(), it is possible
-   that a pending write() will change the length of the file. However, SSHFS currently
-   does not return attribute information for readdir(), so this does not pose problems
-   either. Should SSHFS implement a readdirplus() handler (which provides file names and
-   attributes) this is a problem that will need to be solved.
+   that a pending write() will change the length of the file. SSHFS returns the attributes
+   from the server's directory listing to the kernel (readdirplus), except for entries
+   that are open on a connection other than the one that reads the directory, or that
+   have stripe writes in flight. The kernel then asks for those with getattr(), which is
+   sent on the right connection.
+
+   With -o stripe_size=N, a single open file additionally uses all connections: the file
+   is divided into stripes of N bytes, and stripe k is read and written through connection
+   (c + k) % max_conns, where c is the connection that the file is bound to in
+   sshfs.conntab. Each of these connections gets its own handle for the file, which is
+   opened together with the file, before any I/O can be issued on it; read-only files
+   that fit into the first stripe are not striped at all. Since a given byte range
+   always maps to the same connection for the whole life of the handle, SFTP ordering
+   still applies to overlapping reads and writes. The only requests that can observe
+   writes that are pending on other connections are those that look at or change the
+   file size (getattr and truncate). Therefore get_conn() waits until such writes have
+   completed before returning the connection of an open file.
 */
 
 
@@ -228,14 +247,33 @@ struct buffer {
 	size_t size;
 };
 
+struct list_head {
+	struct list_head *prev;
+	struct list_head *next;
+};
+
 struct dir_handle {
 	struct buffer buf;
 	struct conn *conn;
+	char *path;
+	struct list_head open_list;
 };
 
-struct list_head {
-	struct list_head *prev;
-	struct list_head *next;
+/* State of one readdir() call */
+struct readdir_ctx {
+	const char *path;
+	struct conn *conn;
+	void *dbuf;
+	fuse_fill_dir_t filler;
+	int plus;
+	/* Entries without complete attributes, returned last */
+	GPtrArray *pending;
+};
+
+struct readdir_pending {
+	char *name;
+	struct stat stbuf;
+	struct request *req;
 };
 
 struct request;
@@ -263,12 +301,24 @@ struct sshfs_io {
 	int error;
 };
 
+/* Part of a read reply that goes straight into a caller's buffer */
+struct read_dest {
+	char *buf;
+	size_t offset;
+	size_t size;
+};
+
+#define READ_MAX_DEST 4
+
 struct read_req {
 	struct sshfs_io *sio;
 	struct list_head list;
 	struct buffer data;
 	size_t size;
 	ssize_t res;
+	struct read_dest dest[READ_MAX_DEST];
+	int num_dest;
+	int receiving;
 };
 
 struct read_chunk {
@@ -278,6 +328,13 @@ struct read_chunk {
 	long modifver;
 	struct list_head reqs;
 	struct sshfs_io sio;
+	struct list_head list;
+};
+
+struct stripe {
+	struct buffer handle;
+	struct conn *conn;
+	int connver;
 };
 
 struct sshfs_file {
@@ -285,17 +342,36 @@ struct sshfs_file {
 	struct list_head write_reqs;
 	pthread_cond_t write_finished;
 	int write_error;
-	struct read_chunk *readahead;
+	struct list_head ra_chunks;
+	off_t ra_end;
+	size_t ra_window;
+	size_t ra_max_window;
+	uint64_t ra_hits;
+	uint64_t ra_misses;
 	off_t next_pos;
 	int is_seq;
 	struct conn *conn;
 	int connver;
-	int modifver;
+	uint32_t pflags;
+	struct conntab_entry *ce;
+	struct stripe *stripes;
+	struct datacache_handle *dc;
+	pthread_mutex_t wb_lock;
+	struct buffer wb;
+	off_t wb_offset;
+	struct timespec wb_time;
+	struct list_head wb_list;
+	int wb_refs;
+	char *path;
+	struct list_head open_list;
+	uint64_t wb_writes;
+	uint64_t wb_sends;
 };
 
 struct conntab_entry {
 	unsigned refcount;
 	struct conn *conn;
+	unsigned stripe_writes;
 };
 
 struct sshfs {
@@ -331,9 +407,18 @@ struct sshfs {
 	GHashTable *r_gid_map;
 	unsigned max_read;
 	unsigned max_write;
+	int auto_max_read;
+	int auto_max_write;
 	unsigned ssh_ver;
 	int sync_write;
 	int sync_read;
+	unsigned readahead_max;
+	unsigned write_delay;
+	struct list_head wb_dirty;
+	struct list_head open_files;
+	struct list_head open_dirs;
+	pthread_cond_t wb_cond;
+	int wb_thread_started;
 	int sync_readdir;
 	int direct_io;
 	int debug;
@@ -350,6 +435,8 @@ struct sshfs {
 	unsigned int randseed;
 	int max_conns;
 	struct conn *conns;
+	unsigned stripe_size;
+	pthread_cond_t stripe_cond;
 	int ptyfd;
 	int ptypassivefd;
 	int connvers;
@@ -371,6 +458,9 @@ struct sshfs {
 	int ext_statvfs;
 	int ext_hardlink;
 	int ext_fsync;
+	int ext_limits;
+	int ext_copy_data;
+	int limits_checked;
 	struct fuse_operations *op;
 
 	/* statistics */
@@ -382,6 +472,11 @@ struct sshfs {
 	unsigned int max_rtt;
 	uint64_t total_rtt;
 	unsigned int num_connect;
+	uint64_t ra_hits;
+	uint64_t ra_misses;
+	size_t ra_max_window;
+	uint64_t wb_writes;
+	uint64_t wb_sends;
 };
 
 static struct sshfs sshfs;
@@ -488,6 +583,8 @@ static struct fuse_opt sshfs_opts[] = {
 	SSHFS_OPT("nomap=error",       nomap, NOMAP_ERROR),
 	SSHFS_OPT("sshfs_sync",        sync_write, 1),
 	SSHFS_OPT("no_readahead",      sync_read, 1),
+	SSHFS_OPT("readahead_max=%u",  readahead_max, 0),
+	SSHFS_OPT("write_delay=%u",    write_delay, 0),
 	SSHFS_OPT("sync_readdir",      sync_readdir, 1),
 	SSHFS_OPT("sshfs_debug",       debug, 1),
 	SSHFS_OPT("sshfs_verbose",     verbose, 1),
@@ -504,6 +601,7 @@ static struct fuse_opt sshfs_opts[] = {
 	SSHFS_OPT("dir_cache=no",  dir_cache, 0),
 	SSHFS_OPT("direct_io",  direct_io, 1),
 	SSHFS_OPT("max_conns=%u",  max_conns, 1),
+	SSHFS_OPT("stripe_size=%u", stripe_size, 0),
 
 	SSHFS_OPT("-h",		show_help, 1),
 	SSHFS_OPT("--help",	show_help, 1),
@@ -956,8 +1054,44 @@ static int buf_get_statvfs(struct buffer *buf, struct statvfs *stbuf)
 	return 0;
 }
 
-static int buf_get_entries(struct buffer *buf, void *dbuf,
-                           fuse_fill_dir_t filler)
+#define ATTRS_COMPLETE (SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_UIDGID | \
+			SSH_FILEXFER_ATTR_PERMISSIONS | \
+			SSH_FILEXFER_ATTR_ACMODTIME)
+
+static char *readdir_entry_path(const struct readdir_ctx *ctx,
+				const char *name)
+{
+	return g_strdup_printf("%s/%s", ctx->path[1] ? ctx->path : "", name);
+}
+
+/*
+ * Can the attributes of an entry be returned to the kernel?  Not if
+ * writes to it may be pending on another connection, see the comment
+ * at the top of this file.
+ */
+static int readdir_plus_ok(const struct readdir_ctx *ctx, const char *name)
+{
+	struct conntab_entry *ce;
+	char *path;
+	int ok;
+
+	if (!ctx->plus)
+		return 0;
+	if (sshfs.max_conns == 1)
+		return 1;
+	if (ctx->path == NULL)
+		return 0;
+
+	path = readdir_entry_path(ctx, name);
+	pthread_mutex_lock(&sshfs.lock);
+	ce = g_hash_table_lookup(sshfs.conntab, path);
+	ok = ce == NULL || (ce->conn == ctx->conn && !ce->stripe_writes);
+	pthread_mutex_unlock(&sshfs.lock);
+	g_free(path);
+	return ok;
+}
+
+static int buf_get_entries(struct buffer *buf, struct readdir_ctx *ctx)
 {
 	uint32_t count;
 	unsigned i;
@@ -967,6 +1101,7 @@ static int buf_get_entries(struct buffer *buf, void *dbuf,
 
 	for (i = 0; i < count; i++) {
 		int err = -1;
+		int flags;
 		char *name;
 		char *longname;
 		struct stat stbuf;
@@ -974,13 +1109,26 @@ static int buf_get_entries(struct buffer *buf, void *dbuf,
 			return -EIO;
 		if (buf_get_string(buf, &longname) != -1) {
 			free(longname);
-			err = buf_get_attrs(buf, &stbuf, NULL);
+			err = buf_get_attrs(buf, &stbuf, &flags);
 			if (!err) {
 				if (sshfs.follow_symlinks &&
 				    S_ISLNK(stbuf.st_mode)) {
 					stbuf.st_mode = 0;
 				}
-				filler(dbuf, name, &stbuf, 0, 0);
+				if ((flags & ATTRS_COMPLETE) != ATTRS_COMPLETE ||
+				    !stbuf.st_mode) {
+					struct readdir_pending *rp;
+
+					rp = g_new0(struct readdir_pending, 1);
+					rp->name = name;
+					rp->stbuf = stbuf;
+					g_ptr_array_add(ctx->pending, rp);
+					name = NULL;
+				} else {
+					ctx->filler(ctx->dbuf, name, &stbuf, 0,
+						    readdir_plus_ok(ctx, name) ?
+						    FUSE_FILL_DIR_PLUS : 0);
+				}
 			}
 		}
 		free(name);
@@ -1065,6 +1213,13 @@ static int pty_expect_loop(struct conn *conn)
 	return 0;
 }
 
+/* Must be called with sshfs.lock held */
+static void wait_stripe_writes(struct conntab_entry *ce)
+{
+	while (ce->stripe_writes)
+		pthread_cond_wait(&sshfs.stripe_cond, &sshfs.lock);
+}
+
 static struct conn* get_conn(const struct sshfs_file *sf,
 			     const char *path)
 {
@@ -1074,8 +1229,14 @@ static struct conn* get_conn(const struct sshfs_file *sf,
 	if (sshfs.max_conns == 1)
 		return &sshfs.conns[0];
 
-	if (sf != NULL)
+	if (sf != NULL) {
+		if (sf->stripes) {
+			pthread_mutex_lock(&sshfs.lock);
+			wait_stripe_writes(sf->ce);
+			pthread_mutex_unlock(&sshfs.lock);
+		}
 		return sf->conn;
+	}
 
 	if (path != NULL) {
 		pthread_mutex_lock(&sshfs.lock);
@@ -1083,6 +1244,7 @@ static struct conn* get_conn(const struct sshfs_file *sf,
 
 		if (ce != NULL) {
 			struct conn *conn = ce->conn;
+			wait_stripe_writes(ce);
 			pthread_mutex_unlock(&sshfs.lock);
 			return conn;
 		}
@@ -1356,13 +1518,12 @@ static int sftp_send_iov(struct conn *conn, uint8_t type, uint32_t id,
 	return res;
 }
 
-static int do_read(struct conn *conn, struct buffer *buf)
+static int do_readv(struct conn *conn, struct iovec *iov, int count)
 {
-	int res;
-	uint8_t *p = buf->p;
-	size_t size = buf->size;
-	while (size) {
-		res = read(conn->rfd, p, size);
+	ssize_t res;
+
+	while (count) {
+		res = readv(conn->rfd, iov, count);
 		if (res == -1) {
 			perror("read");
 			return -1;
@@ -1370,12 +1531,30 @@ static int do_read(struct conn *conn, struct buffer *buf)
 			fprintf(stderr, "remote host has disconnected\n");
 			return -1;
 		}
-		size -= res;
-		p += res;
+		while (count && (size_t) res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base = (char *) iov->iov_base + res;
+			iov->iov_len -= res;
+		}
 	}
 	return 0;
 }
 
+static int do_read(struct conn *conn, struct buffer *buf)
+{
+	struct iovec iov;
+
+	if (!buf->size)
+		return 0;
+	iov.iov_base = buf->p;
+	iov.iov_len = buf->size;
+	return do_readv(conn, &iov, 1);
+}
+
 static int sftp_read(struct conn *conn, uint8_t *type, struct buffer *buf)
 {
 	int res;
@@ -1457,24 +1636,129 @@ static int clean_req(void *key, struct request *req, gpointer user_data)
 	return TRUE;
 }
 
+static void sshfs_read_end(struct request *req);
+
+/*
+ * Read the payload of an SSH_FXP_DATA reply to a read request.  The
+ * parts that callers registered before the reply arrived are read
+ * straight into their buffers, anything else into rreq->data at the
+ * same offset.  Called without sshfs.lock, after rreq->receiving was
+ * set, so that the destinations can't change meanwhile.
+ */
+static int sftp_read_data(struct conn *conn, struct read_req *rreq,
+			  uint32_t len)
+{
+	struct iovec iov[2 * READ_MAX_DEST + 1];
+	struct buffer buf;
+	uint32_t size;
+	size_t pos = 0;
+	int count = 0;
+	int i;
+
+	if (len < 4)
+		return -1;
+	buf_init(&buf, 4);
+	if (do_read(conn, &buf) == -1 || buf_get_uint32(&buf, &size) == -1) {
+		buf_free(&buf);
+		return -1;
+	}
+	buf_free(&buf);
+	if (size != len - 4) {
+		fprintf(stderr, "protocol error\n");
+		return -1;
+	}
+	if (size > rreq->size) {
+		fprintf(stderr, "long read\n");
+		rreq->res = -EIO;
+		buf_init(&rreq->data, size);
+		return do_read(conn, &rreq->data);
+	}
+
+	for (i = 0; i <= rreq->num_dest && pos < size; i++) {
+		size_t start = size;
+		size_t end = size;
+
+		if (i < rreq->num_dest) {
+			start = rreq->dest[i].offset;
+			end = start + rreq->dest[i].size;
+			if (start > size)
+				start = size;
+			if (end > size)
+				end = size;
+		}
+		if (pos < start) {
+			if (!rreq->data.p)
+				buf_init(&rreq->data, rreq->size);
+			iov[count].iov_base = rreq->data.p + pos;
+			iov[count].iov_len = start - pos;
+			count++;
+		}
+		if (start < end) {
+			iov[count].iov_base = rreq->dest[i].buf;
+			iov[count].iov_len = end - start;
+			count++;
+		}
+		pos = end;
+	}
+	rreq->res = size;
+
+	return do_readv(conn, iov, count);
+}
+
 static int process_one_request(struct conn *conn)
 {
 	int res;
 	struct buffer buf;
 	uint8_t type;
 	struct request *req;
+	struct read_req *rreq = NULL;
+	uint32_t len;
 	uint32_t id;
 
-	buf_init(&buf, 0);
-	res = sftp_read(conn, &type, &buf);
+	buf_init(&buf, 9);
+	res = do_read(conn, &buf);
+	if (res != -1 &&
+	    (buf_get_uint32(&buf, &len) == -1 ||
+	     buf_get_uint8(&buf, &type) == -1 ||
+	     buf_get_uint32(&buf, &id) == -1))
+		res = -1;
+	buf_free(&buf);
 	if (res == -1)
 		return -1;
-	if (buf_get_uint32(&buf, &id) == -1)
+	if (len > MAX_REPLY_LEN) {
+		fprintf(stderr, "reply len too large: %u\n", len);
+		return -1;
+	}
+	if (len < 5)
 		return -1;
 
+	/*
+	 * The request stays in the table until the reply is complete, so
+	 * that it fails with the connection if reading the rest fails
+	 */
 	pthread_mutex_lock(&sshfs.lock);
 	req = (struct request *)
 		g_hash_table_lookup(sshfs.reqtab, GUINT_TO_POINTER(id));
+	if (req != NULL && type == SSH_FXP_DATA &&
+	    req->end_func == sshfs_read_end) {
+		rreq = (struct read_req *) req->data;
+		rreq->receiving = 1;
+	}
+	pthread_mutex_unlock(&sshfs.lock);
+
+	if (rreq != NULL) {
+		buf_init(&buf, 0);
+		res = sftp_read_data(conn, rreq, len - 5);
+	} else {
+		buf_init(&buf, len - 5);
+		res = do_read(conn, &buf);
+	}
+	if (res == -1) {
+		buf_free(&buf);
+		return -1;
+	}
+
+	pthread_mutex_lock(&sshfs.lock);
 	if (req == NULL)
 		fprintf(stderr, "request %i not found\n", id);
 	else {
@@ -1493,7 +1777,7 @@ static int process_one_request(struct conn *conn)
 		if (sshfs.debug) {
 			struct timeval now;
 			unsigned int difftime;
-			unsigned msgsize = buf.size + 5;
+			unsigned msgsize = len + 4;
 
 			gettimeofday(&now, NULL);
 			difftime = (now.tv_sec - req->start.tv_sec) * 1000;
@@ -1628,6 +1912,12 @@ static int sftp_init_reply_ok(struct conn *conn, struct buffer *buf,
 			if (strcmp(ext, SFTP_EXT_FSYNC) == 0 &&
 			    strcmp(extdata, "1") == 0)
 				sshfs.ext_fsync = 1;
+			if (strcmp(ext, SFTP_EXT_LIMITS) == 0 &&
+			    strcmp(extdata, "1") == 0)
+				sshfs.ext_limits = 1;
+			if (strcmp(ext, SFTP_EXT_COPY_DATA) == 0 &&
+			    strcmp(extdata, "1") == 0)
+				sshfs.ext_copy_data = 1;
 
 			free(ext);
 			free(extdata);
@@ -1663,6 +1953,81 @@ static int sftp_find_init_reply(struct conn *conn, uint32_t *version)
 	return res;
 }
 
+static unsigned limit_io_size(unsigned size, int auto_size, uint64_t limit)
+{
+	if (!limit)
+		return size;
+	if (auto_size)
+		return limit < MAX_LIMITS_IO ? limit : MAX_LIMITS_IO;
+	return limit < size ? limit : size;
+}
+
+/*
+ * Ask the server for the largest read and write it accepts.  Sizes that
+ * were not given on the command line are raised to these, explicit ones
+ * are only lowered.  A zero limit means that the server has none.
+ */
+static int sftp_get_limits(struct conn *conn)
+{
+	int res = -1;
+	uint32_t id = sftp_get_id();
+	uint32_t replid;
+	uint8_t type;
+	uint64_t max_packet;
+	uint64_t max_read;
+	uint64_t max_write;
+	struct buffer buf;
+	struct iovec iov[1];
+
+	buf_init(&buf, 0);
+	buf_add_string(&buf, SFTP_EXT_LIMITS);
+	buf_to_iov(&buf, &iov[0]);
+	if (sftp_send_iov(conn, SSH_FXP_EXTENDED, id, iov, 1) == -1)
+		goto out;
+	buf_clear(&buf);
+	if (sftp_read(conn, &type, &buf) == -1)
+		goto out;
+	if (type != SSH_FXP_EXTENDED_REPLY && type != SSH_FXP_STATUS) {
+		fprintf(stderr, "protocol error\n");
+		goto out;
+	}
+	if (buf_get_uint32(&buf, &replid) == -1)
+		goto out;
+	if (replid != id) {
+		fprintf(stderr, "bad reply ID\n");
+		goto out;
+	}
+	res = 0;
+	sshfs.limits_checked = 1;
+	if (type == SSH_FXP_STATUS ||
+	    buf_get_uint64(&buf, &max_packet) == -1 ||
+	    buf_get_uint64(&buf, &max_read) == -1 ||
+	    buf_get_uint64(&buf, &max_write) == -1) {
+		fprintf(stderr, "failed to get server limits\n");
+		goto out;
+	}
+
+	/* Leave room for the header of the packet */
+	if (max_packet > 1024) {
+		if (!max_read || max_read > max_packet - 1024)
+			max_read = max_packet - 1024;
+		if (!max_write || max_write > max_packet - 1024)
+			max_write = max_packet - 1024;
+	}
+	sshfs.max_read = limit_io_size(sshfs.max_read, sshfs.auto_max_read,
+				       max_read);
+	sshfs.max_write = limit_io_size(sshfs.max_write, sshfs.auto_max_write,
+					max_write);
+	DEBUG("Server limits: packet %llu, read %llu, write %llu; "
+	      "using read %u, write %u\n", (unsigned long long) max_packet,
+	      (unsigned long long) max_read, (unsigned long long) max_write,
+	      sshfs.max_read, sshfs.max_write);
+
+out:
+	buf_free(&buf);
+	return res;
+}
+
 static int sftp_init(struct conn *conn)
 {
 	int res = -1;
@@ -1684,6 +2049,9 @@ static int sftp_init(struct conn *conn)
 			"Warning: server uses version: %i, we support: %i\n",
 			version, PROTO_VERSION);
 	}
+	if (sshfs.ext_limits && !sshfs.limits_checked &&
+	    sftp_get_limits(conn) == -1)
+		goto out;
 	res = 0;
 
 out:
@@ -1887,9 +2255,7 @@ static int start_processing_thread(struct conn *conn)
 static void *sshfs_init(struct fuse_conn_info *conn,
                         struct fuse_config *cfg)
 {
-	/* Readahead should be done by kernel or sshfs but not both */
-	if (conn->capable & FUSE_CAP_ASYNC_READ)
-		sshfs.sync_read = 1;
+	(void) conn;
 
 	// These workarounds require the "path" argument.
 	cfg->nullpath_ok = !(sshfs.truncate_workaround || sshfs.fstat_workaround);
@@ -1898,6 +2264,14 @@ static void *sshfs_init(struct fuse_conn_info *conn,
 	if (sshfs.max_conns > 1)
 		cfg->nullpath_ok = 0;
 
+	// The data cache is keyed by path
+	if (datacache_enabled())
+		cfg->nullpath_ok = 0;
+
+	// A directory handle cannot be rewound, so readdir() must not be
+	// restarted for each window of entries
+	cfg->readdir_window = 0;
+
 	// Lookup of . and .. is supported
 	conn->capable |= FUSE_CAP_EXPORT_SUPPORT;
 
@@ -1987,11 +2361,11 @@ static int sftp_request_send(struct conn *conn, uint8_t type, struct iovec *iov,
 	sem_init(&req->ready, 0, 0);
 	buf_init(&req->reply, 0);
 	pthread_mutex_lock(&sshfs.lock);
+	req->conn = conn;
 	if (begin_func)
 		begin_func(req);
 	id = sftp_get_id();
 	req->id = id;
-	req->conn = conn;
 	req->conn->req_count++;
 	err = start_processing_thread(conn);
 	if (err) {
@@ -2189,6 +2563,9 @@ static int sftp_readdir_send(struct conn *conn, struct request **req,
 				 SSH_FXP_NAME, NULL, req);
 }
 
+static void wb_flush_path(struct sshfs_file *sf, const char *path);
+static void wb_flush_dir(const char *path);
+
 static int sshfs_req_pending(struct request *req)
 {
 	if (g_hash_table_lookup(sshfs.reqtab, GUINT_TO_POINTER(req->id)))
@@ -2198,7 +2575,7 @@ static int sshfs_req_pending(struct request *req)
 }
 
 static int sftp_readdir_async(struct conn *conn, struct buffer *handle,
-			      void *buf, off_t offset, fuse_fill_dir_t filler)
+			      struct readdir_ctx *ctx, off_t offset)
 {
 	int err = 0;
 	int outstanding = 0;
@@ -2258,7 +2635,7 @@ static int sftp_readdir_async(struct conn *conn, struct buffer *handle,
 				done = 1;
 			}
 			if (!done) {
-				err = buf_get_entries(&name, buf, filler);
+				err = buf_get_entries(&name, ctx);
 				buf_free(&name);
 
 				/* increase number of outstanding requests */
@@ -2276,7 +2653,7 @@ static int sftp_readdir_async(struct conn *conn, struct buffer *handle,
 }
 
 static int sftp_readdir_sync(struct conn *conn, struct buffer *handle,
-			     void *buf, off_t offset, fuse_fill_dir_t filler)
+			     struct readdir_ctx *ctx, off_t offset)
 {
 	int err;
 	assert(offset == 0);
@@ -2284,7 +2661,7 @@ static int sftp_readdir_sync(struct conn *conn, struct buffer *handle,
 		struct buffer name;
 		err = sftp_request(conn, SSH_FXP_READDIR, handle, SSH_FXP_NAME, &name);
 		if (!err) {
-			err = buf_get_entries(&name, buf, filler);
+			err = buf_get_entries(&name, ctx);
 			buf_free(&name);
 		}
 	} while (!err);
@@ -2315,6 +2692,8 @@ static int sshfs_opendir(const char *path, struct fuse_file_info *fi)
 		pthread_mutex_lock(&sshfs.lock);
 		handle->conn = conn;
 		handle->conn->dir_count++;
+		handle->path = g_strdup(path);
+		list_add(&handle->open_list, &sshfs.open_dirs);
 		pthread_mutex_unlock(&sshfs.lock);
 		fi->fh = (unsigned long) handle;
 	} else
@@ -2323,22 +2702,103 @@ static int sshfs_opendir(const char *path, struct fuse_file_info *fi)
 	return err;
 }
 
+/*
+ * Returns the entries whose attributes were incomplete in the listing.
+ * For readdirplus their attributes are requested all at once, instead
+ * of leaving the kernel to look them up one round trip at a time.
+ */
+static void sshfs_readdir_pending(struct readdir_ctx *ctx)
+{
+	uint8_t type = sshfs.follow_symlinks ? SSH_FXP_STAT : SSH_FXP_LSTAT;
+	unsigned i;
+
+	for (i = 0; i < ctx->pending->len; i++) {
+		struct readdir_pending *rp = g_ptr_array_index(ctx->pending, i);
+		struct buffer buf;
+		struct iovec iov;
+		char *path;
+
+		if (ctx->path == NULL || !readdir_plus_ok(ctx, rp->name))
+			continue;
+
+		path = readdir_entry_path(ctx, rp->name);
+		buf_init(&buf, 0);
+		buf_add_path(&buf, path);
+		buf_to_iov(&buf, &iov);
+		sftp_request_send(ctx->conn, type, &iov, 1, NULL, NULL,
+				  SSH_FXP_ATTRS, NULL, &rp->req);
+		buf_free(&buf);
+		g_free(path);
+	}
+
+	for (i = 0; i < ctx->pending->len; i++) {
+		struct readdir_pending *rp = g_ptr_array_index(ctx->pending, i);
+		enum fuse_fill_dir_flags flags = 0;
+
+		if (rp->req != NULL) {
+			struct buffer outbuf;
+			struct stat stbuf;
+
+			if (!sftp_request_wait(rp->req, type, SSH_FXP_ATTRS,
+					       &outbuf)) {
+				if (!buf_get_attrs(&outbuf, &stbuf, NULL)) {
+					rp->stbuf = stbuf;
+					flags = FUSE_FILL_DIR_PLUS;
+				}
+				buf_free(&outbuf);
+			}
+		}
+		ctx->filler(ctx->dbuf, rp->name, &rp->stbuf, 0, flags);
+	}
+}
+
 static int sshfs_readdir(const char *path, void *dbuf, fuse_fill_dir_t filler,
 			 off_t offset, struct fuse_file_info *fi,
 			 enum fuse_readdir_flags flags)
 {
-	(void) path; (void) flags;
 	int err;
+	unsigned i;
 	struct dir_handle *handle;
+	struct readdir_ctx ctx = {
+		.path = path,
+		.dbuf = dbuf,
+		.filler = filler,
+		.plus = !!(flags & FUSE_READDIR_PLUS),
+	};
 
 	handle = (struct dir_handle*) fi->fh;
+	ctx.conn = handle->conn;
+	ctx.pending = g_ptr_array_new();
+
+	/* Sizes in the listing should include buffered writes.  Without
+	   a path (nullpath_ok), use the one the directory has now */
+	if (ctx.plus && path) {
+		wb_flush_dir(path);
+	} else if (ctx.plus) {
+		char *dpath;
+
+		pthread_mutex_lock(&sshfs.lock);
+		dpath = g_strdup(handle->path);
+		pthread_mutex_unlock(&sshfs.lock);
+		wb_flush_dir(dpath);
+		g_free(dpath);
+	}
 
 	if (sshfs.sync_readdir)
-		err = sftp_readdir_sync(handle->conn, &handle->buf, dbuf,
-					offset, filler);
+		err = sftp_readdir_sync(handle->conn, &handle->buf, &ctx,
+					offset);
 	else
-		err = sftp_readdir_async(handle->conn, &handle->buf, dbuf,
-					 offset, filler);
+		err = sftp_readdir_async(handle->conn, &handle->buf, &ctx,
+					 offset);
+	if (!err)
+		sshfs_readdir_pending(&ctx);
+
+	for (i = 0; i < ctx.pending->len; i++) {
+		struct readdir_pending *rp = g_ptr_array_index(ctx.pending, i);
+		free(rp->name);
+		g_free(rp);
+	}
+	g_ptr_array_free(ctx.pending, TRUE);
 
 	return err;
 }
@@ -2353,8 +2813,10 @@ static int sshfs_releasedir(const char *path, struct fuse_file_info *fi)
 	err = sftp_request(handle->conn, SSH_FXP_CLOSE, &handle->buf, 0, NULL);
 	pthread_mutex_lock(&sshfs.lock);
 	handle->conn->dir_count--;
+	list_del(&handle->open_list);
 	pthread_mutex_unlock(&sshfs.lock);
 	buf_free(&handle->buf);
+	g_free(handle->path);
 	g_free(handle);
 	return err;
 }
@@ -2441,6 +2903,8 @@ static int sshfs_unlink(const char *path)
 	// Commutes with pending write(), so we can use any connection
 	err = sftp_request(get_conn(NULL, NULL), SSH_FXP_REMOVE, &buf, SSH_FXP_STATUS, NULL);
 	buf_free(&buf);
+	if (!err)
+		datacache_invalidate(path);
 	return err;
 }
 
@@ -2491,6 +2955,44 @@ static void random_string(char *str, int length)
 	*str = '\0';
 }
 
+static void rename_path(char **pathp, const char *from, size_t len,
+			const char *to)
+{
+	char *path = *pathp;
+
+	if (strncmp(path, from, len) != 0 ||
+	    (path[len] != '\0' && path[len] != '/'))
+		return;
+	*pathp = g_strdup_printf("%s%s", to, path + len);
+	g_free(path);
+}
+
+/*
+ * Follow a rename in the paths of the open files and directories,
+ * including those below a renamed directory.  Must be called with
+ * sshfs.lock held
+ */
+static void rename_open_files(const char *from, const char *to)
+{
+	size_t len = strlen(from);
+	struct list_head *curr;
+
+	for (curr = sshfs.open_files.next; curr != &sshfs.open_files;
+	     curr = curr->next) {
+		struct sshfs_file *sf =
+			list_entry(curr, struct sshfs_file, open_list);
+
+		rename_path(&sf->path, from, len, to);
+	}
+	for (curr = sshfs.open_dirs.next; curr != &sshfs.open_dirs;
+	     curr = curr->next) {
+		struct dir_handle *handle =
+			list_entry(curr, struct dir_handle, open_list);
+
+		rename_path(&handle->path, from, len, to);
+	}
+}
+
 static int sshfs_rename(const char *from, const char *to, unsigned int flags)
 {
 	int err;
@@ -2523,6 +3025,17 @@ static int sshfs_rename(const char *from, const char *to, unsigned int flags)
 	if (err == -EPERM && sshfs.renamexdev_workaround)
 		err = -EXDEV;
 
+	if (!err) {
+		datacache_invalidate(from);
+		datacache_invalidate(to);
+	}
+
+	if (!err) {
+		pthread_mutex_lock(&sshfs.lock);
+		rename_open_files(from, to);
+		pthread_mutex_unlock(&sshfs.lock);
+	}
+
 	if (!err && sshfs.max_conns > 1) {
 		pthread_mutex_lock(&sshfs.lock);
 		ce = g_hash_table_lookup(sshfs.conntab, from);
@@ -2559,9 +3072,15 @@ static int sshfs_link(const char *from, const char *to)
 static inline int sshfs_file_is_conn(struct sshfs_file *sf)
 {
 	int ret;
+	int i;
 
 	pthread_mutex_lock(&sshfs.lock);
 	ret = (sf->connver == sf->conn->connver);
+	for (i = 1; ret && sf->stripes && i < sshfs.max_conns; i++) {
+		struct stripe *st = &sf->stripes[i];
+		if (st->conn && st->connver != st->conn->connver)
+			ret = 0;
+	}
 	pthread_mutex_unlock(&sshfs.lock);
 
 	return ret;
@@ -2652,6 +3171,7 @@ static int sshfs_chown(const char *path, uid_t uid, gid_t gid,
 
 static int sshfs_truncate_workaround(const char *path, off_t size,
                                      struct fuse_file_info *fi);
+static int wb_send(struct sshfs_file *sf);
 
 static void sshfs_inc_modifver(void)
 {
@@ -2682,6 +3202,7 @@ static int sshfs_utimens(const char *path, const struct timespec tv[2],
 			return -EIO;
 	}
 
+	wb_flush_path(sf, path);
 	buf_init(&buf, 0);
 	if (sf == NULL)
 		buf_add_path(&buf, path);
@@ -2698,6 +3219,8 @@ static int sshfs_utimens(const char *path, const struct timespec tv[2],
 	return err;
 }
 
+static void sshfs_open_stripes(struct sshfs_file *sf, const char *path);
+
 static int sshfs_open_common(const char *path, mode_t mode,
                              struct fuse_file_info *fi)
 {
@@ -2735,8 +3258,10 @@ static int sshfs_open_common(const char *path, mode_t mode,
 	if (fi->flags & O_EXCL)
 		pflags |= SSH_FXF_EXCL;
 
-	if (fi->flags & O_TRUNC)
+	if (fi->flags & O_TRUNC) {
 		pflags |= SSH_FXF_TRUNC;
+		wb_flush_path(NULL, path);
+	}
 
 	if (fi->flags & O_APPEND)
 		pflags |= SSH_FXF_APPEND;
@@ -2744,20 +3269,29 @@ static int sshfs_open_common(const char *path, mode_t mode,
 	sf = g_new0(struct sshfs_file, 1);
 	list_init(&sf->write_reqs);
 	pthread_cond_init(&sf->write_finished, NULL);
+	pthread_mutex_init(&sf->wb_lock, NULL);
+	list_init(&sf->wb_list);
+	list_init(&sf->ra_chunks);
 	/* Assume random read after open */
 	sf->is_seq = 0;
 	sf->next_pos = 0;
+	sf->pflags = pflags;
+	/* Appending writes ignore the offset, so they can't be striped */
+	if (sshfs.stripe_size && sshfs.max_conns > 1 &&
+	    !(pflags & SSH_FXF_APPEND))
+		sf->stripes = g_new0(struct stripe, sshfs.max_conns);
 	pthread_mutex_lock(&sshfs.lock);
-	sf->modifver= sshfs.modifver;
 	if (sshfs.max_conns > 1) {
 		ce = g_hash_table_lookup(sshfs.conntab, path);
 		if (!ce) {
 			ce = g_malloc(sizeof(struct conntab_entry));
 			ce->refcount = 0;
+			ce->stripe_writes = 0;
 			ce->conn = get_conn(NULL, NULL);
 			g_hash_table_insert(sshfs.conntab, g_strdup(path), ce);
 		}
 		sf->conn = ce->conn;
+		sf->ce = ce;
 		ce->refcount++;
 		sf->conn->file_count++;
 		assert(sf->conn->file_count > 0);
@@ -2795,7 +3329,22 @@ static int sshfs_open_common(const char *path, mode_t mode,
 	if (!err) {
 		if (sshfs.dir_cache)
 			cache_add_attr(path, &stbuf, wrctr);
+		if (pflags == SSH_FXF_READ)
+			sf->dc = datacache_open(path, &stbuf);
+		else
+			datacache_invalidate(path);
 		buf_finish(&sf->handle);
+		pthread_mutex_lock(&sshfs.lock);
+		sf->path = g_strdup(path);
+		list_add(&sf->open_list, &sshfs.open_files);
+		pthread_mutex_unlock(&sshfs.lock);
+		if (sf->stripes && pflags == SSH_FXF_READ &&
+		    stbuf.st_size <= sshfs.stripe_size) {
+			g_free(sf->stripes);
+			sf->stripes = NULL;
+		}
+		if (sf->stripes)
+			sshfs_open_stripes(sf, path);
 		fi->fh = (unsigned long) sf;
 	} else {
 		if (sshfs.dir_cache)
@@ -2810,42 +3359,151 @@ static int sshfs_open_common(const char *path, mode_t mode,
 			}
 			pthread_mutex_unlock(&sshfs.lock);
 		}
+		pthread_mutex_destroy(&sf->wb_lock);
+		g_free(sf->stripes);
 		g_free(sf);
 	}
 	buf_free(&buf);
 	return err;
 }
 
-static int sshfs_open(const char *path, struct fuse_file_info *fi)
+static struct conn *stripe_conn(struct sshfs_file *sf, off_t offset,
+				struct buffer **handlep)
 {
-	return sshfs_open_common(path, 0, fi);
+	struct stripe *st;
+	int i;
+
+	*handlep = &sf->handle;
+	if (!sf->stripes)
+		return sf->conn;
+
+	i = (offset / sshfs.stripe_size) % sshfs.max_conns;
+	st = &sf->stripes[i];
+	if (i == 0 || !st->conn)
+		return sf->conn;
+
+	*handlep = &st->handle;
+	return st->conn;
 }
 
-static int sshfs_flush(const char *path, struct fuse_file_info *fi)
+/* Returns how many bytes from offset on are in the same stripe */
+static size_t stripe_limit(struct sshfs_file *sf, off_t offset, size_t size)
 {
-	int err;
-	struct sshfs_file *sf = get_sshfs_file(fi);
-	struct list_head write_reqs;
-	struct list_head *curr_list;
+	size_t left;
 
-	if (!sshfs_file_is_conn(sf))
-		return -EIO;
+	if (!sf->stripes)
+		return size;
 
-	if (sshfs.sync_write)
-		return 0;
+	left = sshfs.stripe_size - offset % sshfs.stripe_size;
+	return size < left ? size : left;
+}
 
-	(void) path;
-	pthread_mutex_lock(&sshfs.lock);
-	if (!list_empty(&sf->write_reqs)) {
-		curr_list = sf->write_reqs.prev;
-		list_del(&sf->write_reqs);
-		list_init(&sf->write_reqs);
-		list_add(&write_reqs, curr_list);
-		while (!list_empty(&write_reqs))
-			pthread_cond_wait(&sf->write_finished, &sshfs.lock);
-	}
-	err = sf->write_error;
-	sf->write_error = 0;
+/*
+ * Open the file on every other connection, so that the stripes past the
+ * first one can be transferred in parallel.  Failing to open a stripe
+ * is not fatal, its byte ranges stay on the file's own connection.
+ * Called before the file is handed to the kernel, so stripe_conn() can
+ * read the stripes without locking.
+ */
+static void sshfs_open_stripes(struct sshfs_file *sf, const char *path)
+{
+	struct request **reqs;
+	struct conn *conn;
+	struct buffer buf;
+	struct iovec iov;
+	uint32_t pflags;
+	int base = sf->conn - sshfs.conns;
+	int i, err;
+
+	/* The file already exists and has been truncated if requested */
+	pflags = sf->pflags & ~(SSH_FXF_CREAT | SSH_FXF_EXCL | SSH_FXF_TRUNC);
+	buf_init(&buf, 0);
+	buf_add_path(&buf, path);
+	buf_add_uint32(&buf, pflags);
+	buf_add_uint32(&buf, 0);
+	buf_to_iov(&buf, &iov);
+	reqs = g_new(struct request *, sshfs.max_conns);
+	for (i = 1; i < sshfs.max_conns; i++) {
+		conn = &sshfs.conns[(base + i) % sshfs.max_conns];
+		sftp_request_send(conn, SSH_FXP_OPEN, &iov, 1, NULL, NULL,
+				  1, NULL, &reqs[i]);
+	}
+	buf_free(&buf);
+
+	for (i = 1; i < sshfs.max_conns; i++) {
+		struct stripe *st = &sf->stripes[i];
+
+		conn = &sshfs.conns[(base + i) % sshfs.max_conns];
+		err = sftp_request_wait(reqs[i], SSH_FXP_OPEN, SSH_FXP_HANDLE,
+					&st->handle);
+		if (err) {
+			DEBUG("failed to open stripe %i of %s: %s\n", i, path,
+			      strerror(-err));
+			continue;
+		}
+		buf_finish(&st->handle);
+		pthread_mutex_lock(&sshfs.lock);
+		st->conn = conn;
+		st->connver = conn->connver;
+		conn->file_count++;
+		pthread_mutex_unlock(&sshfs.lock);
+	}
+	g_free(reqs);
+}
+
+static void sshfs_close_stripes(struct sshfs_file *sf, int is_conn)
+{
+	int i;
+
+	for (i = 1; sf->stripes && i < sshfs.max_conns; i++) {
+		struct stripe *st = &sf->stripes[i];
+
+		if (!st->conn)
+			continue;
+		if (is_conn)
+			sftp_request(st->conn, SSH_FXP_CLOSE, &st->handle, 0,
+				     NULL);
+		buf_free(&st->handle);
+		pthread_mutex_lock(&sshfs.lock);
+		st->conn->file_count--;
+		pthread_mutex_unlock(&sshfs.lock);
+	}
+	g_free(sf->stripes);
+}
+
+static int sshfs_open(const char *path, struct fuse_file_info *fi)
+{
+	return sshfs_open_common(path, 0, fi);
+}
+
+static int sshfs_flush(const char *path, struct fuse_file_info *fi)
+{
+	int err;
+	struct sshfs_file *sf = get_sshfs_file(fi);
+	struct list_head write_reqs;
+	struct list_head *curr_list;
+
+	if (!sshfs_file_is_conn(sf))
+		return -EIO;
+
+	if (sshfs.sync_write)
+		return 0;
+
+	(void) path;
+	pthread_mutex_lock(&sf->wb_lock);
+	wb_send(sf);
+	pthread_mutex_unlock(&sf->wb_lock);
+	pthread_mutex_lock(&sshfs.lock);
+	if (!list_empty(&sf->write_reqs)) {
+		curr_list = sf->write_reqs.prev;
+		list_del(&sf->write_reqs);
+		list_init(&sf->write_reqs);
+		list_add(&write_reqs, curr_list);
+		while (!list_empty(&write_reqs))
+			pthread_cond_wait(&sf->write_finished, &sshfs.lock);
+	}
+	err = sf->write_error;
+	sf->write_error = 0;
 	pthread_mutex_unlock(&sshfs.lock);
 	return err;
 }
@@ -2873,17 +3531,33 @@ static int sshfs_fsync(const char *path, int isdatasync,
 	return err;
 }
 
+static void ra_release(struct sshfs_file *sf, const char *path);
+
 static int sshfs_release(const char *path, struct fuse_file_info *fi)
 {
 	struct sshfs_file *sf = get_sshfs_file(fi);
 	struct buffer *handle = &sf->handle;
 	struct conntab_entry *ce;
-	if (sshfs_file_is_conn(sf)) {
+	int is_conn = sshfs_file_is_conn(sf);
+	if (is_conn) {
 		sshfs_flush(path, fi);
 		sftp_request(sf->conn, SSH_FXP_CLOSE, handle, 0, NULL);
 	}
 	buf_free(handle);
-	chunk_put_locked(sf->readahead);
+	sshfs_close_stripes(sf, is_conn);
+	ra_release(sf, path);
+	datacache_release(sf->dc);
+	pthread_mutex_lock(&sshfs.lock);
+	list_del(&sf->wb_list);
+	list_init(&sf->wb_list);
+	while (sf->wb_refs)
+		pthread_cond_wait(&sf->write_finished, &sshfs.lock);
+	list_del(&sf->open_list);
+	g_free(sf->path);
+	sshfs.wb_writes += sf->wb_writes;
+	sshfs.wb_sends += sf->wb_sends;
+	pthread_mutex_unlock(&sshfs.lock);
+	buf_free(&sf->wb);
 	if (sshfs.max_conns > 1) {
 		pthread_mutex_lock(&sshfs.lock);
 		sf->conn->file_count--;
@@ -2895,6 +3569,7 @@ static int sshfs_release(const char *path, struct fuse_file_info *fi)
 		}
 		pthread_mutex_unlock(&sshfs.lock);
 	}
+	pthread_mutex_destroy(&sf->wb_lock);
 	g_free(sf);
 	return 0;
 }
@@ -2904,7 +3579,9 @@ static void sshfs_read_end(struct request *req)
 	struct read_req *rreq = (struct read_req *) req->data;
 	if (req->error)
 		rreq->res = req->error;
-	else if (req->replied) {
+	else if (req->replied && req->reply_type == SSH_FXP_DATA) {
+		/* Already received in place by sftp_read_data() */
+	} else if (req->replied) {
 		rreq->res = -EIO;
 
 		if (req->reply_type == SSH_FXP_STATUS) {
@@ -2915,17 +3592,6 @@ static void sshfs_read_end(struct request *req)
 				else
 					rreq->res = -sftp_error_to_errno(serr);
 			}
-		} else if (req->reply_type == SSH_FXP_DATA) {
-			uint32_t retsize;
-			if (buf_get_uint32(&req->reply, &retsize) != -1) {
-				if (retsize > rreq->size) {
-					fprintf(stderr, "long read\n");
-				} else if (buf_check_get(&req->reply, retsize) != -1) {
-					rreq->res = retsize;
-					rreq->data = req->reply;
-					buf_init(&req->reply, 0);
-				}
-			}
 		} else {
 			fprintf(stderr, "protocol error\n");
 		}
@@ -2944,11 +3610,59 @@ static void sshfs_read_begin(struct request *req)
 	rreq->sio->num_reqs++;
 }
 
-static struct read_chunk *sshfs_send_read(struct sshfs_file *sf, size_t size,
-					  off_t offset)
+/*
+ * Register buf as the destination of part of a reply that has not
+ * arrived yet.  Must be called with sshfs.lock held.
+ */
+static int read_add_dest(struct read_req *rreq, char *buf, size_t offset,
+			 size_t size)
+{
+	int i;
+
+	if (rreq->receiving || rreq->num_dest == READ_MAX_DEST)
+		return 0;
+
+	for (i = 0; i < rreq->num_dest; i++) {
+		struct read_dest *d = &rreq->dest[i];
+
+		if (offset < d->offset + d->size && d->offset < offset + size)
+			return 0;
+		if (d->offset > offset)
+			break;
+	}
+	memmove(&rreq->dest[i + 1], &rreq->dest[i],
+		(rreq->num_dest - i) * sizeof(rreq->dest[0]));
+	rreq->dest[i].buf = buf;
+	rreq->dest[i].offset = offset;
+	rreq->dest[i].size = size;
+	rreq->num_dest++;
+	return 1;
+}
+
+/* Check whether a range of a reply went to someone else's buffer */
+static int read_dest_overlaps(struct read_req *rreq, size_t offset,
+			      size_t size)
+{
+	int i;
+
+	for (i = 0; i < rreq->num_dest; i++) {
+		struct read_dest *d = &rreq->dest[i];
+
+		if (offset < d->offset + d->size && d->offset < offset + size)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Send the read requests for a chunk.  If rbuf is not NULL, the data is
+ * received straight into it.
+ */
+static struct read_chunk *sshfs_send_read(struct sshfs_file *sf, char *rbuf,
+					  size_t size, off_t offset)
 {
 	struct read_chunk *chunk = g_new0(struct read_chunk, 1);
-	struct buffer *handle = &sf->handle;
+	struct buffer *handle;
 
 	pthread_cond_init(&chunk->sio.finished, NULL);
 	list_init(&chunk->reqs);
@@ -2961,12 +3675,19 @@ static struct read_chunk *sshfs_send_read(struct sshfs_file *sf, size_t size,
 		struct buffer buf;
 		struct iovec iov[1];
 		struct read_req *rreq;
+		struct conn *conn;
 		size_t bsize = size < sshfs.max_read ? size : sshfs.max_read;
 
+		bsize = stripe_limit(sf, offset, bsize);
+		conn = stripe_conn(sf, offset, &handle);
 		rreq = g_new0(struct read_req, 1);
 		rreq->sio = &chunk->sio;
 		rreq->size = bsize;
 		buf_init(&rreq->data, 0);
+		if (rbuf) {
+			read_add_dest(rreq, rbuf + (offset - chunk->offset), 0,
+				      bsize);
+		}
 		list_add(&rreq->list, &chunk->reqs);
 
 		buf_init(&buf, 0);
@@ -2974,7 +3695,7 @@ static struct read_chunk *sshfs_send_read(struct sshfs_file *sf, size_t size,
 		buf_add_uint64(&buf, offset);
 		buf_add_uint32(&buf, bsize);
 		buf_to_iov(&buf, &iov[0]);
-		err = sftp_request_send(sf->conn, SSH_FXP_READ, iov, 1,
+		err = sftp_request_send(conn, SSH_FXP_READ, iov, 1,
 					sshfs_read_begin,
 					sshfs_read_end,
 					0, rreq, NULL);
@@ -2990,60 +3711,31 @@ static struct read_chunk *sshfs_send_read(struct sshfs_file *sf, size_t size,
 	return chunk;
 }
 
-static int wait_chunk(struct read_chunk *chunk, char *buf, size_t size)
+/* Wait for a chunk whose data is received into the caller's buffer */
+static int wait_chunk(struct read_chunk *chunk)
 {
 	int res = 0;
-	struct read_req *rreq;
+	struct list_head *curr;
 
 	pthread_mutex_lock(&sshfs.lock);
 	while (chunk->sio.num_reqs)
 	       pthread_cond_wait(&chunk->sio.finished, &sshfs.lock);
 	pthread_mutex_unlock(&sshfs.lock);
 
-
-	if (chunk->sio.error) {
-		if (chunk->sio.error != MY_EOF)
-			res = chunk->sio.error;
-
-		goto out;
-	}
-
-	while (!list_empty(&chunk->reqs) && size) {
-		rreq = list_entry(chunk->reqs.prev, struct read_req, list);
+	for (curr = chunk->reqs.prev; curr != &chunk->reqs;
+	     curr = curr->prev) {
+		struct read_req *rreq = list_entry(curr, struct read_req, list);
 
 		if (rreq->res < 0) {
-			chunk->sio.error = rreq->res;
+			if (!res)
+				res = rreq->res;
 			break;
-		} if (rreq->res == 0) {
-			chunk->sio.error = MY_EOF;
-			break;
-		} else if (size < (size_t) rreq->res) {
-			buf_get_mem(&rreq->data, buf, size);
-			rreq->res -= size;
-			rreq->size -= size;
-			res += size;
-			break;
-		} else {
-			buf_get_mem(&rreq->data, buf, rreq->res);
-			res += rreq->res;
-			if ((size_t) rreq->res < rreq->size) {
-				chunk->sio.error = MY_EOF;
-				break;
-			}
-			buf += rreq->res;
-			size -= rreq->res;
-			list_del(&rreq->list);
-			buf_free(&rreq->data);
-			g_free(rreq);
 		}
+		res += rreq->res;
+		if ((size_t) rreq->res < rreq->size)
+			break;
 	}
 
-	if (res > 0) {
-		chunk->offset += res;
-		chunk->size -= res;
-	}
-
-out:
 	chunk_put_locked(chunk);
 	return res;
 }
@@ -3053,82 +3745,347 @@ static int sshfs_sync_read(struct sshfs_file *sf, char *buf, size_t size,
 {
 	struct read_chunk *chunk;
 
-	chunk = sshfs_send_read(sf, size, offset);
-	return wait_chunk(chunk, buf, size);
+	chunk = sshfs_send_read(sf, buf, size, offset);
+	return wait_chunk(chunk);
 }
 
-static void submit_read(struct sshfs_file *sf, size_t size, off_t offset,
-                        struct read_chunk **chunkp)
+/*
+ * Adaptive read-ahead
+ *
+ * Every file keeps a list of chunks that were requested ahead of the
+ * reader, sorted by offset and ending at sf->ra_end.  A read counts as
+ * sequential if it starts where the previous one ended or inside the
+ * requested range, so that kernel read-ahead requests which are
+ * processed out of order by different threads still count.  The second
+ * sequential read in a row opens a window of twice its size, and every
+ * further one doubles the window up to sshfs.readahead_max.  Any other
+ * read closes the window and drops the chunks.
+ *
+ * The window also bounds the number of bytes that the file may have in
+ * flight, so that one stream can't fill the connection for the others.
+ * Each chunk is a single SFTP read that does not cross a stripe.
+ */
+
+/* Must be called with sshfs.lock held */
+static void ra_trim(struct sshfs_file *sf, off_t start, int all)
 {
-	struct read_chunk *chunk;
+	struct list_head *curr;
+	struct list_head *next;
+
+	for (curr = sf->ra_chunks.next; curr != &sf->ra_chunks; curr = next) {
+		struct read_chunk *ch = list_entry(curr, struct read_chunk, list);
+
+		next = curr->next;
+		if (!all && ch->modifver == sshfs.modifver &&
+		    ch->offset + (off_t) ch->size > start)
+			continue;
+
+		/* Chunks still in flight are dropped once they finish */
+		ch->modifver = sshfs.modifver - 1;
+		if (ch->sio.num_reqs)
+			continue;
+
+		list_del(&ch->list);
+		chunk_put(ch);
+	}
+}
+
+/* Must be called with sshfs.lock held */
+static struct read_chunk *ra_find(struct sshfs_file *sf, off_t offset)
+{
+	struct list_head *curr;
+
+	for (curr = sf->ra_chunks.next; curr != &sf->ra_chunks;
+	     curr = curr->next) {
+		struct read_chunk *ch = list_entry(curr, struct read_chunk, list);
+
+		if (ch->offset > offset)
+			break;
+		if (ch->modifver == sshfs.modifver &&
+		    offset < ch->offset + (off_t) ch->size) {
+			ch->refs++;
+			return ch;
+		}
+	}
+	return NULL;
+}
+
+/* Must be called with sshfs.lock held */
+static size_t ra_in_flight(struct sshfs_file *sf)
+{
+	struct list_head *curr;
+	size_t res = 0;
+
+	for (curr = sf->ra_chunks.next; curr != &sf->ra_chunks;
+	     curr = curr->next) {
+		struct read_chunk *ch = list_entry(curr, struct read_chunk, list);
+
+		if (ch->sio.num_reqs)
+			res += ch->size;
+	}
+	return res;
+}
+
+/* Must be called with sshfs.lock held */
+static void ra_insert(struct sshfs_file *sf, struct read_chunk *chunk)
+{
+	struct list_head *curr = sf->ra_chunks.prev;
+
+	while (curr != &sf->ra_chunks &&
+	       list_entry(curr, struct read_chunk, list)->offset > chunk->offset)
+		curr = curr->prev;
+	list_add(&chunk->list, curr);
+}
+
+/*
+ * Update the access pattern and the window for a read, and request the
+ * chunks that the window asks for
+ */
+static void ra_submit(struct sshfs_file *sf, size_t size, off_t offset)
+{
+	off_t end = offset + size;
+	off_t start;
+	off_t limit;
+	size_t in_flight;
+	size_t budget;
+	long modifver;
+	int seq;
 
-	chunk = sshfs_send_read(sf, size, offset);
 	pthread_mutex_lock(&sshfs.lock);
-	chunk->modifver = sshfs.modifver;
-	chunk_put(*chunkp);
-	*chunkp = chunk;
-	chunk->refs++;
+	seq = offset == sf->next_pos ||
+		(sf->ra_window && offset < sf->ra_end &&
+		 offset >= sf->next_pos - (off_t) sf->ra_window);
+	if (seq && sf->is_seq) {
+		if (!sf->ra_window)
+			sf->ra_window = 2 * size;
+		else
+			sf->ra_window *= 2;
+		if (sf->ra_window > sshfs.readahead_max)
+			sf->ra_window = sshfs.readahead_max;
+		if (sf->ra_window > sf->ra_max_window)
+			sf->ra_max_window = sf->ra_window;
+	} else if (!seq) {
+		sf->ra_window = 0;
+		sf->ra_end = 0;
+	}
+	sf->is_seq = seq;
+	if (!seq || end > sf->next_pos)
+		sf->next_pos = end;
+	ra_trim(sf, offset, !sf->ra_window);
+
+	start = sf->ra_end > end ? sf->ra_end : end;
+	limit = end + sf->ra_window;
+	/* The window may have shrunk below what is already in flight */
+	in_flight = ra_in_flight(sf);
+	budget = sf->ra_window > in_flight ? sf->ra_window - in_flight : 0;
+	if (start >= limit || budget == 0) {
+		pthread_mutex_unlock(&sshfs.lock);
+		return;
+	}
+	if (start + (off_t) budget < limit)
+		limit = start + budget;
+	sf->ra_end = limit;
+	modifver = sshfs.modifver;
 	pthread_mutex_unlock(&sshfs.lock);
+
+	while (start < limit) {
+		struct read_chunk *chunk;
+		size_t bsize = limit - start;
+
+		if (bsize > sshfs.max_read)
+			bsize = sshfs.max_read;
+		bsize = stripe_limit(sf, start, bsize);
+		chunk = sshfs_send_read(sf, NULL, bsize, start);
+
+		pthread_mutex_lock(&sshfs.lock);
+		chunk->modifver = modifver;
+		ra_insert(sf, chunk);
+		pthread_mutex_unlock(&sshfs.lock);
+		start += bsize;
+	}
 }
 
-static struct read_chunk *search_read_chunk(struct sshfs_file *sf, off_t offset)
+/*
+ * Get the part of a chunk that starts at offset, returns the number of
+ * bytes stored in buf, 0 at end of file, or -errno.  If the reply has
+ * not arrived yet, it is received straight into buf.  -EAGAIN means
+ * that the data went to another reader and must be read again.
+ */
+static int ra_copy(struct read_chunk *chunk, char *buf, size_t size,
+		   off_t offset)
 {
-	struct read_chunk *ch = sf->readahead;
-	if (ch && ch->offset == offset && ch->modifver == sshfs.modifver) {
-		ch->refs++;
-		return ch;
-	} else
-		return NULL;
+	struct read_req *rreq;
+	size_t skip = offset - chunk->offset;
+	int direct;
+
+	rreq = list_entry(chunk->reqs.prev, struct read_req, list);
+	if (size > rreq->size - skip)
+		size = rreq->size - skip;
+
+	pthread_mutex_lock(&sshfs.lock);
+	direct = read_add_dest(rreq, buf, skip, size);
+	while (chunk->sio.num_reqs)
+	       pthread_cond_wait(&chunk->sio.finished, &sshfs.lock);
+	pthread_mutex_unlock(&sshfs.lock);
+
+	if (rreq->res < 0)
+		return rreq->res;
+	if (skip >= (size_t) rreq->res)
+		return 0;
+	if (size > rreq->res - skip)
+		size = rreq->res - skip;
+	if (!direct) {
+		if (read_dest_overlaps(rreq, skip, size))
+			return -EAGAIN;
+		memcpy(buf, rreq->data.p + skip, size);
+	}
+	return size;
 }
 
 static int sshfs_async_read(struct sshfs_file *sf, char *rbuf, size_t size,
-                            off_t offset)
+			    off_t offset)
 {
-	int res = 0;
-	size_t total = 0;
 	struct read_chunk *chunk;
-	struct read_chunk *chunk_prev = NULL;
-	size_t origsize = size;
-	int curr_is_seq;
+	size_t total = 0;
+	int hit = 1;
+	int res = 0;
+
+	ra_submit(sf, size, offset);
+
+	while (total < size) {
+		off_t pos = offset + total;
+
+		pthread_mutex_lock(&sshfs.lock);
+		chunk = ra_find(sf, pos);
+		pthread_mutex_unlock(&sshfs.lock);
+		if (chunk) {
+			res = ra_copy(chunk, rbuf + total, size - total, pos);
+			if (res == -EAGAIN) {
+				chunk_put_locked(chunk);
+				chunk = NULL;
+			}
+		}
+		if (!chunk) {
+			hit = 0;
+			res = sshfs_sync_read(sf, rbuf + total, size - total,
+					      pos);
+			if (res > 0)
+				total += res;
+			break;
+		}
+
+		if (res > 0)
+			total += res;
+		/* A short chunk means end of file */
+		if (res <= 0 || (total < size &&
+				 pos + res < chunk->offset + (off_t) chunk->size)) {
+			chunk_put_locked(chunk);
+			break;
+		}
+		chunk_put_locked(chunk);
+	}
 
 	pthread_mutex_lock(&sshfs.lock);
-	curr_is_seq = sf->is_seq;
-	sf->is_seq = (sf->next_pos == offset && sf->modifver == sshfs.modifver);
-	sf->next_pos = offset + size;
-	sf->modifver = sshfs.modifver;
-	chunk = search_read_chunk(sf, offset);
+	if (hit)
+		sf->ra_hits++;
+	else
+		sf->ra_misses++;
 	pthread_mutex_unlock(&sshfs.lock);
 
-	if (chunk && chunk->size < size) {
-		chunk_prev = chunk;
-		size -= chunk->size;
-		offset += chunk->size;
-		chunk = NULL;
-	}
+	if (res < 0 && !total)
+		return res;
+	return total;
+}
 
-	if (!chunk)
-		submit_read(sf, size, offset, &chunk);
+static void ra_release(struct sshfs_file *sf, const char *path)
+{
+	struct list_head *curr;
 
-	if (curr_is_seq && chunk && chunk->size <= size)
-		submit_read(sf, origsize, offset + size, &sf->readahead);
+	pthread_mutex_lock(&sshfs.lock);
+	for (curr = sf->ra_chunks.next; curr != &sf->ra_chunks;
+	     curr = curr->next) {
+		struct read_chunk *ch = list_entry(curr, struct read_chunk, list);
+
+		while (ch->sio.num_reqs)
+			pthread_cond_wait(&ch->sio.finished, &sshfs.lock);
+	}
+	ra_trim(sf, 0, 1);
+	sshfs.ra_hits += sf->ra_hits;
+	sshfs.ra_misses += sf->ra_misses;
+	if (sf->ra_max_window > sshfs.ra_max_window)
+		sshfs.ra_max_window = sf->ra_max_window;
+	pthread_mutex_unlock(&sshfs.lock);
 
-	if (chunk_prev) {
-		size_t prev_size = chunk_prev->size;
-		res = wait_chunk(chunk_prev, rbuf, prev_size);
-		if (res < (int) prev_size) {
-			chunk_put_locked(chunk);
-			return res;
+	if (sf->ra_hits || sf->ra_misses)
+		DEBUG("read-ahead%s%s: max window %zu, %llu hits, %llu misses\n",
+		      path ? " " : "", path ? path : "", sf->ra_max_window,
+		      (unsigned long long) sf->ra_hits,
+		      (unsigned long long) sf->ra_misses);
+}
+
+static int sshfs_do_read(struct sshfs_file *sf, char *rbuf, size_t size,
+			 off_t offset)
+{
+	if (sshfs.sync_read)
+		return sshfs_sync_read(sf, rbuf, size, offset);
+	else
+		return sshfs_async_read(sf, rbuf, size, offset);
+}
+
+/*
+ * Serve a read from the data cache.  The blocks that are missing are
+ * read from the server as a whole, so that they can be stored.  The
+ * data is consistent with the size and modification time that the
+ * file had at open.  Once the file has been changed through this
+ * mount, all reads go to the server.
+ */
+static int sshfs_cached_read(struct sshfs_file *sf, char *rbuf, size_t size,
+			     off_t offset)
+{
+	off_t fsize = datacache_file_size(sf->dc);
+	off_t start;
+	off_t end;
+	size_t skip;
+	char *tmp;
+	int res;
+	int err;
+
+	/* The file has been written to, or has grown since it was opened */
+	if (fsize == -1 || offset >= fsize)
+		return sshfs_do_read(sf, rbuf, size, offset);
+
+	if (size > fsize - offset)
+		size = fsize - offset;
+	res = datacache_read(sf->dc, rbuf, size, offset);
+	if (res == (int) size)
+		return res;
+
+	start = offset + res;
+	start -= start % DATACACHE_BLOCK_SIZE;
+	end = offset + size + DATACACHE_BLOCK_SIZE - 1;
+	end -= end % DATACACHE_BLOCK_SIZE;
+	if (end > fsize)
+		end = fsize;
+
+	tmp = g_malloc(end - start);
+	err = sshfs_do_read(sf, tmp, end - start, start);
+	if (err > 0) {
+		datacache_fill(sf->dc, tmp, err, start);
+		skip = offset + res - start;
+		if ((size_t) err > skip) {
+			size_t len = err - skip;
+
+			if (len > size - res)
+				len = size - res;
+			memcpy(rbuf + res, tmp + skip, len);
+			res += len;
 		}
-		rbuf += res;
-		total += res;
+	} else if (err < 0 && !res) {
+		res = err;
 	}
-	res = wait_chunk(chunk, rbuf, size);
-	if (res > 0)
-		total += res;
-	if (res < 0)
-		return res;
+	g_free(tmp);
 
-	return total;
+	return res;
 }
 
 static int sshfs_read(const char *path, char *rbuf, size_t size, off_t offset,
@@ -3140,16 +4097,19 @@ static int sshfs_read(const char *path, char *rbuf, size_t size, off_t offset,
 	if (!sshfs_file_is_conn(sf))
 		return -EIO;
 
-	if (sshfs.sync_read)
-		return sshfs_sync_read(sf, rbuf, size, offset);
+	wb_flush_path(sf, NULL);
+	if (sf->dc)
+		return sshfs_cached_read(sf, rbuf, size, offset);
 	else
-		return sshfs_async_read(sf, rbuf, size, offset);
+		return sshfs_do_read(sf, rbuf, size, offset);
 }
 
 static void sshfs_write_begin(struct request *req)
 {
 	struct sshfs_file *sf = (struct sshfs_file *) req->data;
 	list_add(&req->list, &sf->write_reqs);
+	if (req->conn != sf->conn)
+		sf->ce->stripe_writes++;
 }
 
 static void sshfs_write_end(struct request *req)
@@ -3169,19 +4129,24 @@ static void sshfs_write_end(struct request *req)
 	}
 	list_del(&req->list);
 	pthread_cond_broadcast(&sf->write_finished);
+	if (req->conn != sf->conn && --sf->ce->stripe_writes == 0)
+		pthread_cond_broadcast(&sshfs.stripe_cond);
 }
 
 static int sshfs_async_write(struct sshfs_file *sf, const char *wbuf,
 			     size_t size, off_t offset)
 {
 	int err = 0;
-	struct buffer *handle = &sf->handle;
+	struct buffer *handle;
 
 	while (!err && size) {
 		struct buffer buf;
 		struct iovec iov[2];
+		struct conn *conn;
 		size_t bsize = size < sshfs.max_write ? size : sshfs.max_write;
 
+		bsize = stripe_limit(sf, offset, bsize);
+		conn = stripe_conn(sf, offset, &handle);
 		buf_init(&buf, 0);
 		buf_add_buf(&buf, handle);
 		buf_add_uint64(&buf, offset);
@@ -3189,7 +4154,7 @@ static int sshfs_async_write(struct sshfs_file *sf, const char *wbuf,
 		buf_to_iov(&buf, &iov[0]);
 		iov[1].iov_base = (void *) wbuf;
 		iov[1].iov_len = bsize;
-		err = sftp_request_send(sf->conn, SSH_FXP_WRITE, iov, 2,
+		err = sftp_request_send(conn, SSH_FXP_WRITE, iov, 2,
 					sshfs_write_begin, sshfs_write_end,
 					0, sf, NULL);
 		buf_free(&buf);
@@ -3201,6 +4166,232 @@ static int sshfs_async_write(struct sshfs_file *sf, const char *wbuf,
 	return err;
 }
 
+/*
+ * Write coalescing
+ *
+ * Writes smaller than max_write are held back in a buffer of the file
+ * as long as each one continues the previous one.  The buffer is sent
+ * as one write when it is full, when a write does not continue it,
+ * after write_delay milliseconds, and before anything that could see
+ * the data on the server: read, getattr, truncate, utimens, open with
+ * O_TRUNC, flush, fsync and release.  Those only send the buffers of
+ * the handles open on the same file, which are found by sf->path.
+ * Renames keep that path up to date.  All writes of a file go through
+ * sf->wb_lock, so that they are sent in the order they arrived.
+ * Errors of buffered writes are reported by flush, like those of other
+ * asynchronous writes.
+ *
+ * Files with a filled buffer are on the sshfs.wb_dirty list, oldest
+ * first, which is also where the flusher thread finds them.
+ */
+
+/* Must be called with sf->wb_lock held */
+static int wb_send(struct sshfs_file *sf)
+{
+	int err;
+
+	if (!sf->wb.len)
+		return 0;
+
+	pthread_mutex_lock(&sshfs.lock);
+	list_del(&sf->wb_list);
+	list_init(&sf->wb_list);
+	pthread_mutex_unlock(&sshfs.lock);
+
+	err = sshfs_async_write(sf, (char *) sf->wb.p, sf->wb.len,
+				sf->wb_offset);
+	sf->wb.len = 0;
+	sf->wb_sends++;
+	if (err) {
+		pthread_mutex_lock(&sshfs.lock);
+		sf->write_error = err;
+		pthread_mutex_unlock(&sshfs.lock);
+	}
+	return err;
+}
+
+/* Must be called with sshfs.lock held, which is dropped meanwhile */
+static void wb_flush_file(struct sshfs_file *sf)
+{
+	list_del(&sf->wb_list);
+	list_init(&sf->wb_list);
+	sf->wb_refs++;
+	pthread_mutex_unlock(&sshfs.lock);
+
+	pthread_mutex_lock(&sf->wb_lock);
+	wb_send(sf);
+	pthread_mutex_unlock(&sf->wb_lock);
+
+	pthread_mutex_lock(&sshfs.lock);
+	if (--sf->wb_refs == 0)
+		pthread_cond_broadcast(&sf->write_finished);
+}
+
+/* Is path an entry of the directory dir? */
+static int path_in_dir(const char *path, const char *dir)
+{
+	size_t len = strrchr(path, '/') - path;
+
+	if (!dir[1])
+		return len == 0;
+	return len == strlen(dir) && strncmp(path, dir, len) == 0;
+}
+
+/*
+ * Send the buffers of all handles that are open on path, or on the
+ * file that sf is open on if sf is not NULL.  With children, those of
+ * the files in the directory path instead.
+ */
+static void wb_flush_files(struct sshfs_file *sf, const char *path,
+			   int children)
+{
+	struct list_head *curr;
+	GPtrArray *files;
+	guint i;
+
+	pthread_mutex_lock(&sshfs.lock);
+	if (list_empty(&sshfs.wb_dirty)) {
+		pthread_mutex_unlock(&sshfs.lock);
+		return;
+	}
+	if (sf != NULL)
+		path = sf->path;
+	files = g_ptr_array_new();
+	for (curr = sshfs.wb_dirty.next; curr != &sshfs.wb_dirty;
+	     curr = curr->next) {
+		struct sshfs_file *dirty =
+			list_entry(curr, struct sshfs_file, wb_list);
+
+		if (children ? path_in_dir(dirty->path, path) :
+		    strcmp(dirty->path, path) == 0) {
+			dirty->wb_refs++;
+			g_ptr_array_add(files, dirty);
+		}
+	}
+	pthread_mutex_unlock(&sshfs.lock);
+
+	for (i = 0; i < files->len; i++) {
+		struct sshfs_file *dirty = g_ptr_array_index(files, i);
+
+		pthread_mutex_lock(&dirty->wb_lock);
+		wb_send(dirty);
+		pthread_mutex_unlock(&dirty->wb_lock);
+	}
+
+	pthread_mutex_lock(&sshfs.lock);
+	for (i = 0; i < files->len; i++) {
+		struct sshfs_file *dirty = g_ptr_array_index(files, i);
+
+		if (--dirty->wb_refs == 0)
+			pthread_cond_broadcast(&dirty->write_finished);
+	}
+	pthread_mutex_unlock(&sshfs.lock);
+	g_ptr_array_free(files, TRUE);
+}
+
+static void wb_flush_path(struct sshfs_file *sf, const char *path)
+{
+	wb_flush_files(sf, path, 0);
+}
+
+static void wb_flush_dir(const char *path)
+{
+	wb_flush_files(NULL, path, 1);
+}
+
+
+static void *wb_flusher(void *data)
+{
+	(void) data;
+
+	pthread_mutex_lock(&sshfs.lock);
+	while (1) {
+		struct sshfs_file *sf;
+		struct timespec deadline;
+		struct timespec now;
+
+		if (list_empty(&sshfs.wb_dirty)) {
+			pthread_cond_wait(&sshfs.wb_cond, &sshfs.lock);
+			continue;
+		}
+
+		sf = list_entry(sshfs.wb_dirty.next, struct sshfs_file, wb_list);
+		deadline = sf->wb_time;
+		deadline.tv_sec += sshfs.write_delay / 1000;
+		deadline.tv_nsec += (sshfs.write_delay % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (now.tv_sec < deadline.tv_sec ||
+		    (now.tv_sec == deadline.tv_sec &&
+		     now.tv_nsec < deadline.tv_nsec)) {
+			pthread_cond_timedwait(&sshfs.wb_cond, &sshfs.lock,
+					       &deadline);
+			continue;
+		}
+		wb_flush_file(sf);
+	}
+	return NULL;
+}
+
+/* Must be called with sshfs.lock held */
+static void start_wb_thread(void)
+{
+	int err;
+	pthread_t thread_id;
+	sigset_t oldset;
+	sigset_t newset;
+
+	sigemptyset(&newset);
+	sigaddset(&newset, SIGTERM);
+	sigaddset(&newset, SIGINT);
+	sigaddset(&newset, SIGHUP);
+	sigaddset(&newset, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+	err = pthread_create(&thread_id, NULL, wb_flusher, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (err) {
+		/* Buffers are still sent when full or flushed */
+		fprintf(stderr, "failed to create thread: %s\n", strerror(err));
+		return;
+	}
+	pthread_detach(thread_id);
+	sshfs.wb_thread_started = 1;
+}
+
+/* Must be called with sf->wb_lock held */
+static int wb_write(struct sshfs_file *sf, const char *wbuf, size_t size,
+		    off_t offset)
+{
+	int err = 0;
+
+	if (sf->wb.len && (offset != sf->wb_offset + (off_t) sf->wb.len ||
+			   sf->wb.len + size > sshfs.max_write))
+		err = wb_send(sf);
+	if (err)
+		return err;
+
+	if (!sf->wb.len) {
+		sf->wb_offset = offset;
+		clock_gettime(CLOCK_REALTIME, &sf->wb_time);
+		pthread_mutex_lock(&sshfs.lock);
+		if (!sshfs.wb_thread_started)
+			start_wb_thread();
+		if (list_empty(&sshfs.wb_dirty))
+			pthread_cond_signal(&sshfs.wb_cond);
+		list_add(&sf->wb_list, sshfs.wb_dirty.prev);
+		pthread_mutex_unlock(&sshfs.lock);
+	}
+	buf_add_mem(&sf->wb, wbuf, size);
+	sf->wb_writes++;
+
+	if (sf->wb.len >= sshfs.max_write)
+		err = wb_send(sf);
+	return err;
+}
+
 static void sshfs_sync_write_begin(struct request *req)
 {
 	struct sshfs_io *sio = (struct sshfs_io *) req->data;
@@ -3232,7 +4423,7 @@ static int sshfs_sync_write(struct sshfs_file *sf, const char *wbuf,
 			    size_t size, off_t offset)
 {
 	int err = 0;
-	struct buffer *handle = &sf->handle;
+	struct buffer *handle;
 	struct sshfs_io sio = { .error = 0, .num_reqs = 0 };
 
 	pthread_cond_init(&sio.finished, NULL);
@@ -3240,8 +4431,11 @@ static int sshfs_sync_write(struct sshfs_file *sf, const char *wbuf,
 	while (!err && size) {
 		struct buffer buf;
 		struct iovec iov[2];
+		struct conn *conn;
 		size_t bsize = size < sshfs.max_write ? size : sshfs.max_write;
 
+		bsize = stripe_limit(sf, offset, bsize);
+		conn = stripe_conn(sf, offset, &handle);
 		buf_init(&buf, 0);
 		buf_add_buf(&buf, handle);
 		buf_add_uint64(&buf, offset);
@@ -3249,7 +4443,7 @@ static int sshfs_sync_write(struct sshfs_file *sf, const char *wbuf,
 		buf_to_iov(&buf, &iov[0]);
 		iov[1].iov_base = (void *) wbuf;
 		iov[1].iov_len = bsize;
-		err = sftp_request_send(sf->conn, SSH_FXP_WRITE, iov, 2,
+		err = sftp_request_send(conn, SSH_FXP_WRITE, iov, 2,
 					sshfs_sync_write_begin,
 					sshfs_sync_write_end,
 					0, &sio, NULL);
@@ -3276,17 +4470,28 @@ static int sshfs_write(const char *path, const char *wbuf, size_t size,
 	int err;
 	struct sshfs_file *sf = get_sshfs_file(fi);
 
-	(void) path;
-
 	if (!sshfs_file_is_conn(sf))
 		return -EIO;
 
 	sshfs_inc_modifver();
+	datacache_invalidate(path);
 
-	if (!sshfs.sync_write && !sf->write_error)
-		err = sshfs_async_write(sf, wbuf, size, offset);
-	else
-		err = sshfs_sync_write(sf, wbuf, size, offset);
+	pthread_mutex_lock(&sf->wb_lock);
+	if (!sshfs.sync_write && !sf->write_error) {
+		if (sshfs.write_delay && size < sshfs.max_write) {
+			err = wb_write(sf, wbuf, size, offset);
+		} else {
+			err = wb_send(sf);
+			if (!err)
+				err = sshfs_async_write(sf, wbuf, size, offset);
+		}
+		pthread_mutex_unlock(&sf->wb_lock);
+	} else {
+		err = wb_send(sf);
+		pthread_mutex_unlock(&sf->wb_lock);
+		if (!err)
+			err = sshfs_sync_write(sf, wbuf, size, offset);
+	}
 
 	return err ? err : (int) size;
 }
@@ -3351,7 +4556,9 @@ static int sshfs_truncate(const char *path, off_t size,
 			return -EIO;
 	}
 
+	wb_flush_path(sf, path);
 	sshfs_inc_modifver();
+	datacache_invalidate(path);
 	if (sshfs.truncate_workaround)
 		return sshfs_truncate_workaround(path, size, fi);
 
@@ -3386,6 +4593,7 @@ static int sshfs_getattr(const char *path, struct stat *stbuf,
 			return -EIO;
 	}
 
+	wb_flush_path(sf, path);
 	buf_init(&buf, 0);
 	if(sf == NULL) {
 		buf_add_path(&buf, path);
@@ -3395,7 +4603,7 @@ static int sshfs_getattr(const char *path, struct stat *stbuf,
 	}
 	else {
 		buf_add_buf(&buf, &sf->handle);
-		err = sftp_request(sf->conn, SSH_FXP_FSTAT, &buf,
+		err = sftp_request(get_conn(sf, NULL), SSH_FXP_FSTAT, &buf,
 				   SSH_FXP_ATTRS, &outbuf);
 	}
 	if (!err) {
@@ -3409,6 +4617,65 @@ static int sshfs_getattr(const char *path, struct stat *stbuf,
 	return err;
 }
 
+/*
+ * The copy-data extension copies between two handles on the server, so
+ * no data goes over the connection.  Its reply does not say how much
+ * was copied, so the length is limited to the size of the source first.
+ * Returning EOPNOTSUPP makes the kernel fall back to a regular copy.
+ */
+static ssize_t sshfs_copy_file_range(const char *path_in,
+				     struct fuse_file_info *fi_in,
+				     off_t offset_in, const char *path_out,
+				     struct fuse_file_info *fi_out,
+				     off_t offset_out, size_t size, int flags)
+{
+	int err;
+	struct buffer buf;
+	struct stat stbuf;
+	struct sshfs_file *sf_in = get_sshfs_file(fi_in);
+	struct sshfs_file *sf_out = get_sshfs_file(fi_out);
+
+	if (!sshfs.ext_copy_data || flags)
+		return -EOPNOTSUPP;
+
+	if (!sshfs_file_is_conn(sf_in) || !sshfs_file_is_conn(sf_out))
+		return -EIO;
+
+	/* Handles are only valid on the connection that opened them */
+	if (sf_in->conn != sf_out->conn)
+		return -EOPNOTSUPP;
+
+	/* Pending writes to either file must reach the server first */
+	err = sshfs_flush(path_in, fi_in);
+	if (!err)
+		err = sshfs_flush(path_out, fi_out);
+	if (!err)
+		err = sshfs_getattr(path_in, &stbuf, fi_in);
+	if (err)
+		return err;
+
+	if (offset_in >= stbuf.st_size || !size)
+		return 0;
+	if (size > (size_t) (stbuf.st_size - offset_in))
+		size = stbuf.st_size - offset_in;
+
+	sshfs_inc_modifver();
+	datacache_invalidate(path_out);
+
+	buf_init(&buf, 0);
+	buf_add_string(&buf, SFTP_EXT_COPY_DATA);
+	buf_add_buf(&buf, &sf_in->handle);
+	buf_add_uint64(&buf, offset_in);
+	buf_add_uint64(&buf, size);
+	buf_add_buf(&buf, &sf_out->handle);
+	buf_add_uint64(&buf, offset_out);
+	err = sftp_request(sf_in->conn, SSH_FXP_EXTENDED, &buf,
+			   SSH_FXP_STATUS, NULL);
+	buf_free(&buf);
+
+	return err ? err : (ssize_t) size;
+}
+
 static int sshfs_truncate_zero(const char *path)
 {
 	int err;
@@ -3538,6 +4805,11 @@ static int processing_init(void)
 	for (i = 0; i < sshfs.max_conns; i++)
 		pthread_mutex_init(&sshfs.conns[i].lock_write, NULL);
 	pthread_cond_init(&sshfs.outstanding_cond, NULL);
+	pthread_cond_init(&sshfs.stripe_cond, NULL);
+	pthread_cond_init(&sshfs.wb_cond, NULL);
+	list_init(&sshfs.wb_dirty);
+	list_init(&sshfs.open_files);
+	list_init(&sshfs.open_dirs);
 	sshfs.reqtab = g_hash_table_new(NULL, NULL);
 	if (!sshfs.reqtab) {
 		fprintf(stderr, "failed to create hash table\n");
@@ -3579,6 +4851,7 @@ static struct fuse_operations sshfs_oper = {
 		.release    = sshfs_release,
 		.read       = sshfs_read,
 		.write      = sshfs_write,
+		.copy_file_range = sshfs_copy_file_range,
 		.statfs     = sshfs_statfs,
 		.create     = sshfs_create,
 };
@@ -3601,6 +4874,10 @@ static void usage(const char *progname)
 "    -o delay_connect       delay connection to server\n"
 "    -o sshfs_sync          synchronous writes\n"
 "    -o no_readahead        synchronous reads (no speculative readahead)\n"
+"    -o readahead_max=N     maximum read-ahead window per file in bytes\n"
+"                           (default: 4194304)\n"
+"    -o write_delay=N       maximum time in ms that small writes are held\n"
+"                           back to be merged (default: 50, 0 disables)\n"
 "    -o sync_readdir        synchronous readdir\n"
 "    -d, --debug            print some debugging information (implies -f)\n"
 "    -v, --verbose          print ssh replies and messages\n"
@@ -3610,12 +4887,9 @@ static void usage(const char *progname)
 "    -o dcache_timeout=N    sets timeout for directory cache in seconds (default: 20)\n"
 "    -o dcache_{stat,link,dir}_timeout=N\n"
 "                           sets separate timeout for {attributes, symlinks, names}\n"
-"    -o dcache_clean_interval=N\n"
-"                           sets the interval for automatic cleaning of the\n"
-"                           cache (default: 60)\n"
-"    -o dcache_min_clean_interval=N\n"
-"                           sets the interval for forced cleaning of the\n"
-"                           cache if full (default: 5)\n"
+"    -o data_cache=DIR      keep the contents of files read in DIR\n"
+"    -o data_cache_size=N   maximum size of the data cache in MiB\n"
+"                           (default: 1024)\n"
 "    -o direct_io           enable direct i/o\n"
 "    -o workaround=LIST     colon separated list of workarounds\n"
 "             none             no workarounds enabled\n"
@@ -3645,6 +4919,8 @@ static void usage(const char *progname)
 "    -o no_check_root       don't check for existence of 'dir' on server\n"
 "    -o password_stdin      read password from stdin (only for pam_mount!)\n"
 "    -o max_conns=N         open parallel SSH connections\n"
+"    -o stripe_size=N       spread I/O of a file over all connections in\n"
+"                           stripes of N bytes (default: 0, off)\n"
 "    -o SSHOPT=VAL          ssh options (see man ssh_config)\n"
 "\n"
 "FUSE Options:\n",
@@ -4170,9 +5446,10 @@ int main(int argc, char *argv[])
 #else
 	sshfs.blksize = 4096;
 #endif
-	/* SFTP spec says all servers should allow at least 32k I/O */
-	sshfs.max_read = 32768;
-	sshfs.max_write = 32768;
+	sshfs.max_read = 0;
+	sshfs.max_write = 0;
+	sshfs.readahead_max = 4 * 1024 * 1024;
+	sshfs.write_delay = 50;
 #ifdef __APPLE__
 	sshfs.rename_workaround = 1;
 #else
@@ -4338,8 +5615,22 @@ int main(int argc, char *argv[])
 	if (res == -1)
 		exit(1);
 
+	res = datacache_parse_options(&args);
+	if (res == -1 || datacache_init(fsname) == -1)
+		exit(1);
+
 	sshfs.randseed = time(0);
 
+	/*
+	 * SFTP spec says all servers should allow at least 32k I/O.  Larger
+	 * sizes are used if the server limits allow them.
+	 */
+	sshfs.auto_max_read = !sshfs.max_read;
+	sshfs.auto_max_write = !sshfs.max_write;
+	if (!sshfs.max_read)
+		sshfs.max_read = 32768;
+	if (!sshfs.max_write)
+		sshfs.max_write = 32768;
 	if (sshfs.max_read > 65536)
 		sshfs.max_read = 65536;
 	if (sshfs.max_write > 65536)
@@ -4412,21 +5703,34 @@ int main(int argc, char *argv[])
 
 	if (sshfs.debug) {
 		unsigned int avg_rtt = 0;
+		uint64_t dc_hits, dc_misses, dc_evictions;
 
 		if (sshfs.num_sent)
 			avg_rtt = sshfs.total_rtt / sshfs.num_sent;
+		datacache_get_stats(&dc_hits, &dc_misses, &dc_evictions);
 
 		DEBUG("\n"
 		      "sent:               %llu messages, %llu bytes\n"
 		      "received:           %llu messages, %llu bytes\n"
 		      "rtt min/max/avg:    %ums/%ums/%ums\n"
-		      "num connect:        %u\n",
+		      "num connect:        %u\n"
+		      "read-ahead:         %llu hits, %llu misses, max window %zu\n"
+		      "data cache:         %llu hits, %llu misses, %llu evictions\n"
+		      "write coalescing:   %llu writes in %llu requests\n",
 		      (unsigned long long) sshfs.num_sent,
 		      (unsigned long long) sshfs.bytes_sent,
 		      (unsigned long long) sshfs.num_received,
 		      (unsigned long long) sshfs.bytes_received,
 		      sshfs.min_rtt, sshfs.max_rtt, avg_rtt,
-		      sshfs.num_connect);
+		      sshfs.num_connect,
+		      (unsigned long long) sshfs.ra_hits,
+		      (unsigned long long) sshfs.ra_misses,
+		      sshfs.ra_max_window,
+		      (unsigned long long) dc_hits,
+		      (unsigned long long) dc_misses,
+		      (unsigned long long) dc_evictions,
+		      (unsigned long long) sshfs.wb_writes,
+		      (unsigned long long) sshfs.wb_sends);
 	}
 
 	fuse_opt_free_args(&args);
@@ -0,0 +1,484 @@
+#!/usr/bin/env python3
+'''Performance harness for sshfs
+
+Mounts sshfs against a local sftp-server, with a proxy in between that
+delays the SFTP traffic and limits its bandwidth to model a network
+link. Runs sequential read and write, small random read, metadata and
+readdir workloads for different sshfs options, and reports operations
+per second, throughput and latency percentiles as JSON.
+
+This is not a test - it does not check results and is not collected by
+pytest. Run it from the build directory:
+
+    $ python3 test/perf_harness.py --network 0,20/100 --output base.json
+    (apply changes, rebuild)
+    $ python3 test/perf_harness.py --network 0,20/100 --baseline base.json
+
+A network is given as RTT_MS[/MBIT]: the round trip time in
+milliseconds and the bandwidth of each direction in Mbit/s (no limit
+if omitted). Every connection of sshfs gets its own sftp-server and
+its own link. Numbers are only comparable between runs on the same
+machine.
+'''
+
+import argparse
+import collections
+import json
+import os
+import platform
+import random
+import shlex
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from os.path import join as pjoin
+
+sys.path.insert(0, os.path.dirname(__file__))
+from util import wait_for_mount, umount, cleanup, base_cmdline, basename
+
+# sshfs options of each configuration
+CONFIGS = {
+    'default': [],
+    'no_readahead': [ '-o', 'no_readahead' ],
+    'no_dir_cache': [ '-o', 'dir_cache=no' ],
+    'sshfs_sync': [ '-o', 'sshfs_sync' ],
+    'max_conns': [ '-o', 'max_conns=4' ],
+    'stripe': [ '-o', 'max_conns=4', '-o', 'stripe_size=1048576' ],
+}
+
+WORKLOADS = ( 'seqwrite', 'seqread', 'randread', 'metadata', 'readdir' )
+
+SFTP_SERVERS = ( '/usr/lib/openssh/sftp-server',
+                 '/usr/libexec/openssh/sftp-server',
+                 '/usr/lib/ssh/sftp-server',
+                 '/usr/libexec/sftp-server' )
+
+# Passed to the proxy through the environment of sshfs, since
+# ssh_command cannot contain commas
+ENV_SERVER = 'SSHFS_PERF_SERVER'
+ENV_RTT = 'SSHFS_PERF_RTT'
+ENV_BANDWIDTH = 'SSHFS_PERF_BANDWIDTH'
+
+
+class Link:
+    '''Forwards data from one fd to another like a network link
+
+    Each chunk is written half a round trip after it was read, and no
+    earlier than the end of the previous chunk at the given bandwidth.
+    '''
+
+    def __init__(self, rfd, wfd, delay, bandwidth):
+        self.rfd = rfd
+        self.wfd = wfd
+        self.delay = delay
+        self.bandwidth = bandwidth
+        self.queue = collections.deque()
+        self.cond = threading.Condition()
+        self.threads = [ threading.Thread(target=self.reader),
+                         threading.Thread(target=self.writer) ]
+        for t in self.threads:
+            t.start()
+
+    def reader(self):
+        while True:
+            try:
+                data = os.read(self.rfd, 65536)
+            except OSError:
+                data = b''
+            with self.cond:
+                self.queue.append((time.monotonic(), data))
+                self.cond.notify()
+            if not data:
+                return
+
+    def writer(self):
+        free_at = 0
+        while True:
+            with self.cond:
+                while not self.queue:
+                    self.cond.wait()
+                arrived, data = self.queue.popleft()
+            if not data:
+                break
+            due = arrived + self.delay
+            if self.bandwidth:
+                free_at = max(due, free_at) + len(data) / self.bandwidth
+                due = free_at
+            now = time.monotonic()
+            if due > now:
+                time.sleep(due - now)
+            try:
+                view = memoryview(data)
+                while view:
+                    view = view[os.write(self.wfd, view):]
+            except OSError:
+                break
+        os.close(self.wfd)
+
+    def join(self):
+        for t in self.threads:
+            t.join()
+
+
+def proxy():
+    '''Started by sshfs in place of ssh, see ssh_command in mount()'''
+
+    delay = float(os.environ.get(ENV_RTT, '0')) / 2000
+    bandwidth = float(os.environ.get(ENV_BANDWIDTH, '0')) * 1e6 / 8
+    server = subprocess.Popen(shlex.split(os.environ[ENV_SERVER]),
+                              stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                              bufsize=0)
+    links = [ Link(0, server.stdin.fileno(), delay, bandwidth),
+              Link(server.stdout.fileno(), 1, delay, bandwidth) ]
+    for link in links:
+        link.join()
+    server.wait()
+
+
+def parse_network(spec):
+    rtt, _, bandwidth = spec.partition('/')
+    return float(rtt), float(bandwidth or 0)
+
+
+def mount(config, network, src_dir, mnt_dir, args, output):
+    rtt, bandwidth = parse_network(network)
+    env = dict(os.environ)
+    env[ENV_SERVER] = args.sftp_server
+    env[ENV_RTT] = str(rtt)
+    env[ENV_BANDWIDTH] = str(bandwidth)
+
+    ssh_command = '%s %s --proxy' % (sys.executable,
+                                     os.path.abspath(__file__))
+    cmdline = base_cmdline + [ pjoin(basename, 'sshfs'), '-f',
+                               '-o', 'ssh_command=' + ssh_command,
+                               'localhost:' + src_dir, mnt_dir ]
+    cmdline += CONFIGS[config]
+    for opt in args.options:
+        cmdline += [ '-o', opt ]
+
+    mount_process = subprocess.Popen(cmdline, env=env, stdout=output,
+                                     stderr=output)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+    except BaseException:
+        cleanup(mount_process, mnt_dir)
+        raise
+    return mount_process
+
+
+class Recorder:
+    '''Collects per-operation latencies of one worker thread'''
+
+    def __init__(self):
+        self.lat = []
+        self.bytes = 0
+
+    def timed(self, fn, *args):
+        start = time.perf_counter_ns()
+        res = fn(*args)
+        self.lat.append(time.perf_counter_ns() - start)
+        return res
+
+
+def drop_cache(fd, off=0, size=0):
+    # Clean pages are dropped from the FUSE page cache, so that the
+    # next read goes to sshfs
+    os.posix_fadvise(fd, off, size, os.POSIX_FADV_DONTNEED)
+
+
+def make_file(path, size):
+    with open(path, 'wb') as fh:
+        for off in range(0, size, 1 << 20):
+            fh.write(os.urandom(min(1 << 20, size - off)))
+
+
+def setup_file(src, args):
+    make_file(src, args.file_size)
+
+
+def setup_dir(src, args):
+    os.mkdir(src)
+
+
+def setup_listing(src, args):
+    os.mkdir(src)
+    for i in range(args.files):
+        with open(pjoin(src, 'f%d' % i), 'wb') as fh:
+            fh.write(b'x' * (i % 4096))
+
+
+def wl_seqwrite(src, mnt, rec, args):
+    block = args.block_size
+    buf = os.urandom(block)
+
+    fd = os.open(mnt, os.O_CREAT | os.O_WRONLY | os.O_TRUNC, 0o644)
+    try:
+        for off in range(0, args.file_size, block):
+            rec.bytes += rec.timed(os.pwrite, fd, buf, off)
+    finally:
+        rec.timed(os.close, fd)
+
+
+def wl_seqread(src, mnt, rec, args):
+    block = args.block_size
+
+    fd = os.open(mnt, os.O_RDONLY)
+    try:
+        drop_cache(fd)
+        for off in range(0, args.file_size, block):
+            rec.bytes += len(rec.timed(os.pread, fd, block, off))
+    finally:
+        os.close(fd)
+
+
+def wl_randread(src, mnt, rec, args):
+    block = 4096
+    nblocks = args.file_size // block
+    rnd = random.Random(42)
+
+    fd = os.open(mnt, os.O_RDONLY)
+    try:
+        for _ in range(args.random_ops):
+            off = rnd.randrange(nblocks) * block
+            drop_cache(fd, off, block)
+            rec.bytes += len(rec.timed(os.pread, fd, block, off))
+    finally:
+        os.close(fd)
+
+
+def wl_metadata(src, mnt, rec, args):
+    names = [ pjoin(mnt, 'f%d' % i) for i in range(args.files) ]
+    for name in names:
+        fd = rec.timed(os.open, name, os.O_CREAT | os.O_WRONLY, 0o644)
+        os.close(fd)
+    for name in names:
+        rec.timed(os.stat, name)
+    for name in names:
+        rec.timed(os.unlink, name)
+
+
+def wl_readdir(src, mnt, rec, args):
+    # Like 'ls -l', twice to see the effect of caches
+    for _ in range(2):
+        for name in rec.timed(os.listdir, mnt):
+            rec.timed(os.lstat, pjoin(mnt, name))
+
+
+# Setup, which is not timed, and workload functions
+WORKLOAD_FNS = {
+    'seqwrite': (None, wl_seqwrite),
+    'seqread': (setup_file, wl_seqread),
+    'randread': (setup_file, wl_randread),
+    'metadata': (setup_dir, wl_metadata),
+    'readdir': (setup_listing, wl_readdir),
+}
+
+
+def percentile(values, pct):
+    if not values:
+        return 0
+    idx = min(len(values) - 1, int(len(values) * pct / 100))
+    return values[idx]
+
+
+def run_workload(workload, src_dir, mnt_dir, args):
+    setup, fn = WORKLOAD_FNS[workload]
+    recs = [ Recorder() for _ in range(args.jobs) ]
+    srcs = [ pjoin(src_dir, '%s%d' % (workload, i))
+             for i in range(args.jobs) ]
+    errors = []
+
+    def worker(i):
+        src = srcs[i]
+        try:
+            fn(src, pjoin(mnt_dir, os.path.basename(src)), recs[i], args)
+        except OSError as exc:
+            errors.append(exc)
+
+    try:
+        if setup:
+            for src in srcs:
+                setup(src, args)
+        threads = [ threading.Thread(target=worker, args=(i,))
+                    for i in range(args.jobs) ]
+        start = time.perf_counter()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = time.perf_counter() - start
+    finally:
+        for src in srcs:
+            if os.path.isdir(src):
+                shutil.rmtree(src)
+            elif os.path.exists(src):
+                os.unlink(src)
+    if errors:
+        raise errors[0]
+
+    lat = sorted(l for rec in recs for l in rec.lat)
+    nbytes = sum(rec.bytes for rec in recs)
+    return {
+        'ops': len(lat),
+        'seconds': round(elapsed, 3),
+        'ops_per_sec': round(len(lat) / elapsed, 1),
+        'mb_per_sec': round(nbytes / elapsed / 1e6, 1),
+        'latency_us': {
+            'p50': round(percentile(lat, 50) / 1000, 1),
+            'p90': round(percentile(lat, 90) / 1000, 1),
+            'p99': round(percentile(lat, 99) / 1000, 1),
+            'max': round(lat[-1] / 1000, 1) if lat else 0,
+        },
+    }
+
+
+def run_config(config, network, workloads, args):
+    tmpdir = tempfile.mkdtemp(prefix='sshfs-perf-')
+    src_dir = pjoin(tmpdir, 'src')
+    mnt_dir = pjoin(tmpdir, 'mnt')
+    os.mkdir(src_dir)
+    os.mkdir(mnt_dir)
+
+    results = []
+    output = subprocess.DEVNULL if not args.verbose else None
+    mount_process = mount(config, network, src_dir, mnt_dir, args, output)
+    try:
+        for workload in workloads:
+            res = run_workload(workload, src_dir, mnt_dir, args)
+            res.update(network=network, config=config, workload=workload)
+            results.append(res)
+            print('%-9s %-12s %-9s %9.0f ops/s %8.1f MB/s  '
+                  'p50 %9.1f us  p99 %9.1f us'
+                  % (network, config, workload, res['ops_per_sec'],
+                     res['mb_per_sec'], res['latency_us']['p50'],
+                     res['latency_us']['p99']), file=sys.stderr)
+    except BaseException:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+    finally:
+        shutil.rmtree(tmpdir, ignore_errors=True)
+    return results
+
+
+def compare(results, baseline_file):
+    with open(baseline_file) as fh:
+        baseline = json.load(fh)
+    old = { (r['network'], r['config'], r['workload']): r
+            for r in baseline['results'] }
+
+    print('%-9s %-12s %-9s %12s %12s %8s'
+          % ('network', 'config', 'workload', 'ops/s', 'baseline', 'change'))
+    for r in results:
+        b = old.get((r['network'], r['config'], r['workload']))
+        if b is None or not b['ops_per_sec']:
+            continue
+        change = (r['ops_per_sec'] / b['ops_per_sec'] - 1) * 100
+        print('%-9s %-12s %-9s %12.0f %12.0f %+7.1f%%'
+              % (r['network'], r['config'], r['workload'], r['ops_per_sec'],
+                 b['ops_per_sec'], change))
+
+
+def find_sftp_server():
+    for path in SFTP_SERVERS:
+        if os.access(path, os.X_OK):
+            return path
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__.split('\n')[0])
+    parser.add_argument('--sftp-server', default=find_sftp_server(),
+                        help='sftp-server command line (%(default)s)')
+    parser.add_argument('--network', default='0,20/100',
+                        help='comma separated RTT_MS[/MBIT] links '
+                        '(%(default)s)')
+    parser.add_argument('--config', default=','.join(CONFIGS),
+                        help='comma separated sshfs configurations '
+                        '(%(default)s)')
+    parser.add_argument('--options', action='append', default=[],
+                        help='additional sshfs option for all '
+                        'configurations, may be repeated')
+    parser.add_argument('--workload', default=','.join(WORKLOADS),
+                        help='comma separated workloads (%(default)s)')
+    parser.add_argument('--jobs', type=int, default=1,
+                        help='concurrent threads per workload (%(default)s)')
+    parser.add_argument('--files', type=int, default=1000,
+                        help='files per job for metadata and readdir '
+                        '(%(default)s)')
+    parser.add_argument('--file-size', type=int, default=32 << 20,
+                        help='file size in bytes for seqwrite, seqread '
+                        'and randread (%(default)s)')
+    parser.add_argument('--block-size', type=int, default=128 << 10,
+                        help='block size in bytes for seqwrite and '
+                        'seqread (%(default)s)')
+    parser.add_argument('--random-ops', type=int, default=1000,
+                        help='operations per job for randread '
+                        '(%(default)s)')
+    parser.add_argument('--output', help='write JSON results to this file '
+                        'instead of stdout')
+    parser.add_argument('--baseline', help='compare with the JSON results '
+                        'of an earlier run')
+    parser.add_argument('--verbose', action='store_true',
+                        help='show sshfs output')
+    args = parser.parse_args()
+
+    if not args.sftp_server:
+        parser.error('no sftp-server found, use --sftp-server')
+    for workload in args.workload.split(','):
+        if workload not in WORKLOADS:
+            parser.error('unknown workload: %s' % workload)
+    for config in args.config.split(','):
+        if config not in CONFIGS:
+            parser.error('unknown configuration: %s' % config)
+    for network in args.network.split(','):
+        try:
+            parse_network(network)
+        except ValueError:
+            parser.error('invalid network: %s' % network)
+
+    results = []
+    for network in args.network.split(','):
+        for config in args.config.split(','):
+            results += run_config(config, network,
+                                  args.workload.split(','), args)
+
+    report = {
+        'machine': {
+            'system': platform.system(),
+            'release': platform.release(),
+            'machine': platform.machine(),
+            'cpus': os.cpu_count(),
+        },
+        'parameters': {
+            'sftp_server': args.sftp_server,
+            'options': args.options,
+            'jobs': args.jobs,
+            'files': args.files,
+            'file_size': args.file_size,
+            'block_size': args.block_size,
+            'random_ops': args.random_ops,
+        },
+        'results': results,
+    }
+    if args.output:
+        with open(args.output, 'w') as fh:
+            json.dump(report, fh, indent=2)
+    elif not args.baseline:
+        json.dump(report, sys.stdout, indent=2)
+        print()
+    if args.baseline:
+        compare(results, args.baseline)
+
+
+if __name__ == '__main__':
+    if sys.argv[1:2] == [ '--proxy' ]:
+        # The remaining arguments are those that sshfs passes to ssh
+        proxy()
+    else:
+        main()
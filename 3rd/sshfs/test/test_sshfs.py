@@ -13,6 +13,7 @@ import stat
 import shutil
 import filecmp
 import errno
+import time
 from contextlib import contextmanager
 from tempfile import NamedTemporaryFile
 from util import (wait_for_mount, umount, cleanup, base_cmdline,
@@ -92,10 +93,14 @@ def test_sshfs(tmpdir, debug, cache_timeout, sync_rd, multiconn, capfd):
 
         tst_statvfs(mnt_dir)
         tst_readdir(src_dir, mnt_dir)
+        tst_readdir_attrs(src_dir, mnt_dir)
         tst_open_read(src_dir, mnt_dir)
+        tst_readahead(src_dir, mnt_dir)
         tst_open_write(src_dir, mnt_dir)
         tst_append(src_dir, mnt_dir)
         tst_seek(src_dir, mnt_dir)
+        tst_write_coalesce(src_dir, mnt_dir)
+        tst_copy_file_range(src_dir, mnt_dir)
         tst_create(mnt_dir)
         tst_passthrough(src_dir, mnt_dir, cache_timeout)
         tst_mkdir(mnt_dir)
@@ -120,6 +125,103 @@ def test_sshfs(tmpdir, debug, cache_timeout, sync_rd, multiconn, capfd):
     else:
         umount(mount_process, mnt_dir)
 
+def test_sshfs_stripe(tmpdir, capfd):
+    capfd.register_output(r"^Warning: Permanently added 'localhost' .+", count=0)
+
+    mnt_dir = str(tmpdir.mkdir('mnt'))
+    src_dir = str(tmpdir.mkdir('src'))
+
+    # Small stripes, so that TEST_DATA is spread over all connections
+    cmdline = base_cmdline + [ pjoin(basename, 'sshfs'),
+                               '-f', 'localhost:' + src_dir, mnt_dir,
+                               '-o', 'max_conns=3',
+                               '-o', 'stripe_size=4096',
+                               '-o', 'dir_cache=no',
+                               '-o', 'entry_timeout=0',
+                               '-o', 'attr_timeout=0' ]
+
+    new_env = dict(os.environ) # copy, don't modify
+    new_env['G_DEBUG'] = 'fatal-warnings'
+
+    mount_process = subprocess.Popen(cmdline, env=new_env)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+
+        tst_open_read(src_dir, mnt_dir)
+        tst_open_write(src_dir, mnt_dir)
+        tst_append(src_dir, mnt_dir)
+        tst_seek(src_dir, mnt_dir)
+        tst_truncate_path(mnt_dir)
+        tst_truncate_fd(mnt_dir)
+        tst_open_unlink(mnt_dir)
+        tst_stripe(src_dir, mnt_dir)
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+def test_sshfs_data_cache(tmpdir, capfd):
+    capfd.register_output(r"^Warning: Permanently added 'localhost' .+", count=0)
+
+    mnt_dir = str(tmpdir.mkdir('mnt'))
+    src_dir = str(tmpdir.mkdir('src'))
+    cache_dir = str(tmpdir.mkdir('cache'))
+
+    cmdline = base_cmdline + [ pjoin(basename, 'sshfs'),
+                               '-f', 'localhost:' + src_dir, mnt_dir,
+                               '-o', 'data_cache=' + cache_dir,
+                               '-o', 'dir_cache=no',
+                               '-o', 'entry_timeout=0',
+                               '-o', 'attr_timeout=0' ]
+
+    new_env = dict(os.environ) # copy, don't modify
+    new_env['G_DEBUG'] = 'fatal-warnings'
+
+    name = name_generator()
+    data = os.urandom(200 * 1024 + 1234)
+    with open(pjoin(src_dir, name), 'wb') as fh:
+        fh.write(data)
+
+    # The cache is kept across mounts
+    for first in (True, False):
+        mount_process = subprocess.Popen(cmdline, env=new_env)
+        try:
+            wait_for_mount(mount_process, mnt_dir)
+            data = tst_data_cache(src_dir, mnt_dir, cache_dir, name, data,
+                                  first)
+        except:
+            cleanup(mount_process, mnt_dir)
+            raise
+        else:
+            umount(mount_process, mnt_dir)
+
+    # A mount of another directory that shares the cache directory must
+    # not see these blocks, even for a file with the same name, size and
+    # modification time
+    src2_dir = str(tmpdir.mkdir('src2'))
+    data2 = os.urandom(len(data))
+    with open(pjoin(src2_dir, name), 'wb') as fh:
+        fh.write(data2)
+    st = os.stat(pjoin(src_dir, name))
+    os.utime(pjoin(src2_dir, name), ns=(st.st_atime_ns, st.st_mtime_ns))
+    cmdline[cmdline.index('localhost:' + src_dir)] = 'localhost:' + src2_dir
+    mount_process = subprocess.Popen(cmdline, env=new_env)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        with open(pjoin(mnt_dir, name), 'rb') as fh:
+            assert fh.read() == data2
+        assert len(os.listdir(cache_dir)) == 2
+
+        # Removing the file drops its directory
+        os.unlink(pjoin(mnt_dir, name))
+        assert len(os.listdir(cache_dir)) == 1
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
 @contextmanager
 def os_open(name, flags):
     fd = os.open(name, flags)
@@ -224,6 +326,30 @@ def tst_open_read(src_dir, mnt_dir):
 
     assert filecmp.cmp(pjoin(mnt_dir, name), TEST_FILE, False)
 
+def tst_readahead(src_dir, mnt_dir):
+    name = name_generator()
+    data = os.urandom(3 * 1024 * 1024 + 1234)
+    with open(pjoin(src_dir, name), 'wb') as fh:
+        fh.write(data)
+
+    fullname = pjoin(mnt_dir, name)
+    with os_open(fullname, os.O_RDWR) as fd:
+        # Sequential reads open the read-ahead window, a random read
+        # closes it again
+        for off in range(0, len(data), 65536):
+            assert os.pread(fd, 65536, off) == data[off:off+65536]
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+        assert os.pread(fd, 4096, 1000000) == data[1000000:1004096]
+        for off in range(0, 1024 * 1024, 65536):
+            assert os.pread(fd, 65536, off) == data[off:off+65536]
+
+        # Data that was read ahead must not survive a write
+        os.pwrite(fd, b'x' * 4096, 1024 * 1024 + 8192)
+        data = data[:1024*1024+8192] + b'x' * 4096 + data[1024*1024+12288:]
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+        for off in range(1024 * 1024, len(data), 65536):
+            assert os.pread(fd, 65536, off) == data[off:off+65536]
+
 def tst_open_write(src_dir, mnt_dir):
     name = name_generator()
     fd = os.open(pjoin(src_dir, name),
@@ -262,6 +388,64 @@ def tst_seek(src_dir, mnt_dir):
     with open(fullname, 'rb') as fh:
         assert fh.read() == b'\0foocom\n'
 
+def tst_write_coalesce(src_dir, mnt_dir):
+    name = name_generator()
+    fullname = pjoin(mnt_dir, name)
+    data = os.urandom(300 * 1024)
+
+    with os_open(fullname, os.O_CREAT | os.O_RDWR) as fd:
+        for off in range(0, len(data), 4096):
+            os.pwrite(fd, data[off:off+4096], off)
+        # Out of order writes are not merged with the buffered ones
+        os.pwrite(fd, b'x' * 100, 10)
+        data = data[:10] + b'x' * 100 + data[110:]
+        assert os.fstat(fd).st_size == len(data)
+        assert os.pread(fd, len(data), 0) == data
+
+        # Buffered writes reach the server without a flush
+        os.pwrite(fd, b'y' * 10, len(data))
+        data += b'y' * 10
+        time.sleep(1)
+        with open(pjoin(src_dir, name), 'rb') as fh:
+            assert fh.read() == data
+
+        # The buffer is found by path, also after a rename
+        name = name_generator()
+        os.rename(fullname, pjoin(mnt_dir, name))
+        fullname = pjoin(mnt_dir, name)
+        os.pwrite(fd, b'z' * 10, len(data))
+        data += b'z' * 10
+        assert os.stat(fullname).st_size == len(data)
+        with open(fullname, 'rb') as fh:
+            assert fh.read() == data
+
+    with open(pjoin(src_dir, name), 'rb') as fh:
+        assert fh.read() == data
+
+def tst_copy_file_range(src_dir, mnt_dir):
+    name_in = name_generator()
+    name_out = name_generator()
+    data = os.urandom(1024 * 1024 + 1234)
+    with open(pjoin(src_dir, name_in), 'wb') as fh:
+        fh.write(data)
+    os_create(pjoin(src_dir, name_out))
+
+    with os_open(pjoin(mnt_dir, name_in), os.O_RDONLY) as fd_in, \
+         os_open(pjoin(mnt_dir, name_out), os.O_WRONLY) as fd_out:
+        copied = 0
+        while copied < len(data):
+            res = os.copy_file_range(fd_in, fd_out, len(data),
+                                     copied, 4096 + copied)
+            assert res > 0
+            copied += res
+        # Nothing is copied past the end of the source
+        assert os.copy_file_range(fd_in, fd_out, 100, len(data)) == 0
+
+    with open(pjoin(src_dir, name_out), 'rb') as fh:
+        assert fh.read() == b'\0' * 4096 + data
+    with open(pjoin(mnt_dir, name_out), 'rb') as fh:
+        assert fh.read() == b'\0' * 4096 + data
+
 def tst_open_unlink(mnt_dir):
     name = pjoin(mnt_dir, name_generator())
     data1 = b'foo'
@@ -340,6 +524,29 @@ def tst_readdir(src_dir, mnt_dir):
     os.rmdir(subdir)
     os.rmdir(src_newdir)
 
+def tst_readdir_attrs(src_dir, mnt_dir):
+    newdir = name_generator()
+    src_newdir = pjoin(src_dir, newdir)
+    mnt_newdir = pjoin(mnt_dir, newdir)
+    os.mkdir(src_newdir)
+    # More entries than libfuse buffers in its first window
+    for i in range(1500):
+        with open(pjoin(src_newdir, 'f%d' % i), 'wb') as fh:
+            fh.write(b'x' * (i % 37))
+    os.symlink('f1', pjoin(src_newdir, 'link'))
+
+    # Sizes include writes that are still buffered
+    with os_open(pjoin(mnt_newdir, 'f0'), os.O_WRONLY) as fd:
+        os.pwrite(fd, b'y' * 100, 0)
+        sizes = { e.name: e.stat(follow_symlinks=False).st_size
+                  for e in os.scandir(mnt_newdir) }
+    assert sizes['f0'] == 100
+    for i in range(1, 1500):
+        assert sizes['f%d' % i] == i % 37
+    assert len(sizes) == 1501
+
+    shutil.rmtree(src_newdir)
+
 def tst_truncate_path(mnt_dir):
     assert len(TEST_DATA) > 1024
 
@@ -388,6 +595,77 @@ def tst_truncate_fd(mnt_dir):
         fh.seek(0)
         assert fh.read(size) == TEST_DATA[:size-1024]
 
+def tst_stripe(src_dir, mnt_dir):
+    name = name_generator()
+    fullname = pjoin(mnt_dir, name)
+    data = os.urandom(1024 * 1024)
+
+    # Writes that are still in flight on other connections must be
+    # visible to fstat() and ftruncate()
+    with os_open(fullname, os.O_CREAT | os.O_RDWR) as fd:
+        for off in range(0, len(data), 10000):
+            os.pwrite(fd, data[off:off+10000], off)
+            assert os.fstat(fd).st_size == min(off + 10000, len(data))
+        assert os.pread(fd, len(data), 0) == data
+        os.ftruncate(fd, 5000)
+        assert os.fstat(fd).st_size == 5000
+
+    with open(pjoin(src_dir, name), 'rb') as fh:
+        assert fh.read() == data[:5000]
+
+def tst_data_cache(src_dir, mnt_dir, cache_dir, name, data, first):
+    fullname = pjoin(mnt_dir, name)
+    if first:
+        with open(fullname, 'rb') as fh:
+            assert fh.read() == data
+        (hashdir,) = os.listdir(cache_dir)
+        (gen,) = os.listdir(pjoin(cache_dir, hashdir))
+        blocks = os.listdir(pjoin(cache_dir, hashdir, gen))
+        assert sorted(blocks) == [ '0', '1', '2', '3', 'info' ]
+
+        # Nothing is stored for files that are opened but not read
+        with open(pjoin(src_dir, name + 'e'), 'wb') as fh:
+            fh.write(b'e' * 5000)
+        with open(fullname + 'e', 'rb') as fh:
+            pass
+        os.unlink(pjoin(src_dir, name + 'e'))
+        assert os.listdir(cache_dir) == [ hashdir ]
+
+    # Changes that keep the size and modification time are not noticed,
+    # so the data must come from the cache
+    st = os.stat(pjoin(src_dir, name))
+    with open(pjoin(src_dir, name), 'r+b') as fh:
+        fh.write(b'x' * 4096)
+    os.utime(pjoin(src_dir, name), ns=(st.st_atime_ns, st.st_mtime_ns))
+    with open(fullname, 'rb') as fh:
+        assert fh.read() == data
+    with open(fullname, 'rb') as fh:
+        fh.seek(100000)
+        assert fh.read(50000) == data[100000:150000]
+
+    # A different modification time drops the blocks
+    os.utime(pjoin(src_dir, name), ns=(st.st_atime_ns,
+                                       st.st_mtime_ns - 10**10))
+    data = b'x' * 4096 + data[4096:]
+    with open(fullname, 'rb') as fh:
+        assert fh.read() == data
+
+    # So does a write through the mount, also for handles that were
+    # opened before and must now read past the old end of the file
+    with open(fullname, 'rb') as fh:
+        assert fh.read(4096) == data[:4096]
+        with open(fullname, 'r+b') as fh2:
+            fh2.seek(70000)
+            fh2.write(b'y' * 4096)
+            fh2.seek(len(data))
+            fh2.write(b'z' * 10000)
+        data = data[:70000] + b'y' * 4096 + data[74096:] + b'z' * 10000
+        fh.seek(len(data) - 15000)
+        assert fh.read() == data[-15000:]
+    with open(fullname, 'rb') as fh:
+        assert fh.read() == data
+    return data
+
 def tst_utimens(mnt_dir, tol=0):
     filename = pjoin(mnt_dir, name_generator())
     os.mkdir(filename)